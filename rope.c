@@ -1,28 +1,219 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "rope.h"
 
 #define is_leaf_node(n) (!(n)->left && !(n)->right)
+#define is_continuation(c) (((unsigned char)(c) & 0xC0) == 0x80)
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+#define ROPE_ARENA_SLAB_SIZE (64*1024)
+#define ROPE_MAP_SPAN (64*1024)     // bytes of a mapped file per leaf
+#define ROPE_FIND_WINDOW 4096       // leaves shorter than ROPE_FIND_COPY are searched in batches this big
+#define ROPE_FIND_COPY 256
+#define ROPE_POOL_TASKS 4           // work ranges per thread, so stealing can even out the load
+#define ROPE_POOL_MIN_RANGE (256*1024)  // ranges smaller than this aren't worth a thread
+#define ROPE_INLINE_MAX 23          // longest text stored in the same allocation as its leaf
+#define ROPE_SLICE_PIN 65536        // substrings pinning more than this many times their length are built eagerly
+#define ROPE_BUILDER_CHUNK 4096     // size of the chunks rope_builder_push_copy fills
+#define ROPE_COMPRESS_MAX 16384     // largest compressed leaf, the size of a decompression buffer
+#define ROPE_LZ_HASH_BITS 12
+#define ROPE_LZ_MIN_MATCH 4
+#define ROPE_COMPACT_EDITS 64       // edits between compaction checks, at least, and nodes walked per edit by them, at most
+#define ROPE_HASH_MOD ((UINT64_C(1) << 61) - 1)   // a Mersenne prime, so reduction is a shift and an add
+#define ROPE_HASH_BASE UINT64_C(0x1d8e4e27c47d124f)
+#define ROPE_HASH_BASE2 UINT64_C(0x1d03dfb44e69cae0)   // its powers, mod ROPE_HASH_MOD
+#define ROPE_HASH_BASE3 UINT64_C(0x11fab20cc99e753d)
+#define ROPE_HASH_BASE4 UINT64_C(0x07cb34476851b462)
+
+struct rope_slab {
+    struct rope_slab *next;
+    size_t used;
+    size_t size;
+    max_align_t mem[];
+};
+
+struct rope_arena {
+    struct rope_slab *slabs;    // the first slab is the one being filled
+    size_t slab_size;
+};
+
+struct rope_mapping {
+    char *addr;
+    size_t length;
+    int refs;       // nodes pointing into the mapping
+    struct rope_node *nodes;    // the block of nodes rope_load built over it, freed with it
+};
+
+/** Create an arena to allocate a family of ropes from
+    Ropes in an arena are never freed one at a time; rope_arena_reset releases
+    every rope allocated from it at once.
+    @param slab_size Bytes to reserve at a time, or 0 for the default
+    @return A new, empty arena, or NULL on error
+*/
+struct rope_arena *new_rope_arena(size_t slab_size)
+{
+    struct rope_arena *a;
+    if ((a = (struct rope_arena *)malloc(sizeof(struct rope_arena))) == NULL)
+        return NULL;
+    a->slabs = NULL;
+    a->slab_size = slab_size ? slab_size : ROPE_ARENA_SLAB_SIZE;
+    return a;
+}
+
+/** Release every rope allocated from a, keeping one slab around for reuse
+*/
+void rope_arena_reset(struct rope_arena *a)
+{
+    struct rope_slab *s, *next;
+    if (!a || !a->slabs)
+        return;
+    for (s = a->slabs->next; s; s = next) {
+        next = s->next;
+        free(s);
+    }
+    a->slabs->next = NULL;
+    a->slabs->used = 0;
+}
+
+void free_rope_arena(struct rope_arena *a)
+{
+    if (!a)
+        return;
+    rope_arena_reset(a);
+    free(a->slabs);
+    free(a);
+}
+
+/** Allocate size bytes from a, or from the heap if a is NULL
+*/
+static void *rope_alloc(struct rope_arena *a, size_t size)
+{
+    struct rope_slab *s;
+    void *p;
+    if (!a)
+        return malloc(size);
+    size = (size + sizeof(max_align_t)-1) & ~(sizeof(max_align_t)-1);
+    if (!(s = a->slabs) || s->used + size > s->size) {
+        size_t slab_size = MAX(size, a->slab_size);
+        if ((s = (struct rope_slab *)malloc(sizeof(struct rope_slab) + slab_size)) == NULL)
+            return NULL;
+        s->used = 0;
+        s->size = slab_size;
+        if (slab_size > a->slab_size && a->slabs) {     // keep filling the current slab
+            s->next = a->slabs->next;
+            a->slabs->next = s;
+        } else {
+            s->next = a->slabs;
+            a->slabs = s;
+        }
+    }
+    p = (char *)s->mem + s->used;
+    s->used += size;
+    return p;
+}
+
+/** Release memory from rope_alloc. Arena memory is only released by a reset.
+*/
+static void rope_free(struct rope_arena *a, void *p)
+{
+    if (!a)
+        free(p);
+}
+
+static struct rope *alloc_rope(struct rope_arena *a)
+{
+    struct rope *r;
+    if ((r = (struct rope *)rope_alloc(a, sizeof(struct rope))) == NULL)
+        return NULL;
+    r->head = NULL;
+    r->arena = a;
+    r->until_check = 0;
+    return r;
+}
+
+static struct rope_node *arena_rope_node(struct rope_arena *a, int64_t weight, struct rope_node *left,
+                                         struct rope_node *right, char *data);
+static struct rope_node *init_rope_node(struct rope_node *ret, struct rope_arena *a, int64_t weight,
+                                        struct rope_node *left, struct rope_node *right, char *data);
+static struct rope_node *build_balanced(struct rope_arena *a, struct rope_node **leaves, int count);
+static struct rope_node *concat_consume(struct rope_arena *a, struct rope_node *l, struct rope_node *r);
+static struct rope_node *substring_node(struct rope_arena *a, struct rope_node *n, int64_t lo, int64_t hi);
+static struct rope_node *rebalance_node(struct rope_arena *a, struct rope_node *n, int chunk_size);
+static struct rope *after_edit(struct rope *from, struct rope *r);
+
+static struct rope_mapping *ref_mapping(struct rope_mapping *m)
+{
+    if (m)
+        __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    return m;
+}
+
+/** Drop a reference to m, unmapping the file once no leaf points into it
+*/
+static void free_rope_mapping(struct rope_mapping *m)
+{
+    if (!m || __atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    munmap(m->addr, m->length);
+    free(m->nodes);
+    free(m);
+}
+
+/** Take another reference to n
+    Reference counts are atomic, since readers of a rope_handle snapshot may
+    share its nodes with the writer's edits.
+    @return n
+*/
+static struct rope_node *ref_node(struct rope_node *n)
+{
+    if (n)
+        __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+    return n;
+}
+
+/** Drop a reference to n, freeing it once nothing refers to it any more
+    @param free_strings Whether to also free the strings of leaves that are freed
+*/
 void free_rope_node(struct rope_node *n, bool free_strings)
 {
-    if (!n)
+    if (!n || n->flags & ROPE_NODE_ARENA || __atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) > 0)
         return;
+    bool loaded = n->flags & ROPE_NODE_LOADED;
     free_rope_node(n->left, free_strings);
     free_rope_node(n->right, free_strings);
-    if (n->data && free_strings)
+    if (n->mapping)
+        free_rope_mapping(n->mapping);  // frees n too, with the last of its block
+    else if (n->data && !(n->flags & ROPE_NODE_INLINE) && (free_strings || n->flags & ROPE_NODE_OWNED))
         free(n->data);
-    free(n);
+    if (!loaded)
+        free(n);
 }
 
 void free_rope(struct rope *r, bool free_strings)
 {
-    if (!r)
+    if (!r || r->arena)
         return;
     free_rope_node(r->head, free_strings);
     free(r);
@@ -30,12 +221,7 @@ void free_rope(struct rope *r, bool free_strings)
 
 struct rope_node *new_rope_node(char *s)
 {
-  struct rope_node *n = (struct rope_node *)malloc(sizeof(struct rope_node));
-  n->data = s;
-  n->left = NULL;
-  n->right = NULL;
-  n->weight = strlen(s);
-  return n;
+    return alloc_rope_node(strlen(s), NULL, NULL, s);
 }
 
 /** Create a new rope containing the given string
@@ -44,301 +230,3742 @@ struct rope_node *new_rope_node(char *s)
 */ 
 struct rope *new_rope(char *s)
 {
-    struct rope *r =  (struct rope *)malloc(sizeof(struct rope));
+    return new_arena_rope(NULL, s);
+}
+
+/** Create a new rope containing the given string, allocated from an arena
+    Ropes derived from it with concatenation, substrings and so on are
+    allocated from the same arena.
+    @param a The arena to allocate from, or NULL for the heap
+    @return A new rope, or NULL on error
+*/
+struct rope *new_arena_rope(struct rope_arena *a, char *s)
+{
+    struct rope *r = alloc_rope(a);
     if (!r)
         return NULL;
-    r->head = strcmp(s, "") ? new_rope_node(s) : NULL;
+    if (strcmp(s, "") && (r->head = arena_rope_node(a, strlen(s), NULL, NULL, s)) == NULL) {
+        rope_free(a, r);
+        return NULL;
+    }
+    return r;
+}
+
+/** Create a rope over the contents of a file without reading it
+    The file is mapped read-only and split into leaves of ROPE_MAP_SPAN bytes
+    that point straight into the mapping, so the text may contain NUL bytes and
+    pages are only read in as they are touched. The mapping lives until the
+    last leaf pointing into it is freed; the file must not be truncated before then.
+    @return A new rope, or NULL with errno set on error
+*/
+struct rope *rope_from_file(const char *path)
+{
+    struct rope *r;
+    struct rope_mapping *m;
+    struct rope_node **leaves;
+    struct stat st;
+    int fd, err;
+    int64_t count;
+    void *addr;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || (r = alloc_rope(NULL)) == NULL) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return r;
+    }
+    if ((uint64_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        free(r);
+        errno = EFBIG;
+        return NULL;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = errno;
+    close(fd);  // the mapping keeps the file open
+    if (addr == MAP_FAILED) {
+        free(r);
+        errno = err;
+        return NULL;
+    }
+    count = (st.st_size + ROPE_MAP_SPAN-1) / ROPE_MAP_SPAN;
+    if ((m = (struct rope_mapping *)malloc(sizeof(struct rope_mapping))) == NULL
+        || (leaves = (struct rope_node **)malloc(sizeof(*leaves)*count)) == NULL) {
+        free(m);
+        free(r);
+        munmap(addr, st.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    m->addr = addr;
+    m->length = st.st_size;
+    m->refs = 1;    // held while the leaves are built
+    m->nodes = NULL;
+    for (int64_t i = 0; i < count; ++i) {
+        int64_t lo = i*ROPE_MAP_SPAN, hi = MIN((int64_t)st.st_size, lo+ROPE_MAP_SPAN);
+        if ((leaves[i] = alloc_rope_node(hi-lo, NULL, NULL, m->addr+lo)) == NULL) {
+            while (i--)
+                free_rope_node(leaves[i], false);
+            free(leaves);
+            free(r);
+            free_rope_mapping(m);
+            errno = ENOMEM;
+            return NULL;
+        }
+        leaves[i]->mapping = ref_mapping(m);
+    }
+    r->head = build_balanced(NULL, leaves, count);
+    free(leaves);
+    free_rope_mapping(m);
     return r;
 }
 
-static int node_weight(struct rope_node *n)
+static int64_t node_weight(struct rope_node *n)
 {
   return n ? n->weight : 0;
 }
 
-struct rope_node *new_rope_nodev(int argc, char **args)
+static int node_depth(struct rope_node *n)
 {
-    struct rope_node *r = (struct rope_node *)malloc(sizeof(struct rope_node));
-    if (argc == 1) {
-        r->left = NULL;
-        r->right = NULL;
-        r->weight = strlen(*args);
-        r->data = *args;
-    } else {
-        int args_remaining = argc/2;
-        r->left = new_rope_nodev(args_remaining, args);
-        r->right = new_rope_nodev(args_remaining, args+args_remaining);
-        r->weight = r->left->weight + r->right->weight;
-        r->data = NULL;
-    }
-    return r;
+    return n ? n->depth : 0;
 }
 
-/** Create a new rope, with a variable number of arguments
-    @param argc The number of arguments this function is passing.
-    
+/** Count the newlines in s[0, len), a vector at a time where available
 */
-struct rope *new_ropev(int argc, ...)
+static int64_t count_newlines(const char *s, int64_t len)
 {
-    va_list ap;
-    int i = log(argc)/log(2);
-    if (i % 2 != 0 && i != 1) {
-        return NULL;
+    int64_t count = 0, i = 0;
+#if defined(__AVX2__)
+    __m256i nl = _mm256_set1_epi8('\n'), zero = _mm256_setzero_si256();
+    while (i + 32 <= len) {
+        __m256i acc = zero;     // a count per byte lane, summed before it can wrap
+        for (int n = 0; n < 255 && i + 32 <= len; ++n, i += 32)
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s+i)), nl));
+        acc = _mm256_sad_epu8(acc, zero);
+        __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        count += _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
     }
-    i = argc;
-    va_start(ap, argc);
-    char **args = (char **)malloc(argc*sizeof(char *));
-    char **p = args;
-    while (i--) {
-        *p++ = va_arg(ap, char *);
+#elif defined(__SSE2__)
+    __m128i nl = _mm_set1_epi8('\n'), zero = _mm_setzero_si128();
+    while (i + 16 <= len) {
+        __m128i acc = zero;     // a count per byte lane, summed before it can wrap
+        for (int n = 0; n < 255 && i + 16 <= len; ++n, i += 16)
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s+i)), nl));
+        acc = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(acc) + _mm_extract_epi16(acc, 4);
     }
-    p = args;
-    struct rope *r = (struct rope *)malloc(sizeof(struct rope));
-    r->head = new_rope_nodev(argc, p);
-
-    va_end(ap);
-    free(args);
-    return r;
+#endif
+    for (; i < len; ++i)
+        count += s[i] == '\n';
+    return count;
 }
 
-static bool is_rope_node(struct rope_node *n)
+/** Count the UTF-8 code points in s[0, len), a vector at a time where available
+    Every byte but a continuation byte (10xxxxxx) starts a code point, so
+    counts of adjacent pieces add up even when a sequence spans both.
+*/
+static int64_t count_codepoints(const char *s, int64_t len)
 {
-    if (!n)
-        return true;
-    if (n->left || n->right) {  // concatenation node
-        if (n->data || !n->left || !n->right)            // can't have any data
-            return false;
-        int weight = node_weight(n->left) + node_weight(n->right);
-        if (weight != n->weight) // weight must equal the same as both subtrees
-            return false;
-        return is_rope_node(n->left) && is_rope_node(n->right);  // left and right subtrees must be ropes
-    } else if (!n->left && !n->right) {
-
+    int64_t count = len, i = 0;
+#if defined(__AVX2__)
+    __m256i top = _mm256_set1_epi8(-64), zero = _mm256_setzero_si256();    // continuations are below 0xC0 as signed
+    while (i + 32 <= len) {
+        __m256i acc = zero;
+        for (int n = 0; n < 255 && i + 32 <= len; ++n, i += 32)
+            acc = _mm256_sub_epi8(acc, _mm256_cmpgt_epi8(top, _mm256_loadu_si256((const __m256i *)(s+i))));
+        acc = _mm256_sad_epu8(acc, zero);
+        __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        count -= _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
     }
-    // leaf node
-    return n->data && n->weight == strlen(n->data) ? true : false;
+#elif defined(__SSE2__)
+    __m128i top = _mm_set1_epi8(-64), zero = _mm_setzero_si128();      // continuations are below 0xC0 as signed
+    while (i + 16 <= len) {
+        __m128i acc = zero;
+        for (int n = 0; n < 255 && i + 16 <= len; ++n, i += 16)
+            acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(top, _mm_loadu_si128((const __m128i *)(s+i))));
+        acc = _mm_sad_epu8(acc, zero);
+        count -= _mm_cvtsi128_si32(acc) + _mm_extract_epi16(acc, 4);
+    }
+#endif
+    for (; i < len; ++i)
+        count -= is_continuation(s[i]);
+    return count;
 }
 
-bool is_rope(struct rope *r)
+/* Compressed leaves hold their text as a packed length followed by LZ77
+   sequences in the style of LZ4: a token byte with the literal count in its
+   high nibble and the match length less ROPE_LZ_MIN_MATCH in its low one,
+   each continued in bytes of 255 when it is 15, then the literals, then a
+   two byte little-endian offset back to the match. The last sequence is
+   literals alone. */
+
+static uint32_t lz_hash(const char *p)
 {
-    return !r || is_rope_node(r->head);
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v * 2654435761u >> (32 - ROPE_LZ_HASH_BITS);
 }
 
-char rope_index(struct rope *r, int index)
+static char *lz_put_length(char *op, int64_t length)
 {
-    if (!r || !r->head)
-        return -1;
-    struct rope_node *n = r->head;
-    while (n) {
-        if (n->left && n->right) {          // concatenation node
-            if (index < n->left->weight) {  // in left subtree
-                n = n->left;
-            } else {
-                index -= n->left->weight;   // if in right subtree, subtract weight of left subtree
-                n = n->right;
-            }
-        } else { // leaf node
-            return index < 0 || index >= n->weight ? -1 : n->data[index];
+    for (; length >= 255; length -= 255)
+        *op++ = (char)255;
+    *op++ = (char)length;
+    return op;
+}
+
+/** Compress s[0, len), len at most ROPE_COMPRESS_MAX, into out
+    @return the compressed length, or 0 if it would not fit in cap bytes
+*/
+static int64_t lz_compress(const char *s, int64_t len, char *out, int64_t cap)
+{
+    uint16_t table[1 << ROPE_LZ_HASH_BITS] = { 0 };    // last position + 1 with each hash
+    char *op = out, *end = out + cap;
+    int64_t i = 0, anchor = 0;
+    while (i + ROPE_LZ_MIN_MATCH <= len) {
+        uint32_t h = lz_hash(s+i);
+        int64_t candidate = (int64_t)table[h] - 1, match = 0;
+        table[h] = (uint16_t)(i+1);
+        if (candidate >= 0 && !memcmp(s+candidate, s+i, ROPE_LZ_MIN_MATCH)) {
+            match = ROPE_LZ_MIN_MATCH;
+            while (i + match < len && s[candidate+match] == s[i+match])
+                match++;
         }
+        if (!match) {
+            i++;
+            continue;
+        }
+        int64_t literals = i - anchor;
+        // a token, two offset bytes and the length bytes, at most
+        if (end - op < 3 + literals + literals/255 + 1 + (match-ROPE_LZ_MIN_MATCH)/255 + 1)
+            return 0;
+        char *token = op++;
+        *token = (char)((literals < 15 ? literals : 15) << 4);
+        if (literals >= 15)
+            op = lz_put_length(op, literals - 15);
+        memcpy(op, s+anchor, literals);
+        op += literals;
+        *op++ = (char)((i-candidate) & 0xFF);
+        *op++ = (char)((i-candidate) >> 8);
+        *token |= (char)(match-ROPE_LZ_MIN_MATCH < 15 ? match-ROPE_LZ_MIN_MATCH : 15);
+        if (match-ROPE_LZ_MIN_MATCH >= 15)
+            op = lz_put_length(op, match-ROPE_LZ_MIN_MATCH - 15);
+        i += match;
+        anchor = i;
     }
-    return -1;  // no such node
+    int64_t literals = len - anchor;
+    if (end - op < 1 + literals + literals/255 + 1)
+        return 0;
+    *op++ = (char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15)
+        op = lz_put_length(op, literals - 15);
+    memcpy(op, s+anchor, literals);
+    return op + literals - out;
 }
 
-int rope_length(struct rope *r)
+/** Read a length continued in bytes of 255 at *ip, stopping at end
+    @return false if the input runs out first
+*/
+static bool lz_get_length(const unsigned char **ip, const unsigned char *end, int64_t *length)
 {
-    return r && r->head ? r->head->weight : 0;
+    unsigned char c;
+    do {
+        if (*ip >= end)
+            return false;
+        *length += c = *(*ip)++;
+    } while (c == 255);
+    return true;
 }
 
-bool rope_node_equal(struct rope_node *n1, struct rope_node *n2)
+/** Decompress in[0, in_len) into exactly len bytes at out
+    @return false if the input is malformed
+*/
+static bool lz_decompress(const char *in, int64_t in_len, char *out, int64_t len)
 {
-    int weight;
-    char *s, *p;
-    if (!n1 && !n2)
-        return true;
-    if (is_leaf_node(n1) || is_leaf_node(n2)) {
-        if (is_leaf_node(n1) != is_leaf_node(n2))
+    const unsigned char *ip = (const unsigned char *)in, *end = ip + in_len;
+    int64_t op = 0;
+    while (ip < end) {
+        unsigned token = *ip++;
+        int64_t literals = token >> 4, match = token & 15;
+        if (literals == 15 && !lz_get_length(&ip, end, &literals))
             return false;
-        if (n1->weight != n2->weight)
+        if (literals > end - ip || literals > len - op)
             return false;
-        weight = n1->weight;
-        p = n1->data, s = n2->data;
-        while (weight--)
-            if (*p++ != *s++)
-                return false;
-        return true;
+        memcpy(out+op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == end)
+            break;
+        if (end - ip < 2)
+            return false;
+        int64_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (match == 15 && !lz_get_length(&ip, end, &match))
+            return false;
+        match += ROPE_LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match > len - op)
+            return false;
+        if (offset >= match) {
+            memcpy(out+op, out+op-offset, match);
+        } else {
+            for (int64_t j = 0; j < match; ++j)     // the match overlaps what it copies
+                out[op+j] = out[op+j-offset];
+        }
+        op += match;
     }
-    if (n1->weight != n2->weight)
-        return false;
-    return rope_node_equal(n1->left, n2->left) && rope_node_equal(n1->right, n2->right);
+    return op == len;
 }
 
-bool rope_equal(struct rope *r1, struct rope *r2)
+/* Each thread decompresses leaves into a few buffers of its own, reused
+   least recently used first, so reading a compressed leaf again soon after
+   costs nothing and readers never contend. */
+struct leaf_cache {
+    uint64_t ids[ROPE_LEAF_CACHE];  // ids of the leaves held, 0 for none
+    uint64_t used[ROPE_LEAF_CACHE];
+    uint64_t clock;
+    char text[ROPE_LEAF_CACHE][ROPE_COMPRESS_MAX];
+};
+
+static _Thread_local struct leaf_cache leaf_cache;
+static uint64_t rope_leaf_ids = 0;  // the last id handed to a compressed leaf
+
+/** Decompress a compressed leaf into this thread's cache
+    @return its text, or NULL if it is malformed
+*/
+static const char *try_unpack_leaf(struct rope_node *n)
 {
-    return rope_node_equal(r1->head, r2->head);
+    struct leaf_cache *c = &leaf_cache;
+    uint64_t id = (uint64_t)n->offset;
+    int slot = 0;
+    for (int i = 0; i < ROPE_LEAF_CACHE; ++i) {
+        if (c->ids[i] == id) {
+            c->used[i] = ++c->clock;
+            return c->text[i];
+        }
+        if (c->used[i] < c->used[slot])
+            slot = i;
+    }
+    int64_t packed;
+    memcpy(&packed, n->data, sizeof(packed));
+    if (n->weight > ROPE_COMPRESS_MAX || !lz_decompress(n->data + sizeof(packed), packed, c->text[slot], n->weight)) {
+        c->ids[slot] = 0;
+        return NULL;
+    }
+    c->ids[slot] = id;
+    c->used[slot] = ++c->clock;
+    return c->text[slot];
 }
 
-struct rope_node *copy_rope_node(struct rope_node *n)
+/** Decompress a compressed leaf into this thread's cache
+    Compressed leaves are only ever built by compress_node from text it has
+    just packed, so one that doesn't unpack means memory was corrupted, and
+    there is nothing sensible to return; this aborts rather than hand every
+    reader a NULL to check. is_rope checks them with try_unpack_leaf instead.
+    @return its text
+*/
+static const char *unpack_leaf(struct rope_node *n)
 {
-    if (!n)
-        return NULL;
-    struct rope_node *ret = (struct rope_node *)malloc(sizeof(struct rope_node));
-    ret->left = copy_rope_node(n->left);
-    ret->right = copy_rope_node(n->right);
-    ret->data = n->data;
-    ret->weight = ret->data ? strlen(ret->data) : ret->left->weight + ret->right->weight;
-    return ret;
+    const char *text = try_unpack_leaf(n);
+    if (!text)
+        abort();
+    return text;
 }
 
-struct rope *rope_copy(struct rope *r)
+/** The text of leaf n, decompressing it first if it is compressed
+    Text decompressed this way stays valid until ROPE_LEAF_CACHE - 1 other
+    compressed leaves have been read on this thread.
+*/
+static inline const char *leaf_text(struct rope_node *n)
 {
-    struct rope *ret = (struct rope *)malloc(sizeof(struct rope));
-    ret->head = copy_rope_node(r->head);
-    if (r->head && !ret->head) {
-        free(ret);
-        return NULL;
-    }
-    return ret;
+    return n->flags & ROPE_NODE_COMPRESSED ? unpack_leaf(n) : n->data;
 }
 
-struct rope *rope_concat(struct rope *r1, struct rope *r2)
+static uint64_t pointer_hash(const void *p)
 {
-    if (!r1 || !r2)
-        return NULL;
-    if (!r1->head)
-        return rope_copy(r2);
-    if (!r2->head)
-        return rope_copy(r1);
-    struct rope *r;
-    if ((r = (struct rope *)malloc(sizeof(struct rope))) == NULL)
-        return NULL;
-    if ((r->head = alloc_rope_node(r1->head->weight+r2->head->weight, r1->head, r2->head, NULL)) == NULL) {
-        free(r);
-        return NULL;
-    }
-    return r;
+    return (uintptr_t)p * 0x9E3779B97F4A7C15ull >> 20;
+}
+
+/** Reduce x < 2^122 modulo ROPE_HASH_MOD
+*/
+static uint64_t hash_reduce(unsigned __int128 x)
+{
+    uint64_t r = (uint64_t)(x & ROPE_HASH_MOD) + (uint64_t)(x >> 61);
+    r = (r & ROPE_HASH_MOD) + (r >> 61);
+    return r >= ROPE_HASH_MOD ? r - ROPE_HASH_MOD : r;
 }
 
-void rope_tostring_traverse(struct rope_node *n, char **c)
+static uint64_t hash_mul(uint64_t a, uint64_t b)
 {
-  if (!n)
-    return;
-  rope_tostring_traverse(n->left, c);
-  char *copy = n->data;
-  if (n->data) {
-    while (copy - n->data < n->weight) {
-        **c = *copy;
-        *c += 1;
-        copy++;
-    }
-  }
-  rope_tostring_traverse(n->right, c);
+    return hash_reduce((unsigned __int128)a * b);
 }
 
-char *rope_tostring(struct rope *r)
+/** Hash a leaf's text: sum of s[i] * base^(len-1-i)
+    Four characters are folded in per step so that only one multiplication per
+    step depends on the one before.
+*/
+static void hash_text(const char *s, int64_t len, uint64_t *hash, uint64_t *pow)
 {
-    char *ret;
-    if (!r || !r->head) {
-        ret = (char *)malloc(1);
-        strcpy(ret, "");
-        return ret;
+    const unsigned char *p = (const unsigned char *)s;
+    uint64_t h = 0, hp = 1;
+    int64_t i = 0;
+    for (; i + 4 <= len; i += 4, p += 4) {
+        h = hash_reduce((unsigned __int128)h * ROPE_HASH_BASE4 + (unsigned __int128)p[0] * ROPE_HASH_BASE3
+                        + (unsigned __int128)p[1] * ROPE_HASH_BASE2 + (unsigned __int128)p[2] * ROPE_HASH_BASE + p[3]);
+        hp = hash_mul(hp, ROPE_HASH_BASE4);
     }
-    ret = (char *)malloc(sizeof(char)*r->head->weight+1);
-    char *p = ret;
-    rope_tostring_traverse(r->head, &p);
-    *p = '\0';
-    return ret;
+    for (; i < len; ++i, ++p) {
+        h = hash_reduce((unsigned __int128)h * ROPE_HASH_BASE + *p);
+        hp = hash_mul(hp, ROPE_HASH_BASE);
+    }
+    *hash = h;
+    *pow = hp;
 }
 
-struct rope_node *alloc_rope_node(int weight, struct rope_node *left, struct rope_node *right, char *data)
+static bool node_is_hashed(struct rope_node *n)
 {
-    struct rope_node *ret;
-    if ((ret = (struct rope_node *)malloc(sizeof(struct rope_node))) == NULL)
-        return NULL;  
-    ret->weight = weight;
-    ret->left = left;
-    ret->right = right;
-    ret->data = data;
-    return ret;
+    return __atomic_load_n(&n->hash_pow, __ATOMIC_ACQUIRE) != 0;
 }
 
-struct rope_node *substring_recur(struct rope_node *n, int lo, int hi)
+static uint64_t node_hash_pow(struct rope_node *n)
 {
+    return n ? __atomic_load_n(&n->hash_pow, __ATOMIC_RELAXED) : 1;
+}
+
+/** Hash the text under n, hashing any leaves that haven't been yet
+    Leaves are hashed on first use rather than when they're built, so edits
+    don't pay for it; a concatenation's hash is derived from its children's.
+    Threads reading the same tree may both fill in a hash; they store the
+    same values, and hash_pow, which is never 0 once computed, goes last.
+*/
+static uint64_t node_hash(struct rope_node *n)
+{
+    uint64_t hash, pow;
     if (!n)
-        return NULL;
-    struct rope_node *left, *right, *ret;
-    if (is_leaf_node(n)) {
-        if (lo <= 0 && hi == 0)
-            return NULL;
-        ret = n;
-        if (lo != -1 && lo > 0) { // need to realloc node
-            ret = alloc_rope_node(n->weight-lo, NULL, NULL, n->data+lo);
-        }
-        if (hi != -1 && hi > 0 && hi < ret->weight) {
-            if (ret == n) {
-                ret = alloc_rope_node(hi, NULL, NULL, n->data);
-            } else { // node contains lo as well
-                ret->weight -= ret->weight - hi;
-            }
+        return 0;
+    if (!node_is_hashed(n)) {
+        if (is_leaf_node(n)) {
+            hash_text(leaf_text(n), n->weight, &hash, &pow);
+        } else {
+            uint64_t right = node_hash(n->right), right_pow = node_hash_pow(n->right);
+            hash = hash_reduce((unsigned __int128)node_hash(n->left) * right_pow + right);
+            pow = hash_mul(node_hash_pow(n->left), right_pow);
         }
-        return ret;
+        __atomic_store_n(&n->hash, hash, __ATOMIC_RELAXED);
+        __atomic_store_n(&n->hash_pow, pow, __ATOMIC_RELEASE);
     }
-    ret = NULL;
-    int recur_lo, recur_hi;
-    // Figure out if we need to recurse
-    if ((lo >= 0 && lo < n->left->weight) || hi < n->left->weight) { // Is hi or lo contained in the left subtree?
-        // If we recurse on the left subtree, it must contain lo. So we must check if it contains hi as well
-        recur_hi = hi < 0 || hi >= n->left->weight ? -1 : hi - n->right->weight;
-        left = substring_recur(n->left, lo, recur_hi);
-    } else if (lo >= n->left->weight && hi >= n->left->weight)
-        left = NULL; 
-    else {
-        left = n->left;
-    }
-    if (lo >= n->left->weight || hi >= n->left->weight) {
-        // Similar to above, if we're recursing on the right subtee it must contain hi. Check if it contains lo
-        recur_lo = lo < 0 || lo < n->right->weight ? -1 : lo - n->left->weight;
-        right = substring_recur(n->right, recur_lo, hi-n->left->weight);
-    } else {
-        right = n->right;
-    }
-    // Look the results from this node's descendants. If a child was re-allocated, then
-    // this node needs to be too.
-    if (!right)
-        return left;
-    if (!left)
-        return right;
-    if (left != n->left) {
-        if ((ret = (struct rope_node *)malloc(sizeof(struct rope_node))) == NULL)
-            return NULL;
-        ret->left = left;
-        ret->right = n->right;
+    return __atomic_load_n(&n->hash, __ATOMIC_RELAXED);
+}
+
+/** The number of newlines under n, counting any leaves that haven't been yet
+*/
+static int64_t node_newlines(struct rope_node *n)
+{
+    int64_t newlines;
+    if (!n)
+        return 0;
+    if ((newlines = __atomic_load_n(&n->newlines, __ATOMIC_RELAXED)) < 0) {
+        newlines = is_leaf_node(n) ? count_newlines(leaf_text(n), n->weight)
+                                   : node_newlines(n->left) + node_newlines(n->right);
+        __atomic_store_n(&n->newlines, newlines, __ATOMIC_RELAXED);
     }
-    if (right != n->right) {
-        if (!ret) {
-            if ((ret = (struct rope_node *)malloc(sizeof(struct rope_node))) == NULL)
-                return NULL;
-            ret->left = left;
-        }
-        ret->right = right;
+    return newlines;
+}
+
+/** The number of code points under n, counting any leaves that haven't been yet
+*/
+static int64_t node_codepoints(struct rope_node *n)
+{
+    int64_t codepoints;
+    if (!n)
+        return 0;
+    if ((codepoints = __atomic_load_n(&n->codepoints, __ATOMIC_RELAXED)) < 0) {
+        codepoints = is_leaf_node(n) ? count_codepoints(leaf_text(n), n->weight)
+                                     : node_codepoints(n->left) + node_codepoints(n->right);
+        __atomic_store_n(&n->codepoints, codepoints, __ATOMIC_RELAXED);
     }
-    if (!ret) {
-        ret = n;
-    } else {
-        ret->weight = ret->right->weight + ret->left->weight;
+    return codepoints;
+}
+
+/* Leaves shorter than this are coalesced into owned chunks; 0 turns chunking off.
+   Read through chunk_size(), since edits on any thread read it. */
+static int rope_chunk_size = 0;
+
+static inline int chunk_size(void)
+{
+    return __atomic_load_n(&rope_chunk_size, __ATOMIC_RELAXED);
+}
+
+/** Turn leaf coalescing on or off
+    While on, concatenating or taking substrings of small leaves copies them into
+    contiguous chunks of at most size bytes that the rope owns, instead of
+    keeping one node per caller string.
+    The setting is process-wide and applies to every rope. Set it before
+    ropes are shared between threads: changing it is not a data race, but
+    edits already running on other threads may see either value.
+    @param size The largest chunk to build, or 0 to keep every leaf as given
+*/
+void rope_set_chunk_size(int size)
+{
+    __atomic_store_n(&rope_chunk_size, size > 0 ? size : 0, __ATOMIC_RELAXED);
+}
+
+/** Copy the text in [lo, hi) under n to p
+    @return the position just past the copied text
+*/
+static char *copy_node_range(struct rope_node *n, int64_t lo, int64_t hi, char *p)
+{
+    if (is_leaf_node(n)) {
+        memcpy(p, leaf_text(n)+lo, hi-lo);
+        return p + hi-lo;
     }
+    int64_t left_weight = n->left->weight;
+    if (lo < left_weight)
+        p = copy_node_range(n->left, lo, hi < left_weight ? hi : left_weight, p);
+    if (hi > left_weight)
+        p = copy_node_range(n->right, lo > left_weight ? lo-left_weight : 0, hi-left_weight, p);
+    return p;
+}
 
-    return ret;
+/** Allocate room for weight characters of text and a terminator for a new leaf to own
+    Text up to ROPE_INLINE_MAX characters goes right after the leaf node itself,
+    so reading it costs no second cache miss. *mem is then set to the memory
+    for that node, to be passed on to owned_leaf, and otherwise to NULL.
+    @return The buffer, or NULL on error
+*/
+static char *alloc_leaf_text(struct rope_arena *a, int64_t weight, struct rope_node **mem)
+{
+    if (weight > ROPE_INLINE_MAX) {
+        *mem = NULL;
+        return (char *)rope_alloc(a, weight+1);
+    }
+    if ((*mem = (struct rope_node *)rope_alloc(a, sizeof(struct rope_node) + weight+1)) == NULL)
+        return NULL;
+    return (char *)(*mem + 1);
 }
 
-struct rope *rope_substring(struct rope *r, int lo, int hi)
+/** Wrap a buffer from alloc_leaf_text in a leaf that frees it along with the node
+*/
+static struct rope_node *owned_leaf(struct rope_arena *a, struct rope_node *mem, char *data, int64_t weight)
 {
-    struct rope *ret;
-    if (!r || !r->head) {
-        return lo == 0 && hi == 0 ? r : NULL;
+    struct rope_node *ret;
+    if (mem) {
+        init_rope_node(mem, a, weight, NULL, NULL, data);
+        mem->flags |= ROPE_NODE_INLINE;
+        return mem;
     }
-    if ((ret = (struct rope *)malloc(sizeof(struct rope))) == NULL)
+    if ((ret = arena_rope_node(a, weight, NULL, NULL, data)) == NULL) {
+        rope_free(a, data);
         return NULL;
-    
-    ret->head = substring_recur(r->head, lo, hi);
+    }
+    ret->flags |= ROPE_NODE_OWNED;
     return ret;
 }
+
+/** Allocate a leaf owning a copy of the text in [lo, hi) under n
+*/
+static struct rope_node *new_chunk(struct rope_arena *a, struct rope_node *n, int64_t lo, int64_t hi)
+{
+    struct rope_node *mem;
+    char *data;
+    if ((data = alloc_leaf_text(a, hi-lo, &mem)) == NULL)
+        return NULL;
+    *copy_node_range(n, lo, hi, data) = '\0';
+    return owned_leaf(a, mem, data, hi-lo);
+}
+
+/** Allocate a leaf owning a copy of the text of two adjacent leaves
+*/
+static struct rope_node *merge_leaves(struct rope_arena *a, struct rope_node *l, struct rope_node *r)
+{
+    struct rope_node *mem;
+    char *data;
+    if ((data = alloc_leaf_text(a, l->weight+r->weight, &mem)) == NULL)
+        return NULL;
+    memcpy(data, leaf_text(l), l->weight);
+    memcpy(data+l->weight, leaf_text(r), r->weight);
+    data[l->weight+r->weight] = '\0';
+    return owned_leaf(a, mem, data, l->weight+r->weight);
+}
+
+/** Create a new rope out of a number of strings, one leaf each
+    Like new_rope, the rope points into the strings rather than copying them.
+    @param argc The number of strings that follow
+    @return A new balanced rope, or NULL on error
+*/
+struct rope *new_ropev(int argc, ...)
+{
+    va_list ap;
+    struct rope_builder *b;
+    if ((b = new_rope_builder(NULL)) == NULL)
+        return NULL;
+    va_start(ap, argc);
+    while (argc--) {
+        char *s = va_arg(ap, char *);
+        rope_builder_push(b, s, strlen(s));
+    }
+    va_end(ap);
+    return rope_builder_finish(b);
+}
+
+static bool is_rope_node(struct rope_node *n)
+{
+    if (!n)
+        return true;
+    if (n->flags & ROPE_NODE_SLICE) {   // slice: a range of another tree, and the tree built from it
+        struct rope_node *tree = __atomic_load_n(&n->right, __ATOMIC_ACQUIRE);
+        return !n->data && n->left && n->offset >= 0 && n->weight > 0
+               && n->offset + n->weight <= n->left->weight && is_rope_node(n->left)
+               && (!tree || (tree->weight == n->weight && !(tree->flags & ROPE_NODE_SLICE) && is_rope_node(tree)));
+    }
+    if (n->left || n->right) {  // concatenation node
+        if (n->data || !n->left || !n->right)            // can't have any data
+            return false;
+        int64_t weight = node_weight(n->left) + node_weight(n->right);
+        if (weight != n->weight) // weight must equal the same as both subtrees
+            return false;
+        return is_rope_node(n->left) && is_rope_node(n->right);  // left and right subtrees must be ropes
+    } else if (!n->left && !n->right) {
+
+    }
+    if (n->flags & ROPE_NODE_COMPRESSED)    // compressed leaf: its text must unpack to weight characters
+        return n->data && n->weight <= ROPE_COMPRESS_MAX && try_unpack_leaf(n) != NULL;
+    // leaf node: its weight can't run past the end of the string it points into
+    if (n->mapping)
+        return n->data >= n->mapping->addr && n->data + n->weight <= n->mapping->addr + n->mapping->length;
+    return n->data && !memchr(n->data, '\0', n->weight) ? true : false;
+}
+
+/** The root of r's tree, building a slice's tree of its own the first time
+    Slices are only made by rope_substring, and only ever as a rope's head, so
+    everything below this works on plain trees. The tree a slice's text is
+    built into shares what it can with the tree it slices, and is kept in the
+    slice's right child for next time. r itself is never changed, so threads
+    may read a rope concurrently whether or not it is a slice: if two build
+    the tree at once, the first to install it wins and the other frees its own.
+    @return The root, or NULL if r is empty or on error
+*/
+static struct rope_node *rope_root(struct rope *r)
+{
+    struct rope_node *n = r ? r->head : NULL, *tree, *built = NULL;
+    if (!n || !(n->flags & ROPE_NODE_SLICE))
+        return n;
+    if ((tree = __atomic_load_n(&n->right, __ATOMIC_ACQUIRE)) != NULL)
+        return tree;
+    if ((tree = substring_node(r->arena, n->left, n->offset, n->offset + n->weight)) == NULL)
+        return NULL;
+    if (!__atomic_compare_exchange_n(&n->right, &built, tree, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free_rope_node(tree, false);    // another thread got there first
+        return built;
+    }
+    return tree;
+}
+
+bool is_rope(struct rope *r)
+{
+    return !r || is_rope_node(r->head);
+}
+
+char rope_index(struct rope *r, int64_t index)
+{
+    if (!r || !r->head)
+        return -1;
+    struct rope_node *n = r->head;
+    if (n->flags & ROPE_NODE_SLICE) {   // look straight through to the sliced tree
+        if (index < 0 || index >= n->weight)
+            return -1;
+        index += n->offset;
+        n = n->left;
+    }
+    while (n) {
+        if (n->left && n->right) {          // concatenation node
+            if (index < n->left->weight) {  // in left subtree
+                n = n->left;
+            } else {
+                index -= n->left->weight;   // if in right subtree, subtract weight of left subtree
+                n = n->right;
+            }
+        } else { // leaf node
+            return index < 0 || index >= n->weight ? -1 : leaf_text(n)[index];
+        }
+    }
+    return -1;  // no such node
+}
+
+/* The queries of one rope_index_batch call, in ascending order of offset.
+   Query i asks for offsets[i*stride] and its answer goes to
+   out[slots ? slots[i*stride] : i]. */
+struct index_batch {
+    const int64_t *offsets;
+    const int64_t *slots;
+    int stride;
+    int64_t length;
+    char *out;
+};
+
+static int compare_offsets(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/** Answer queries [lo, hi) of b, which all fall in n or off its ends
+    The queries are split between the children where their offsets cross the
+    left child's weight, so each node is visited once however many queries
+    fall in it. The right child is prefetched while the left is walked.
+    @param base The offset of n in the rope
+*/
+static void index_batch_node(struct index_batch *b, struct rope_node *n, int64_t base, int64_t lo, int64_t hi)
+{
+    const int64_t *offsets = b->offsets;
+    int stride = b->stride;
+    while (!is_leaf_node(n)) {
+        __builtin_prefetch(n->left);
+        __builtin_prefetch(n->right);
+        int64_t middle = base + n->left->weight, l = lo, h = hi;
+        while (l < h) {     // the first query at or past middle
+            int64_t m = l + (h-l)/2;
+            if (offsets[m*stride] < middle)
+                l = m + 1;
+            else
+                h = m;
+        }
+        if (l == hi) {
+            n = n->left;
+        } else {
+            if (l > lo)
+                index_batch_node(b, n->left, base, lo, l);
+            lo = l;
+            base = middle;
+            n = n->right;
+        }
+    }
+    const char *text = leaf_text(n);
+    __builtin_prefetch(text + MAX(offsets[lo*stride] - base, 0));
+    for (int64_t i = lo; i < hi; ++i) {
+        int64_t offset = offsets[i*stride], at = offset - base;
+        char c = offset < 0 || offset >= b->length || at < 0 || at >= n->weight ? -1 : text[at];
+        b->out[b->slots ? b->slots[i*stride] : i] = c;
+    }
+}
+
+/** Look up many characters of r at once, like rope_index for each offset
+    The offsets are sorted, unless they already are, and resolved in a
+    single walk down the tree that visits each node at most once.
+    @param offsets The offsets to look up, in any order, repeats allowed
+    @param out Set to the character at each offset, or -1 for offsets outside r
+    @return false if there was no memory to sort the offsets
+*/
+bool rope_index_batch(struct rope *r, const int64_t *offsets, int64_t n, char *out)
+{
+    struct rope_node *node = r ? r->head : NULL;
+    struct index_batch b = { .offsets = offsets, .slots = NULL, .stride = 1, .length = rope_length(r), .out = out };
+    int64_t (*sorted)[2] = NULL, base = 0;
+    if (n <= 0)
+        return true;
+    if (!node) {
+        memset(out, -1, n);
+        return true;
+    }
+    for (int64_t i = 1; i < n; ++i) {
+        if (offsets[i] < offsets[i-1]) {
+            if (!(sorted = malloc(n * sizeof(*sorted))))
+                return false;
+            for (int64_t j = 0; j < n; ++j) {
+                sorted[j][0] = offsets[j];
+                sorted[j][1] = j;
+            }
+            qsort(sorted, n, sizeof(*sorted), compare_offsets);
+            b.offsets = &sorted[0][0];
+            b.slots = &sorted[0][1];
+            b.stride = 2;
+            break;
+        }
+    }
+    if (node->flags & ROPE_NODE_SLICE) {    // look straight through to the sliced tree
+        base = -node->offset;
+        node = node->left;
+    }
+    index_batch_node(&b, node, base, 0, n);
+    free(sorted);
+    return true;
+}
+
+int64_t rope_length(struct rope *r)
+{
+    return r && r->head ? r->head->weight : 0;
+}
+
+/** The number of lines in r
+    Lines are separated by newlines, so a trailing newline starts an empty last
+    line and an empty rope has one line.
+*/
+int64_t rope_line_count(struct rope *r)
+{
+    return r ? node_newlines(rope_root(r)) + 1 : 0;
+}
+
+/** Find where a line starts
+    @param line The line to find, counting from 0
+    @return the offset of the first character of line, or -1 if r has no such line
+*/
+int64_t rope_line_to_offset(struct rope *r, int64_t line)
+{
+    struct rope_node *n = rope_root(r);
+    const char *p, *text;
+    int64_t offset = 0, left_newlines;
+    if (line <= 0 || line >= rope_line_count(r))
+        return line == 0 && r ? 0 : -1;
+    // find the newline ending line-1
+    while (!is_leaf_node(n)) {
+        if (line <= (left_newlines = node_newlines(n->left))) {
+            n = n->left;
+        } else {
+            line -= left_newlines;
+            offset += n->left->weight;
+            n = n->right;
+        }
+    }
+    text = leaf_text(n);
+    for (p = text; (p = (const char *)memchr(p, '\n', text + n->weight - p)) && --line; ++p)
+        ;
+    return offset + (p - text) + 1;
+}
+
+/** Find the line an offset is on
+    @param offset Clamped to the rope; the end of the rope is on the last line
+    @return the line, counting from 0
+*/
+int64_t rope_offset_to_line(struct rope *r, int64_t offset)
+{
+    struct rope_node *n = rope_root(r);
+    int64_t line = 0;
+    offset = offset < 0 ? 0 : offset > rope_length(r) ? rope_length(r) : offset;
+    if (!n)
+        return 0;
+    while (!is_leaf_node(n)) {
+        if (offset < n->left->weight) {
+            n = n->left;
+        } else {
+            line += node_newlines(n->left);
+            offset -= n->left->weight;
+            n = n->right;
+        }
+    }
+    if (offset > n->weight/2)  // count whichever side of offset is shorter
+        return line + node_newlines(n) - count_newlines(leaf_text(n)+offset, n->weight-offset);
+    return line + count_newlines(leaf_text(n), offset);
+}
+
+/** The number of UTF-8 code points in r
+    Counts are cached in every node, so this is O(1) after the first call.
+*/
+int64_t rope_cp_length(struct rope *r)
+{
+    return node_codepoints(rope_root(r));
+}
+
+/** Find where a code point starts
+    @param cp The code point to find, counting from 0; rope_cp_length gives the end of the rope
+    @return the byte offset of its first byte, or -1 if r has no such code point
+*/
+int64_t rope_cp_to_offset(struct rope *r, int64_t cp)
+{
+    struct rope_node *n = rope_root(r);
+    int64_t offset = 0, left_codepoints, block;
+    const char *p, *text;
+    if (cp < 0 || cp > node_codepoints(n))
+        return -1;
+    if (cp == node_codepoints(n))
+        return rope_length(r);
+    while (!is_leaf_node(n)) {
+        if (cp < (left_codepoints = node_codepoints(n->left))) {
+            n = n->left;
+        } else {
+            cp -= left_codepoints;
+            offset += n->left->weight;
+            n = n->right;
+        }
+    }
+    text = leaf_text(n);
+    for (p = text; text + n->weight - p > 64 && (block = count_codepoints(p, 64)) <= cp; p += 64)
+        cp -= block;        // whole blocks before it
+    for (; is_continuation(*p) || cp--; ++p)    // skip to the cp'th byte that starts one
+        ;
+    return offset + (p - text);
+}
+
+/** Find the code point a byte offset is in
+    @param offset Clamped to the rope; the end of the rope gives rope_cp_length
+    @return the number of code points starting before offset
+*/
+int64_t rope_offset_to_cp(struct rope *r, int64_t offset)
+{
+    struct rope_node *n = rope_root(r);
+    int64_t cp = 0;
+    offset = offset < 0 ? 0 : offset > rope_length(r) ? rope_length(r) : offset;
+    if (!n)
+        return 0;
+    while (!is_leaf_node(n)) {
+        if (offset < n->left->weight) {
+            n = n->left;
+        } else {
+            cp += node_codepoints(n->left);
+            offset -= n->left->weight;
+            n = n->right;
+        }
+    }
+    return cp + count_codepoints(leaf_text(n), offset);
+}
+
+/** Decode the code point at an index
+    Malformed sequences decode to U+FFFD, one byte at a time.
+    @param cp The index, counting code points from 0
+    @return the code point, or -1 if r has no such code point
+*/
+int32_t rope_index_cp(struct rope *r, int64_t cp)
+{
+    static const int lengths[16] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+    unsigned char s[4];
+    int64_t offset = rope_cp_to_offset(r, cp), n;
+    if (offset < 0 || offset >= rope_length(r))
+        return -1;
+    n = rope_copy_range(r, offset, offset+4, (char *)s);
+    int len = lengths[s[0] >> 4];
+    if (len == 1)
+        return s[0];
+    if (len == 0 || len > n || (len == 4 && s[0] > 0xF4))
+        return 0xFFFD;
+    int32_t c = s[0] & (0x7F >> len);
+    for (int i = 1; i < len; ++i) {
+        if (!is_continuation(s[i]))
+            return 0xFFFD;
+        c = c << 6 | (s[i] & 0x3F);
+    }
+    if (c < (len == 2 ? 0x80 : len == 3 ? 0x800 : 0x10000) || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+        return 0xFFFD;      // overlong, out of range or a surrogate
+    return c;
+}
+
+/** Create a rope holding the code points in [lo, hi) of r, like rope_substring
+    The bounds are clamped to the rope.
+    @return A new rope sharing r's nodes, or NULL on error
+*/
+struct rope *rope_substring_cp(struct rope *r, int64_t lo, int64_t hi)
+{
+    int64_t length = rope_cp_length(r);
+    lo = lo < 0 ? 0 : lo > length ? length : lo;
+    hi = hi < lo ? lo : hi > length ? length : hi;
+    return rope_substring(r, rope_cp_to_offset(r, lo), rope_cp_to_offset(r, hi));
+}
+
+/** Find the first difference between the text in [lo, hi) under m and s
+    @return its offset from lo, or hi-lo if there is none
+*/
+static int64_t range_mismatch(struct rope_node *m, int64_t lo, int64_t hi, const char *s);
+
+/** range_mismatch against the text in [lo, hi) of compressed leaf n
+    The text is copied out of the cache first, since reading the compressed
+    leaves under m could evict it. Kept out of line so only this path pays
+    for the buffer on the stack.
+*/
+static __attribute__((noinline)) int64_t leaf_mismatch(struct rope_node *n, int64_t lo, int64_t hi,
+                                                       struct rope_node *m, int64_t mlo)
+{
+    char text[ROPE_COMPRESS_MAX];
+    memcpy(text, leaf_text(n)+lo, hi-lo);
+    return range_mismatch(m, mlo, mlo + hi-lo, text);
+}
+
+/** Check that the text in [lo, hi) under n equals s
+*/
+static bool range_matches(struct rope_node *n, int64_t lo, int64_t hi, const char *s)
+{
+    if (is_leaf_node(n))
+        return !memcmp(leaf_text(n)+lo, s, hi-lo);
+    int64_t left_weight = n->left->weight;
+    if (lo < left_weight && !range_matches(n->left, lo, hi < left_weight ? hi : left_weight, s))
+        return false;
+    if (hi > left_weight)
+        return range_matches(n->right, lo > left_weight ? lo-left_weight : 0, hi-left_weight,
+                             s + (lo < left_weight ? left_weight-lo : 0));
+    return true;
+}
+
+/** Check that the text under n equals the text starting at lo under m
+    Whenever that text is a whole subtree of m, it is compared with n by
+    pointer first, so shared subtrees are skipped, then by hash, so most
+    mismatches are rejected without reading them.
+*/
+static bool node_matches(struct rope_node *n, struct rope_node *m, int64_t lo)
+{
+    while (!is_leaf_node(m)) {   // narrow m down to the smallest subtree holding the text
+        if (lo + n->weight <= m->left->weight) {
+            m = m->left;
+        } else if (lo >= m->left->weight) {
+            lo -= m->left->weight;
+            m = m->right;
+        } else {
+            break;
+        }
+    }
+    if (lo == 0 && m->weight == n->weight) {
+        if (m == n)
+            return true;
+        if (node_hash(m) != node_hash(n))
+            return false;
+    }
+    if (n->flags & ROPE_NODE_COMPRESSED)
+        return leaf_mismatch(n, 0, n->weight, m, lo) == n->weight;
+    if (is_leaf_node(n))
+        return range_matches(m, lo, lo + n->weight, n->data);
+    return node_matches(n->left, m, lo) && node_matches(n->right, m, lo + n->left->weight);
+}
+
+/** Compare the text under two nodes, whatever the shape of the trees
+*/
+bool rope_node_equal(struct rope_node *n1, struct rope_node *n2)
+{
+    if (!n1 || !n2)
+        return node_weight(n1) == node_weight(n2);
+    return n1->weight == n2->weight && node_matches(n1, n2, 0);
+}
+
+/** Check whether two ropes hold the same text
+    Ropes of different lengths or hashes differ without looking at their text;
+    otherwise only the parts they don't share are compared.
+*/
+bool rope_equal(struct rope *r1, struct rope *r2)
+{
+    return rope_node_equal(rope_root(r1), rope_root(r2));
+}
+
+/** Find the first byte where a[0, len) and b[0, len) differ, a vector at a time
+    @return its offset, or len if they are the same
+*/
+static int64_t mismatch_bytes(const char *a, const char *b, int64_t len)
+{
+    int64_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= len; i += 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a+i)),
+                                                               _mm256_loadu_si256((const __m256i *)(b+i))));
+        if (mask != 0xFFFFFFFFu)
+            return i + __builtin_ctz(~mask);
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a+i)),
+                                                         _mm_loadu_si128((const __m128i *)(b+i))));
+        if (mask != 0xFFFF)
+            return i + __builtin_ctz(~mask);
+    }
+#endif
+    for (; i < len && a[i] == b[i]; ++i)
+        ;
+    return i;
+}
+
+/** Find the first difference between the text in [lo, hi) under m and s
+    @return its offset from lo, or hi-lo if there is none
+*/
+static int64_t range_mismatch(struct rope_node *m, int64_t lo, int64_t hi, const char *s)
+{
+    if (is_leaf_node(m))
+        return mismatch_bytes(leaf_text(m)+lo, s, hi-lo);
+    int64_t left_weight = m->left->weight, done = 0;
+    if (lo < left_weight) {
+        int64_t end = hi < left_weight ? hi : left_weight;
+        done = range_mismatch(m->left, lo, end, s);
+        if (done < end-lo)
+            return done;
+    }
+    if (hi > left_weight)
+        done += range_mismatch(m->right, lo > left_weight ? lo-left_weight : 0, hi-left_weight, s+done);
+    return done;
+}
+
+/** Find the first difference between the text in [lo, hi) under n and the
+    text of the same length starting at mlo under m
+    Both sides are first narrowed to the smallest subtrees holding their
+    text, so a subtree the ropes share at the same offset is skipped by
+    pointer without reading it.
+    @return its offset from lo, or hi-lo if there is none
+*/
+static int64_t node_mismatch(struct rope_node *n, int64_t lo, int64_t hi, struct rope_node *m, int64_t mlo)
+{
+    int64_t len = hi - lo, done;
+    while (!is_leaf_node(n)) {
+        if (hi <= n->left->weight) {
+            n = n->left;
+        } else if (lo >= n->left->weight) {
+            lo -= n->left->weight;
+            hi -= n->left->weight;
+            n = n->right;
+        } else {
+            break;
+        }
+    }
+    while (!is_leaf_node(m)) {
+        if (mlo + len <= m->left->weight) {
+            m = m->left;
+        } else if (mlo >= m->left->weight) {
+            mlo -= m->left->weight;
+            m = m->right;
+        } else {
+            break;
+        }
+    }
+    if (m == n && mlo == lo)
+        return len;
+    if (n->flags & ROPE_NODE_COMPRESSED)
+        return leaf_mismatch(n, lo, hi, m, mlo);
+    if (is_leaf_node(n))
+        return range_mismatch(m, mlo, mlo + len, n->data + lo);
+    done = node_mismatch(n->left, lo, n->left->weight, m, mlo);
+    if (done < n->left->weight - lo)
+        return done;
+    return done + node_mismatch(n->right, 0, hi - n->left->weight, m, mlo + done);
+}
+
+/** Compare the text in [lo1, hi1) of r1 with the text in [lo2, hi2) of r2
+    byte by byte, as unsigned chars, like memcmp, with a shorter text
+    ordering before any longer one it is a prefix of. The bounds are clamped
+    to the ropes. Subtrees shared by the ropes at the same offset are skipped
+    without reading them, and the rest is compared a leaf segment at a time.
+    @param mismatch If not NULL, set to the offset from lo1 and lo2 of the
+           first byte that differs, or to the length of the shorter range
+    @return a negative number, zero or a positive number as the first range
+            orders before, the same as or after the second
+*/
+int rope_compare_range(struct rope *r1, int64_t lo1, int64_t hi1,
+                       struct rope *r2, int64_t lo2, int64_t hi2, int64_t *mismatch)
+{
+    int64_t length1 = rope_length(r1), length2 = rope_length(r2), len, at = 0;
+    lo1 = lo1 < 0 ? 0 : lo1 > length1 ? length1 : lo1;
+    hi1 = hi1 < lo1 ? lo1 : hi1 > length1 ? length1 : hi1;
+    lo2 = lo2 < 0 ? 0 : lo2 > length2 ? length2 : lo2;
+    hi2 = hi2 < lo2 ? lo2 : hi2 > length2 ? length2 : hi2;
+    len = hi1-lo1 < hi2-lo2 ? hi1-lo1 : hi2-lo2;
+    if (len > 0) {
+        struct rope_node *n1 = rope_root(r1), *n2 = rope_root(r2);
+        at = n1 && n2 ? node_mismatch(n1, lo1, lo1 + len, n2, lo2) : 0;
+    }
+    if (mismatch)
+        *mismatch = at;
+    if (at < len)
+        return (unsigned char)rope_index(r1, lo1 + at) - (unsigned char)rope_index(r2, lo2 + at);
+    return (hi1-lo1 > len) - (hi2-lo2 > len);
+}
+
+/** Compare the text of two ropes, like rope_compare_range over all of both
+*/
+int rope_compare(struct rope *r1, struct rope *r2, int64_t *mismatch)
+{
+    return rope_compare_range(r1, 0, rope_length(r1), r2, 0, rope_length(r2), mismatch);
+}
+
+/* One side of rope_diff: the subtrees of one rope it has reached but not yet
+   matched or split, with a max-heap on their weights and a table from each
+   node to its entries. */
+struct diff_entry {
+    struct rope_node *node;
+    int64_t offset;     // in the rope
+    int64_t next;       // the next entry for the same node, or -1
+    bool done;          // matched or split since it was added
+};
+
+struct diff_side {
+    struct diff_entry *entries;
+    int64_t count, cap;
+    int64_t *heap;      // indices of entries, heaviest first
+    int64_t heap_count;
+    struct rope_node **keys;
+    int64_t *heads;     // first entry for each key
+    int64_t slots, used;
+};
+
+static int64_t diff_slot(struct diff_side *d, struct rope_node *n)
+{
+    int64_t i = pointer_hash(n) & (d->slots-1);
+    while (d->keys[i] && d->keys[i] != n)
+        i = (i+1) & (d->slots-1);
+    return i;
+}
+
+/** Add n, at offset in its rope, to the side
+    @return false if out of memory
+*/
+static bool diff_add(struct diff_side *d, struct rope_node *n, int64_t offset)
+{
+    int64_t i, slot;
+    if (d->count == d->cap) {
+        int64_t cap = d->cap ? 2*d->cap : 64;
+        struct diff_entry *entries = (struct diff_entry *)realloc(d->entries, cap * sizeof(*entries));
+        if (!entries)
+            return false;
+        d->entries = entries;
+        int64_t *heap = (int64_t *)realloc(d->heap, cap * sizeof(*heap));
+        if (!heap)
+            return false;
+        d->heap = heap;
+        d->cap = cap;
+    }
+    if (2*(d->used+1) > d->slots) {     // keep the table at most half full
+        struct rope_node **keys = d->keys;
+        int64_t *heads = d->heads, slots = d->slots;
+        d->slots = slots ? 2*slots : 128;
+        d->keys = (struct rope_node **)calloc(d->slots, sizeof(*d->keys));
+        d->heads = (int64_t *)malloc(d->slots * sizeof(*d->heads));
+        if (!d->keys || !d->heads) {
+            free(d->keys);
+            free(d->heads);
+            d->keys = keys;
+            d->heads = heads;
+            d->slots = slots;
+            return false;
+        }
+        for (i = 0; i < slots; ++i) {
+            if (keys[i]) {
+                slot = diff_slot(d, keys[i]);
+                d->keys[slot] = keys[i];
+                d->heads[slot] = heads[i];
+            }
+        }
+        free(keys);
+        free(heads);
+    }
+    slot = diff_slot(d, n);
+    if (!d->keys[slot]) {
+        d->keys[slot] = n;
+        d->heads[slot] = -1;
+        d->used++;
+    }
+    d->entries[d->count] = (struct diff_entry){ .node = n, .offset = offset, .next = d->heads[slot], .done = false };
+    d->heads[slot] = d->count;
+    for (i = d->heap_count++; i > 0 && d->entries[d->heap[(i-1)/2]].node->weight < n->weight; i = (i-1)/2)
+        d->heap[i] = d->heap[(i-1)/2];
+    d->heap[i] = d->count++;
+    return true;
+}
+
+/** Claim an entry for n that is neither matched nor split yet
+    @return its index, or -1 if there is none
+*/
+static int64_t diff_take(struct diff_side *d, struct rope_node *n)
+{
+    if (!d->slots)
+        return -1;
+    int64_t slot = diff_slot(d, n);
+    if (!d->keys[slot])
+        return -1;
+    for (int64_t i = d->heads[slot]; i >= 0; i = d->entries[i].next) {
+        if (!d->entries[i].done) {
+            d->entries[i].done = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/** Drop entries that are done from the top of the heap
+    @return the heaviest remaining entry, or -1 if there is none
+*/
+static int64_t diff_top(struct diff_side *d)
+{
+    while (d->heap_count && d->entries[d->heap[0]].done) {
+        int64_t last = d->heap[--d->heap_count], i = 0, child;
+        int64_t weight = d->entries[last].node->weight;
+        while ((child = 2*i + 1) < d->heap_count) {
+            if (child+1 < d->heap_count
+                && d->entries[d->heap[child+1]].node->weight > d->entries[d->heap[child]].node->weight)
+                child++;
+            if (d->entries[d->heap[child]].node->weight <= weight)
+                break;
+            d->heap[i] = d->heap[child];
+            i = child;
+        }
+        d->heap[i] = last;
+    }
+    return d->heap_count ? d->heap[0] : -1;
+}
+
+static void free_diff_side(struct diff_side *d)
+{
+    free(d->entries);
+    free(d->heap);
+    free(d->keys);
+    free(d->heads);
+}
+
+/** Add an edit or matched range to a growing array
+    @return false if out of memory
+*/
+static bool diff_append(struct rope_edit **edits, int64_t *count, int64_t *cap,
+                        int64_t old_lo, int64_t old_hi, int64_t new_lo, int64_t new_hi)
+{
+    if (*count == *cap) {
+        int64_t grown = *cap ? 2 * *cap : 16;
+        struct rope_edit *tmp = (struct rope_edit *)realloc(*edits, grown * sizeof(**edits));
+        if (!tmp)
+            return false;
+        *edits = tmp;
+        *cap = grown;
+    }
+    (*edits)[(*count)++] = (struct rope_edit){ .old_lo = old_lo, .old_hi = old_hi, .new_lo = new_lo, .new_hi = new_hi };
+    return true;
+}
+
+/** Reach subtree n of the rope on side s: match it with the same node on the
+    other side if that has reached it too, otherwise add it to side s
+    @return false if out of memory
+*/
+static bool diff_reach(struct diff_side *sides, int s, struct rope_node *n, int64_t offset,
+                       struct rope_edit **matches, int64_t *count, int64_t *cap)
+{
+    int64_t i;
+    if (n->weight == 0)
+        return true;
+    if ((i = diff_take(&sides[!s], n)) < 0)
+        return diff_add(&sides[s], n, offset);
+    int64_t other = sides[!s].entries[i].offset;
+    return s ? diff_append(matches, count, cap, other, other + n->weight, offset, offset + n->weight)
+             : diff_append(matches, count, cap, offset, offset + n->weight, other, other + n->weight);
+}
+
+static int compare_new_lo(const void *a, const void *b)
+{
+    int64_t x = ((const struct rope_edit *)a)->new_lo, y = ((const struct rope_edit *)b)->new_lo;
+    return (x > y) - (x < y);
+}
+
+/** The length of the text r1 and r2 have in common just before hi1 and hi2,
+    up to max characters
+*/
+static int64_t common_suffix(struct rope *r1, int64_t hi1, struct rope *r2, int64_t hi2, int64_t max)
+{
+    struct rope_iter a, b;
+    const char *p = NULL, *q = NULL;
+    int64_t length = 0, la = 0, lb = 0, j;
+    if (max <= 0 || !rope_iter_init(&a, r1, hi1) || !rope_iter_init(&b, r2, hi2))
+        return 0;
+    while (length < max) {
+        if (!la && !(la = rope_iter_prev_chunk(&a, &p)))
+            break;
+        if (!lb && !(lb = rope_iter_prev_chunk(&b, &q)))
+            break;
+        p = leaf_text(a.path[a.depth-1]);   // in case reading one compressed leaf evicted the other
+        q = leaf_text(b.path[b.depth-1]);
+        int64_t k = MIN(MIN(la, lb), max - length);
+        for (j = 0; j < k && p[la-1-j] == q[lb-1-j]; ++j)
+            ;
+        length += j;
+        if (j < k)
+            break;
+        la -= k;
+        lb -= k;
+    }
+    return length;
+}
+
+/** Find the edits that turn r1 into r2
+    Both trees are opened up from the top, heaviest subtree first, and a
+    subtree one rope shares with the other is matched by pointer as soon as
+    both sides reach it, without looking inside. Only the nodes above the
+    changes are visited, so versions derived from one another through
+    rope_concat, rope_insert, rope_delete and rope_substring are diffed in
+    time proportional to the change rather than the text. The text between
+    matched subtrees is then trimmed of any common prefix and suffix.
+    Text moved from one place to another shows up as a deletion and an insertion.
+    @param count Set to the number of edits
+    @return a malloc'd array of edits, in order, each replacing
+            [old_lo, old_hi) of r1 with [new_lo, new_hi) of r2; or NULL on error
+*/
+struct rope_edit *rope_diff(struct rope *r1, struct rope *r2, int64_t *count)
+{
+    struct diff_side sides[2];
+    struct rope_edit *matches = NULL, *edits = NULL;
+    struct rope_node *roots[2] = { rope_root(r1), rope_root(r2) };
+    int64_t match_count = 0, match_cap = 0, edit_count = 0, edit_cap = 0, kept = 0;
+    int64_t length1 = rope_length(r1), length2 = rope_length(r2);
+    bool ok = (!length1 || roots[0]) && (!length2 || roots[1]);
+    memset(sides, 0, sizeof(sides));
+    for (int s = 0; s < 2 && ok; ++s)
+        ok = !roots[s] || diff_reach(sides, s, roots[s], 0, &matches, &match_count, &match_cap);
+    while (ok) {    // split the heaviest unmatched subtree of either rope
+        int64_t top0 = diff_top(&sides[0]), top1 = diff_top(&sides[1]);
+        if (top0 < 0 && top1 < 0)
+            break;
+        int s = top1 < 0 || (top0 >= 0 && sides[0].entries[top0].node->weight >= sides[1].entries[top1].node->weight) ? 0 : 1;
+        struct diff_entry *e = &sides[s].entries[s ? top1 : top0];
+        struct rope_node *n = e->node;
+        int64_t offset = e->offset;
+        e->done = true;
+        if (!is_leaf_node(n))
+            ok = diff_reach(sides, s, n->left, offset, &matches, &match_count, &match_cap)
+                 && diff_reach(sides, s, n->right, offset + n->left->weight, &matches, &match_count, &match_cap);
+    }
+    free_diff_side(&sides[0]);
+    free_diff_side(&sides[1]);
+
+    // keep the matches that are in the same order in both ropes
+    if (match_count)
+        qsort(matches, match_count, sizeof(*matches), compare_new_lo);
+    for (int64_t i = 0; i < match_count; ++i) {
+        if (!kept || matches[i].old_lo >= matches[kept-1].old_hi)
+            matches[kept++] = matches[i];
+    }
+    int64_t lo1 = 0, lo2 = 0, prefix;
+    for (int64_t i = 0; i <= kept && ok; ++i) {    // trim the text between them
+        int64_t hi1 = i < kept ? matches[i].old_lo : length1, hi2 = i < kept ? matches[i].new_lo : length2;
+        int64_t start1 = lo1, start2 = lo2;
+        if (lo1 < hi1 && lo2 < hi2) {
+            rope_compare_range(r1, lo1, hi1, r2, lo2, hi2, &prefix);
+            start1 += prefix;
+            start2 += prefix;
+        }
+        int64_t suffix = common_suffix(r1, hi1, r2, hi2, MIN(hi1 - start1, hi2 - start2));
+        if (start1 < hi1 - suffix || start2 < hi2 - suffix)
+            ok = diff_append(&edits, &edit_count, &edit_cap, start1, hi1 - suffix, start2, hi2 - suffix);
+        if (i < kept) {
+            lo1 = matches[i].old_hi;
+            lo2 = matches[i].new_hi;
+        }
+    }
+    free(matches);
+    if (ok && !edits)   // no edits still needs an array to return
+        ok = (edits = (struct rope_edit *)malloc(sizeof(*edits))) != NULL;
+    if (!ok) {
+        free(edits);
+        return NULL;
+    }
+    *count = edit_count;
+    return edits;
+}
+
+/** A fingerprint of r's text, the same for all ropes with the same text
+    This is a polynomial hash modulo 2^61-1, cached in each node, so it costs a
+    pass over the text only the first time, and only over new nodes after edits.
+*/
+uint64_t rope_hash(struct rope *r)
+{
+    return r ? node_hash(rope_root(r)) : 0;
+}
+
+/** Create a rope with the same contents as r
+    Ropes are never modified once built, so the copy just shares r's tree.
+    @return A new rope, or NULL on error
+*/
+struct rope *rope_copy(struct rope *r)
+{
+    struct rope *ret = alloc_rope(r->arena);
+    if (!ret)
+        return NULL;
+    ret->head = ref_node(r->head);
+    return ret;
+}
+
+/** Create a concatenation node, taking over the caller's references to l and r
+*/
+static struct rope_node *concat_node(struct rope_arena *a, struct rope_node *l, struct rope_node *r)
+{
+    if (!l || !r)
+        return NULL;
+    return arena_rope_node(a, l->weight + r->weight, l, r, NULL);
+}
+
+/** Join two subtrees whose depths differ by at most two into an AVL-balanced node.
+    Takes over the caller's references to l and r; a side taken apart by a
+    rotation is released once its children have been reused.
+*/
+static struct rope_node *balance_node(struct rope_arena *a, struct rope_node *l, struct rope_node *r)
+{
+    struct rope_node *ret;
+    if (r->depth > l->depth + 1) {
+        if (node_depth(r->right) >= node_depth(r->left))   // single rotation
+            ret = concat_node(a, concat_node(a, l, ref_node(r->left)), ref_node(r->right));
+        else                                                // double rotation
+            ret = concat_node(a, concat_node(a, l, ref_node(r->left->left)),
+                              concat_node(a, ref_node(r->left->right), ref_node(r->right)));
+        free_rope_node(r, false);
+    } else if (l->depth > r->depth + 1) {
+        if (node_depth(l->left) >= node_depth(l->right))
+            ret = concat_node(a, ref_node(l->left), concat_node(a, ref_node(l->right), r));
+        else
+            ret = concat_node(a, concat_node(a, ref_node(l->left), ref_node(l->right->left)),
+                              concat_node(a, ref_node(l->right->right), r));
+        free_rope_node(l, false);
+    } else {
+        ret = concat_node(a, l, r);
+    }
+    return ret;
+}
+
+/** Concatenate two subtrees, descending the spine of the deeper one so the
+    result stays AVL-balanced when both inputs are. Allocates O(|l->depth - r->depth|)
+    nodes and never modifies its inputs.
+    @return A new reference to the joined tree
+*/
+static struct rope_node *join_nodes(struct rope_arena *a, struct rope_node *l, struct rope_node *r)
+{
+    struct rope_node *n;
+    if (l->depth > r->depth + 1) {
+        if ((n = join_nodes(a, l->right, r)) == NULL)
+            return NULL;
+        return balance_node(a, ref_node(l->left), n);
+    }
+    if (r->depth > l->depth + 1) {
+        if ((n = join_nodes(a, l, r->left)) == NULL)
+            return NULL;
+        return balance_node(a, n, ref_node(r->right));
+    }
+    return concat_node(a, ref_node(l), ref_node(r));
+}
+
+/** Copy of n with its rightmost (or leftmost) leaf replaced by leaf, whose weight may differ
+    Takes over the caller's reference to leaf.
+*/
+static struct rope_node *replace_edge_leaf(struct rope_arena *a, struct rope_node *n, struct rope_node *leaf, bool rightmost)
+{
+    struct rope_node *child;
+    if (is_leaf_node(n))
+        return leaf;
+    if ((child = replace_edge_leaf(a, rightmost ? n->right : n->left, leaf, rightmost)) == NULL)
+        return NULL;
+    return rightmost ? concat_node(a, ref_node(n->left), child) : concat_node(a, child, ref_node(n->right));
+}
+
+static struct rope_node *edge_leaf(struct rope_node *n, bool rightmost)
+{
+    while (!is_leaf_node(n))
+        n = rightmost ? n->right : n->left;
+    return n;
+}
+
+/** Concatenate two subtrees, merging the leaves where they meet into a single chunk
+    when one side is a single leaf and both leaves are small. That covers appending
+    or prepending small pieces; larger subtrees are joined as they are.
+    @return A new reference to the concatenation
+*/
+static struct rope_node *concat_nodes(struct rope_arena *a, struct rope_node *l, struct rope_node *r)
+{
+    struct rope_node *edge, *chunk;
+    int size = chunk_size();
+    if (size && (is_leaf_node(r) || is_leaf_node(l))) {
+        bool append = is_leaf_node(r);
+        edge = edge_leaf(append ? l : r, append);
+        if (edge->weight + (append ? r : l)->weight <= size) {
+            if ((chunk = append ? merge_leaves(a, edge, r) : merge_leaves(a, l, edge)) == NULL)
+                return NULL;
+            return replace_edge_leaf(a, append ? l : r, chunk, append);
+        }
+    }
+    return join_nodes(a, l, r);
+}
+
+/** Boehm's balance criterion: a rope of depth d is balanced if it holds at
+    least fib(d + 2) characters. AVL trees always satisfy it, so this only
+    fails for trees that were assembled by hand.
+*/
+static bool node_is_balanced(struct rope_node *n)
+{
+    unsigned long long a = 1, b = 1, t;
+    if (n->depth > ROPE_MAX_DEPTH)
+        return false;
+    for (int i = 0; i < n->depth; ++i) {
+        t = a + b;
+        a = b;
+        b = t;
+    }
+    return (unsigned long long)n->weight >= b;
+}
+
+/** Collect the non-empty leaves under n, left to right, into a growing array.
+    Walks with an explicit stack so degenerate trees can't overflow the call stack.
+    @return the number of leaves, or -1 if out of memory
+*/
+static int collect_leaves(struct rope_node *n, struct rope_node ***leaves)
+{
+    struct rope_node **stack, **out = NULL, **tmp;
+    int top = 0, count = 0, cap = 0;
+    if ((stack = (struct rope_node **)malloc(sizeof(*stack)*(n->depth+1))) == NULL)
+        return -1;
+    stack[top++] = n;
+    while (top) {
+        n = stack[--top];
+        if (!is_leaf_node(n)) {
+            stack[top++] = n->right;
+            stack[top++] = n->left;
+            continue;
+        }
+        if (n->weight == 0)
+            continue;
+        if (count == cap) {
+            cap = cap ? cap*2 : 16;
+            if ((tmp = (struct rope_node **)realloc(out, sizeof(*out)*cap)) == NULL) {
+                free(out);
+                free(stack);
+                return -1;
+            }
+            out = tmp;
+        }
+        out[count++] = n;
+    }
+    free(stack);
+    *leaves = out;
+    return count;
+}
+
+/** Build a perfectly balanced tree over leaves, taking over a reference to each
+*/
+static struct rope_node *build_balanced(struct rope_arena *a, struct rope_node **leaves, int count)
+{
+    if (count == 1)
+        return leaves[0];
+    int half = count/2;
+    return concat_node(a, build_balanced(a, leaves, half), build_balanced(a, leaves+half, count-half));
+}
+
+/** Replace each run of adjacent leaves that fits in a chunk with one chunk
+    Takes over the references in leaves, like build_balanced.
+    @return the new number of leaves, or -1 if out of memory
+*/
+static int coalesce_leaves(struct rope_arena *a, struct rope_node **leaves, int count, int chunk_size)
+{
+    int out = 0, run;
+    int64_t weight;
+    for (int i = 0; i < count; i += run) {
+        weight = leaves[i]->weight;
+        for (run = 1; i+run < count && weight + leaves[i+run]->weight <= chunk_size; ++run)
+            weight += leaves[i+run]->weight;
+        if (run == 1) {
+            leaves[out++] = leaves[i];
+            continue;
+        }
+        struct rope_node *mem;
+        char *data, *p;
+        if ((data = p = alloc_leaf_text(a, weight, &mem)) == NULL)
+            return -1;
+        for (int j = i; j < i+run; ++j) {
+            p = copy_node_range(leaves[j], 0, leaves[j]->weight, p);
+            free_rope_node(leaves[j], false);
+        }
+        *p = '\0';
+        if ((leaves[out++] = owned_leaf(a, mem, data, weight)) == NULL)
+            return -1;
+    }
+    return out;
+}
+
+/** Rebuild the tree above n's leaves with minimal depth. The leaves are shared,
+    not copied, unless they are small enough to coalesce into chunks.
+    @param chunk_size The largest chunk to coalesce leaves into, or 0 for none
+*/
+static struct rope_node *rebalance_node(struct rope_arena *a, struct rope_node *n, int chunk_size)
+{
+    struct rope_node **leaves = NULL;
+    int count = collect_leaves(n, &leaves);
+    for (int i = 0; i < count; ++i)
+        ref_node(leaves[i]);
+    if (count > 0 && chunk_size)
+        count = coalesce_leaves(a, leaves, count, chunk_size);
+    if (count < 0) {
+        free(leaves);
+        return NULL;
+    }
+    n = count ? build_balanced(a, leaves, count) : NULL;
+    free(leaves);
+    return n;
+}
+
+/** Create a balanced rope with the same contents as r
+    Concatenation keeps ropes balanced on its own; this is for ropes that were
+    assembled by hand, or that should be packed as tightly as possible.
+    @return A new rope sharing r's leaves, or NULL on error
+*/
+struct rope *rope_rebalance(struct rope *r)
+{
+    struct rope *ret;
+    if (!r)
+        return NULL;
+    struct rope_arena *a = r->arena;
+    if ((ret = alloc_rope(a)) == NULL)
+        return NULL;
+    struct rope_node *root;
+    if (r->head && ((root = rope_root(r)) == NULL || (ret->head = rebalance_node(a, root, chunk_size())) == NULL)) {
+        rope_free(a, ret);
+        return NULL;
+    }
+    return ret;
+}
+
+/** Build a leaf holding the text in [lo, hi) of leaf n compressed, hi-lo at
+    most ROPE_COMPRESS_MAX
+    Its counts and hash are taken from the text before it is packed away.
+    Text that wouldn't shrink by at least an eighth is left as it is.
+    @return A new reference to the leaf
+*/
+static struct rope_node *compressed_leaf(struct rope_arena *a, struct rope_node *n, int64_t lo, int64_t hi)
+{
+    char packed[ROPE_COMPRESS_MAX];
+    struct rope_node *ret;
+    char *data;
+    int64_t len = lz_compress(n->data+lo, hi-lo, packed, (hi-lo) - (hi-lo)/8);
+    if (!len)
+        return substring_node(a, n, lo, hi);
+    if ((data = (char *)rope_alloc(a, sizeof(len) + len)) == NULL)
+        return NULL;
+    if ((ret = arena_rope_node(a, hi-lo, NULL, NULL, n->data+lo)) == NULL) {
+        rope_free(a, data);
+        return NULL;
+    }
+    node_hash(ret);
+    memcpy(data, &len, sizeof(len));
+    memcpy(data + sizeof(len), packed, len);
+    ret->data = data;
+    ret->flags |= ROPE_NODE_OWNED | ROPE_NODE_COMPRESSED;
+    ret->offset = (int64_t)__atomic_add_fetch(&rope_leaf_ids, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+/** Build n with its leaves of min_leaf characters or more compressed
+    Leaves longer than ROPE_COMPRESS_MAX are compressed in pieces, joined
+    by a balanced subtree; subtrees with nothing to compress are shared, and
+    so are leaves none of whose pieces compress.
+    @return A new reference to the result
+*/
+static struct rope_node *compress_node(struct rope_arena *a, struct rope_node *n, int64_t min_leaf)
+{
+    struct rope_node *left, *right, **pieces;
+    if (!is_leaf_node(n)) {
+        if ((left = compress_node(a, n->left, min_leaf)) == NULL)
+            return NULL;
+        if ((right = compress_node(a, n->right, min_leaf)) == NULL) {
+            free_rope_node(left, false);
+            return NULL;
+        }
+        if (left == n->left && right == n->right) {
+            free_rope_node(left, false);
+            free_rope_node(right, false);
+            return ref_node(n);
+        }
+        return concat_node(a, left, right);
+    }
+    if (n->flags & ROPE_NODE_COMPRESSED || n->weight < min_leaf)
+        return ref_node(n);
+    int count = (int)((n->weight + ROPE_COMPRESS_MAX-1) / ROPE_COMPRESS_MAX), compressed = 0;
+    if ((pieces = (struct rope_node **)malloc(sizeof(*pieces) * count)) == NULL)
+        return NULL;
+    for (int i = 0; i < count; ++i) {
+        int64_t lo = n->weight * i / count, hi = n->weight * (i+1) / count;
+        if ((pieces[i] = compressed_leaf(a, n, lo, hi)) == NULL) {
+            while (i--)
+                free_rope_node(pieces[i], false);
+            free(pieces);
+            return NULL;
+        }
+        compressed += pieces[i]->flags & ROPE_NODE_COMPRESSED ? 1 : 0;
+    }
+    if (!compressed) {
+        for (int i = 0; i < count; ++i)
+            free_rope_node(pieces[i], false);
+        free(pieces);
+        return ref_node(n);
+    }
+    right = build_balanced(a, pieces, count);
+    free(pieces);
+    return right;
+}
+
+/** Create a rope with the same contents as r whose long leaves are compressed
+    Meant for text that is kept but rarely read, like the older parts of a
+    log. A compressed leaf is decompressed into a small per-thread cache
+    whenever it is read, so reading it again soon after is cheap, and edits
+    copy out only the text they cut. Leaves too short to be worth it, and
+    ones that don't compress, are shared with r unchanged.
+    @param min_leaf The shortest leaf to compress; shorter ones than
+           ROPE_INLINE_MAX never are
+    @return A new rope, or NULL on error
+*/
+struct rope *rope_compress(struct rope *r, int64_t min_leaf)
+{
+    struct rope *ret;
+    struct rope_node *root, *n;
+    if (!r)
+        return NULL;
+    struct rope_arena *a = r->arena;
+    if ((ret = alloc_rope(a)) == NULL)
+        return NULL;
+    if (!r->head)
+        return ret;
+    min_leaf = MAX(min_leaf, ROPE_INLINE_MAX+1);
+    if ((root = rope_root(r)) == NULL || (n = compress_node(a, root, min_leaf)) == NULL) {
+        rope_free(a, ret);
+        return NULL;
+    }
+    if (!node_is_balanced(n)) {
+        ret->head = rebalance_node(a, n, 0);
+        free_rope_node(n, false);
+        if (!ret->head) {
+            rope_free(a, ret);
+            return NULL;
+        }
+    } else {
+        ret->head = n;
+    }
+    return ret;
+}
+
+/** Create a rope with the text of r1 followed by that of r2
+    Both ropes must come from the same arena, or both from the heap, since the
+    result shares their nodes and is freed the same way they are.
+    @return A new rope, or NULL with errno EINVAL if r1 and r2 come from
+            different arenas, or NULL on other errors
+*/
+struct rope *rope_concat(struct rope *r1, struct rope *r2)
+{
+    if (!r1 || !r2)
+        return NULL;
+    if (r1->arena != r2->arena) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!r1->head)
+        return rope_copy(r2);
+    if (!r2->head)
+        return rope_copy(r1);
+    struct rope_node *root1 = rope_root(r1), *root2 = rope_root(r2);
+    if (!root1 || !root2)
+        return NULL;
+    struct rope *r;
+    struct rope_node *n;
+    struct rope_arena *a = r1->arena;
+    if ((r = alloc_rope(a)) == NULL)
+        return NULL;
+    if ((r->head = concat_nodes(a, root1, root2)) == NULL) {
+        rope_free(a, r);
+        return NULL;
+    }
+    if (!node_is_balanced(r->head) && (n = rebalance_node(a, r->head, chunk_size())) != NULL) {
+        free_rope_node(r->head, false);
+        r->head = n;
+    }
+    return after_edit(r1->until_check <= r2->until_check ? r1 : r2, r);
+}
+
+/* Subtrees over a power-of-two number of leaves are kept on a stack, largest
+   first, like the digits of a binary counter: pushing a leaf merges it with
+   the subtrees of the same size on top. */
+struct rope_builder {
+    struct rope_arena *arena;
+    struct rope_node *stack[64];
+    int64_t sizes[64];      // leaves under each subtree on the stack
+    int top;
+    char *chunk;            // the chunk rope_builder_push_copy is filling
+    int64_t used;
+    bool failed;            // an allocation failed; finishing returns NULL
+};
+
+/** Start building a rope from a stream of pieces
+    @param a The arena to allocate the rope from, or NULL for the heap
+    @return A new builder, or NULL on error
+*/
+struct rope_builder *new_rope_builder(struct rope_arena *a)
+{
+    struct rope_builder *b;
+    if ((b = (struct rope_builder *)calloc(1, sizeof(struct rope_builder))) == NULL)
+        return NULL;
+    b->arena = a;
+    return b;
+}
+
+/** Abandon a builder and everything pushed into it
+*/
+void free_rope_builder(struct rope_builder *b)
+{
+    if (!b)
+        return;
+    while (b->top)
+        free_rope_node(b->stack[--b->top], false);
+    rope_free(b->arena, b->chunk);
+    free(b);
+}
+
+/** Add a leaf after everything pushed so far, taking over the caller's reference to it
+    Only subtrees of equal size are joined, so they stay perfectly balanced and
+    each leaf costs O(1) amortized.
+*/
+static bool builder_push_leaf(struct rope_builder *b, struct rope_node *leaf)
+{
+    struct rope_node *n;
+    int64_t size = 1;
+    if (!leaf) {
+        b->failed = true;
+        return false;
+    }
+    for (; b->top && b->sizes[b->top-1] == size; size *= 2, leaf = n) {
+        if ((n = concat_node(b->arena, b->stack[b->top-1], leaf)) == NULL) {
+            free_rope_node(leaf, false);
+            b->failed = true;
+            return false;
+        }
+        b->top--;
+    }
+    b->stack[b->top] = leaf;
+    b->sizes[b->top++] = size;
+    return true;
+}
+
+/** Join r, built from the leaves pushed after l, onto the right of l
+    l is a perfect subtree from the stack at least as deep as r, so r hangs off
+    the node on l's right spine as deep as it is, and the spine above that is
+    copied bottom up. Each copy is one deeper than its left sibling, so the
+    result stays AVL-balanced. Takes over the caller's references to l and r.
+*/
+static struct rope_node *builder_join(struct rope_arena *a, struct rope_node *l, struct rope_node *r)
+{
+    struct rope_node *spine[64], *n = l, *child, *joined = r;
+    int depth = 0;
+    while (n->depth > r->depth) {
+        spine[depth++] = n;
+        n = n->right;
+    }
+    for (int i = depth; i >= 0 && joined; --i) {
+        child = ref_node(i == depth ? n : spine[i]->left);
+        if ((n = concat_node(a, child, joined)) == NULL) {
+            free_rope_node(child, false);
+            free_rope_node(joined, false);
+        }
+        joined = n;
+    }
+    free_rope_node(l, false);
+    return joined;
+}
+
+/** Turn the chunk being filled by rope_builder_push_copy into a leaf
+*/
+static bool builder_flush_chunk(struct rope_builder *b)
+{
+    char *chunk = b->chunk;
+    if (!chunk)
+        return true;
+    chunk[b->used] = '\0';
+    b->chunk = NULL;
+    return builder_push_leaf(b, owned_leaf(b->arena, NULL, chunk, b->used));
+}
+
+/** Append len characters at s to the rope being built
+    Like new_rope, the rope points into s, which must outlive it.
+    @return false on error
+*/
+bool rope_builder_push(struct rope_builder *b, char *s, int64_t len)
+{
+    if (b->failed || !builder_flush_chunk(b))
+        return false;
+    if (len <= 0)
+        return true;
+    return builder_push_leaf(b, arena_rope_node(b->arena, len, NULL, NULL, s));
+}
+
+/** The length of s[0, len) without any incomplete UTF-8 sequence at its end
+*/
+static int64_t utf8_complete(const char *s, int64_t len)
+{
+    int64_t i = len;
+    while (i > 0 && len-i < 3 && is_continuation(s[i-1]))
+        --i;
+    if (i == 0)
+        return len;
+    unsigned char lead = s[i-1];
+    int need = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+    return len-(i-1) < need ? i-1 : len;
+}
+
+/** Append a copy of len characters at s to the rope being built
+    Consecutive copies are packed into chunks the rope owns, so s can be
+    reused straight away and small pieces don't each cost a leaf. A chunk
+    never ends partway through a UTF-8 sequence; the start of one is carried
+    over into the next chunk.
+    @return false on error
+*/
+bool rope_builder_push_copy(struct rope_builder *b, const char *s, int64_t len)
+{
+    char carry[4];
+    int64_t n, carried = 0;
+    if (b->failed)
+        return false;
+    while (len > 0 || carried) {
+        if (!b->chunk) {
+            if ((b->chunk = (char *)rope_alloc(b->arena, ROPE_BUILDER_CHUNK+1)) == NULL) {
+                b->failed = true;
+                return false;
+            }
+            memcpy(b->chunk, carry, carried);
+            b->used = carried;
+            carried = 0;
+        }
+        n = MIN(len, ROPE_BUILDER_CHUNK - b->used);
+        memcpy(b->chunk + b->used, s, n);
+        b->used += n;
+        s += n;
+        len -= n;
+        if (b->used == ROPE_BUILDER_CHUNK) {
+            int64_t complete = utf8_complete(b->chunk, b->used);
+            carried = b->used - complete;
+            memcpy(carry, b->chunk + complete, carried);
+            b->used = complete;
+            if (!builder_flush_chunk(b))
+                return false;
+        }
+    }
+    return true;
+}
+
+/** Finish building, and free the builder
+    The subtrees left on the stack are joined smallest first, so the result is
+    within one level of the minimum depth for its number of leaves.
+    @return The rope holding everything pushed, or NULL if anything failed
+*/
+struct rope *rope_builder_finish(struct rope_builder *b)
+{
+    struct rope *r;
+    struct rope_node *n = NULL;
+    if (!builder_flush_chunk(b) || b->failed || (r = alloc_rope(b->arena)) == NULL) {
+        free_rope_builder(b);
+        return NULL;
+    }
+    for (; b->top; b->top--) {
+        n = n ? builder_join(b->arena, b->stack[b->top-1], n) : b->stack[b->top-1];
+        if (!n) {
+            b->top--;
+            rope_free(b->arena, r);
+            free_rope_builder(b);
+            return NULL;
+        }
+    }
+    r->head = n;
+    free_rope_builder(b);
+    return r;
+}
+
+char *rope_tostring(struct rope *r)
+{
+    char *ret;
+    int64_t length = rope_length(r);
+    if ((ret = (char *)malloc(length+1)) == NULL)
+        return NULL;
+    rope_copy_range(r, 0, length, ret);
+    ret[length] = '\0';
+    return ret;
+}
+
+/** Copy the characters in [lo, hi) of r into buf, one memcpy per leaf
+    Subtrees outside the range are never visited. The bounds are clamped to
+    the rope and buf is not NUL terminated.
+    @return the number of characters copied
+*/
+int64_t rope_copy_range(struct rope *r, int64_t lo, int64_t hi, char *buf)
+{
+    lo = lo < 0 ? 0 : lo;
+    hi = hi > rope_length(r) ? rope_length(r) : hi;
+    if (lo >= hi)
+        return 0;
+    if (r->head->flags & ROPE_NODE_SLICE)
+        copy_node_range(r->head->left, r->head->offset + lo, r->head->offset + hi, buf);
+    else
+        copy_node_range(r->head, lo, hi, buf);
+    return hi-lo;
+}
+
+/** Point iov at the leaves holding the characters in [lo, hi) of r, without copying
+    Fills at most iovcnt entries; if the range needs more, call again starting
+    where these left off. The bounds are clamped to the rope. Compressed
+    leaves are pointed at in this thread's decompression cache, so at most
+    ROPE_LEAF_CACHE of them are filled in per call, and the entries stay
+    valid only until other compressed leaves are read on this thread.
+    @return the number of entries filled
+*/
+int rope_iovec(struct rope *r, int64_t lo, int64_t hi, struct iovec *iov, int iovcnt)
+{
+    struct rope_iter it;
+    const char *chunk;
+    int count = 0, compressed = 0;
+    int64_t len;
+    hi = hi > rope_length(r) ? rope_length(r) : hi;
+    if (!rope_iter_init(&it, r, lo))
+        return 0;
+    while (count < iovcnt && compressed < ROPE_LEAF_CACHE && it.pos < hi
+           && (len = rope_iter_next_chunk(&it, &chunk)) > 0) {
+        if (it.path[it.depth-1]->flags & ROPE_NODE_COMPRESSED)
+            compressed++;
+        iov[count].iov_base = (void *)chunk;
+        iov[count++].iov_len = it.pos > hi ? len - (it.pos-hi) : len;
+    }
+    return count;
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#define ROPE_WRITE_BATCH (IOV_MAX < 256 ? IOV_MAX : 256)
+#define ROPE_WRITE_STAGING 16384    // leaves shorter than ROPE_WRITE_COPY are gathered here
+#define ROPE_WRITE_COPY 512
+
+/** Write r to a file descriptor straight from its leaves, with batched writev calls
+    Runs of short leaves are copied into one staging buffer first, since the
+    kernel's cost per iovec entry outweighs copying a few hundred bytes. A
+    batch ends after ROPE_LEAF_CACHE compressed leaves, so the ones it points
+    at are all still in the decompression cache when it is written.
+    @return the number of characters written, or -1 on error with errno set
+*/
+int64_t rope_write(struct rope *r, int fd)
+{
+    struct iovec iov[ROPE_WRITE_BATCH];
+    char staging[ROPE_WRITE_STAGING];
+    struct rope_iter it;
+    const char *chunk;
+    int64_t length = rope_length(r), pos = 0, len;
+    int count, used, compressed;
+    ssize_t written;
+    if (!rope_iter_init(&it, r, 0))
+        return -1;
+    while (pos < length) {
+        rope_iter_seek(&it, pos);
+        count = used = compressed = 0;
+        while (compressed < ROPE_LEAF_CACHE && (len = rope_iter_next_chunk(&it, &chunk)) > 0) {
+            if (it.path[it.depth-1]->flags & ROPE_NODE_COMPRESSED)
+                compressed++;
+            if (len >= ROPE_WRITE_COPY) {
+                if (count == ROPE_WRITE_BATCH)
+                    break;
+                iov[count].iov_base = (void *)chunk;
+                iov[count++].iov_len = len;
+                continue;
+            }
+            if (used + len > ROPE_WRITE_STAGING)
+                break;
+            memcpy(staging+used, chunk, len);
+            if (count && (char *)iov[count-1].iov_base + iov[count-1].iov_len == staging+used) {
+                iov[count-1].iov_len += len;
+            } else if (count < ROPE_WRITE_BATCH) {
+                iov[count].iov_base = staging+used;
+                iov[count++].iov_len = len;
+            } else {
+                break;
+            }
+            used += len;
+        }
+        // whatever didn't fit in this batch is picked up again from pos
+        if ((written = writev(fd, iov, count)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += written;
+    }
+    return pos;
+}
+
+/* rope_save's format, in host byte order: a header, the text of every
+   distinct leaf, padded to 8 bytes, a table of nodes with each node after its
+   children, and a trailer saying where things are. The trailer goes last so
+   the file can be written in one pass, even to a pipe. */
+#define ROPE_FILE_MAGIC "ROPEFIL1"
+#define ROPE_FILE_BYTE_ORDER 0x01020304
+#define ROPE_FILE_CHECKSUM 1    // trailer flag: checksum covers everything before the trailer
+#define ROPE_FILE_LEAF -1       // right of a leaf in the node table
+#define ROPE_SAVE_BUFFER 65536
+
+struct rope_file_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t node_size;     // sizeof(struct rope_file_node)
+};
+
+struct rope_file_node {
+    int64_t weight;
+    int64_t left;           // index of the left child, or a leaf's offset into the text
+    int64_t right;          // index of the right child, or ROPE_FILE_LEAF
+    int64_t newlines;
+    int64_t codepoints;
+    uint64_t hash;
+    uint64_t hash_pow;
+};
+
+struct rope_file_trailer {
+    uint64_t text_length;   // unpadded
+    uint64_t node_count;    // the last node is the head; none for an empty rope
+    uint64_t flags;
+    uint64_t checksum;      // hash of the bytes before the trailer, like rope_hash
+    char magic[8];
+};
+
+/* Open addressing from a node, or a leaf's text, to what was saved for it */
+struct rope_save_slot {
+    const void *key;
+    int64_t value;
+};
+
+struct rope_save {
+    int fd;
+    bool failed;
+    bool checksum;
+    uint64_t sum;
+    char *buf;
+    size_t used;
+    int64_t text_length;
+    struct rope_file_node *nodes;
+    int64_t count;                  // nodes in the table, which has room for slots/2
+    struct rope_save_slot *seen;    // node -> index in the table
+    struct rope_save_slot *texts;   // leaf with the first copy of some text -> its offset
+    int64_t slots;                  // a power of two
+};
+
+static bool save_flush(struct rope_save *st)
+{
+    char *p = st->buf;
+    ssize_t n;
+    while (!st->failed && st->used) {
+        if ((n = write(st->fd, p, st->used)) < 0) {
+            if (errno == EINTR)
+                continue;
+            st->failed = true;
+        } else {
+            p += n;
+            st->used -= n;
+        }
+    }
+    st->used = 0;
+    return !st->failed;
+}
+
+/** Write len bytes at p, folding them into the checksum
+*/
+static void save_bytes(struct rope_save *st, const void *p, size_t len)
+{
+    uint64_t hash, pow;
+    size_t n;
+    if (st->checksum) {
+        hash_text((const char *)p, len, &hash, &pow);
+        st->sum = hash_reduce((unsigned __int128)st->sum * pow + hash);
+    }
+    for (; len && !st->failed; p = (const char *)p + n, len -= n) {
+        if (st->used == ROPE_SAVE_BUFFER)
+            save_flush(st);
+        n = MIN(len, ROPE_SAVE_BUFFER - st->used);
+        memcpy(st->buf + st->used, p, n);
+        st->used += n;
+    }
+}
+
+/** Find the slot for key, a node, in one of st's tables
+    A leaf's text may also be found under another leaf with the same text.
+*/
+static struct rope_save_slot *save_slot(struct rope_save *st, struct rope_save_slot *table, const void *key)
+{
+    const struct rope_node *n, *m = (const struct rope_node *)key;
+    bool texts = table == st->texts;
+    int64_t i = (texts ? m->hash : pointer_hash(key)) & (st->slots-1);
+    for (; (n = (const struct rope_node *)table[i].key) != NULL; i = (i+1) & (st->slots-1)) {
+        if (n == m || (texts && n->weight == m->weight && n->hash == m->hash
+                       && rope_node_equal((struct rope_node *)n, (struct rope_node *)m)))
+            break;
+    }
+    return &table[i];
+}
+
+/** Double the size of st's tables once they are half full
+    @return false if out of memory
+*/
+static bool save_grow(struct rope_save *st)
+{
+    struct rope_save_slot *seen = st->seen, *texts = st->texts;
+    struct rope_file_node *nodes;
+    int64_t slots = st->slots;
+    if (2*(st->count+1) <= slots)
+        return true;
+    if ((nodes = (struct rope_file_node *)realloc(st->nodes, sizeof(struct rope_file_node) * slots)) == NULL)
+        return false;
+    st->nodes = nodes;
+    st->seen = (struct rope_save_slot *)calloc(2*slots, sizeof(struct rope_save_slot));
+    st->texts = (struct rope_save_slot *)calloc(2*slots, sizeof(struct rope_save_slot));
+    if (!st->seen || !st->texts) {
+        free(st->seen);
+        free(st->texts);
+        st->seen = seen;
+        st->texts = texts;
+        return false;
+    }
+    st->slots = 2*slots;
+    for (int64_t i = 0; i < slots; ++i) {
+        if (seen[i].key)
+            *save_slot(st, st->seen, seen[i].key) = seen[i];
+        if (texts[i].key)
+            *save_slot(st, st->texts, texts[i].key) = texts[i];
+    }
+    free(seen);
+    free(texts);
+    return true;
+}
+
+/** Write the text of the leaves under n and add n to the node table, children first
+    Nodes shared within the tree are saved once, and so is text that
+    appears in several leaves.
+    @return n's index in the table
+*/
+static int64_t save_node(struct rope_save *st, struct rope_node *n)
+{
+    struct rope_save_slot *slot = save_slot(st, st->seen, n);
+    struct rope_file_node d;
+    if (slot->key)
+        return slot->value;
+    d.weight = n->weight;
+    d.hash = node_hash(n);
+    d.hash_pow = n->hash_pow;
+    d.newlines = node_newlines(n);
+    d.codepoints = node_codepoints(n);
+    if (is_leaf_node(n)) {
+        struct rope_save_slot *text = save_slot(st, st->texts, n);
+        if (!text->key) {
+            text->key = n;
+            text->value = st->text_length;
+            save_bytes(st, leaf_text(n), n->weight);
+            st->text_length += n->weight;
+        }
+        d.left = text->value;
+        d.right = ROPE_FILE_LEAF;
+    } else {
+        d.left = save_node(st, n->left);
+        d.right = save_node(st, n->right);
+    }
+    if (st->failed)
+        return -1;
+    if (!save_grow(st)) {
+        st->failed = true;
+        errno = ENOMEM;
+        return -1;
+    }
+    st->nodes[st->count] = d;
+    slot = save_slot(st, st->seen, n);     // the tables may have moved
+    slot->key = n;
+    return slot->value = st->count++;
+}
+
+/** Save r to a file descriptor in a form rope_load can map back in without parsing
+    The file is written in one pass. Shared subtrees and repeated leaf text are
+    stored once, with the lengths, counts and hashes of every node.
+    @param checksum Whether to store a checksum for rope_load to verify
+    @return false on error, with errno set
+*/
+bool rope_save(struct rope *r, int fd, bool checksum)
+{
+    struct rope_node *n = rope_root(r);
+    struct rope_file_header header = { ROPE_FILE_MAGIC, ROPE_FILE_BYTE_ORDER, sizeof(struct rope_file_node) };
+    struct rope_file_trailer trailer = { .flags = checksum ? ROPE_FILE_CHECKSUM : 0 };
+    struct rope_save st = { .fd = fd, .checksum = checksum };
+    static const char padding[8];
+    if (r && r->head && !n) {
+        errno = ENOMEM;
+        return false;
+    }
+    st.slots = 64;
+    st.buf = (char *)malloc(ROPE_SAVE_BUFFER);
+    st.nodes = (struct rope_file_node *)malloc(sizeof(struct rope_file_node) * st.slots/2);
+    st.seen = (struct rope_save_slot *)calloc(st.slots, sizeof(struct rope_save_slot));
+    st.texts = (struct rope_save_slot *)calloc(st.slots, sizeof(struct rope_save_slot));
+    if (!st.buf || !st.nodes || !st.seen || !st.texts) {
+        st.failed = true;
+        errno = ENOMEM;
+    } else {
+        save_bytes(&st, &header, sizeof(header));
+        if (n)
+            save_node(&st, n);
+        save_bytes(&st, padding, -st.text_length & 7);
+        save_bytes(&st, st.nodes, sizeof(struct rope_file_node) * st.count);
+        trailer.text_length = st.text_length;
+        trailer.node_count = st.count;
+        trailer.checksum = st.sum;
+        memcpy(trailer.magic, ROPE_FILE_MAGIC, 8);
+        st.checksum = false;
+        save_bytes(&st, &trailer, sizeof(trailer));
+        save_flush(&st);
+    }
+    free(st.buf);
+    free(st.nodes);
+    free(st.seen);
+    free(st.texts);
+    return !st.failed;
+}
+
+/** Map a file written by rope_save back in as a rope
+    The text is used in place, straight from the mapping, and every node is
+    built from the table in one block, so loading costs one pass over the
+    table and never reads the text, unless the file has a checksum to verify.
+    The counts and hashes stored with each node are only trusted in a file
+    with a checksum, and then only if each node's agree with its children's;
+    without one they are counted from the text on first use, as for a new rope.
+    The nodes and the mapping are freed with the last node still in use.
+    @return A new rope, or NULL on error with errno set; EINVAL for a file
+            that isn't a saved rope or is damaged
+*/
+struct rope *rope_load(const char *path)
+{
+    struct rope *r;
+    struct rope_mapping *m = NULL;
+    struct rope_node *nodes = NULL;
+    struct stat st;
+    char *addr;
+    int fd, err;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if ((uint64_t)st.st_size < sizeof(struct rope_file_header) + sizeof(struct rope_file_trailer)
+        || (uint64_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    addr = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = errno;
+    close(fd);
+    if (addr == MAP_FAILED) {
+        errno = err;
+        return NULL;
+    }
+    const struct rope_file_header *header = (const struct rope_file_header *)addr;
+    const struct rope_file_trailer *trailer =
+        (const struct rope_file_trailer *)(addr + st.st_size - sizeof(struct rope_file_trailer));
+    const struct rope_file_node *table;
+    uint64_t text_space = (trailer->text_length + 7) & ~(uint64_t)7, count = trailer->node_count;
+    uint64_t hash, pow;
+    bool trusted = trailer->flags & ROPE_FILE_CHECKSUM;
+    err = EINVAL;
+    if (memcmp(header->magic, ROPE_FILE_MAGIC, 8) || memcmp(trailer->magic, ROPE_FILE_MAGIC, 8)
+        || header->byte_order != ROPE_FILE_BYTE_ORDER || header->node_size != sizeof(struct rope_file_node)
+        || trailer->text_length > (uint64_t)st.st_size || count > (uint64_t)st.st_size
+        || sizeof(*header) + text_space + count * sizeof(*table) + sizeof(*trailer) != (uint64_t)st.st_size)
+        goto fail;
+    if (trailer->flags & ROPE_FILE_CHECKSUM) {
+        hash_text(addr, (char *)trailer - addr, &hash, &pow);
+        if (hash != trailer->checksum)
+            goto fail;
+    }
+    table = (const struct rope_file_node *)(addr + sizeof(*header) + text_space);
+    err = ENOMEM;
+    if ((r = alloc_rope(NULL)) == NULL)
+        goto fail;
+    if (count == 0) {
+        munmap(addr, st.st_size);
+        return r;
+    }
+    if ((m = (struct rope_mapping *)malloc(sizeof(struct rope_mapping))) == NULL
+        || (nodes = (struct rope_node *)malloc(sizeof(struct rope_node) * count)) == NULL) {
+        free(r);
+        goto fail;
+    }
+    err = EINVAL;
+    for (uint64_t i = 0; i < count; ++i) {
+        const struct rope_file_node *d = &table[i];
+        struct rope_node *n = &nodes[i];
+        n->weight = d->weight;
+        n->newlines = trusted ? d->newlines : -1;
+        n->codepoints = trusted ? d->codepoints : -1;
+        n->hash = trusted ? d->hash : 0;
+        n->hash_pow = trusted ? d->hash_pow : 0;
+        n->flags = ROPE_NODE_LOADED;
+        n->refs = 0;
+        n->mapping = m;
+        n->offset = 0;
+        if (d->right == ROPE_FILE_LEAF) {
+            if (d->weight <= 0 || d->left < 0 || (uint64_t)d->left > trailer->text_length
+                || (uint64_t)d->weight > trailer->text_length - d->left
+                || (trusted && (d->newlines < 0 || d->newlines > d->weight
+                                || d->codepoints < 0 || d->codepoints > d->weight)))
+                break;
+            n->left = n->right = NULL;
+            n->data = addr + sizeof(*header) + d->left;
+            n->depth = 0;
+        } else {
+            int64_t weight;
+            if (d->left < 0 || (uint64_t)d->left >= i || d->right < 0 || (uint64_t)d->right >= i
+                || __builtin_add_overflow(nodes[d->left].weight, nodes[d->right].weight, &weight)
+                || weight != d->weight)
+                break;
+            n->left = &nodes[d->left];
+            n->right = &nodes[d->right];
+            n->left->refs++;
+            n->right->refs++;
+            n->data = NULL;
+            n->depth = 1 + MAX(n->left->depth, n->right->depth);
+            if (n->depth > ROPE_MAX_DEPTH)
+                break;
+            if (trusted && (n->newlines != n->left->newlines + n->right->newlines
+                            || n->codepoints != n->left->codepoints + n->right->codepoints
+                            || n->hash_pow != hash_mul(n->left->hash_pow, n->right->hash_pow)
+                            || n->hash != hash_reduce((unsigned __int128)n->left->hash * n->right->hash_pow
+                                                      + n->right->hash)))
+                break;
+        }
+        if (i == count-1)
+            err = 0;
+    }
+    for (uint64_t i = 0; !err && i < count-1; ++i)
+        if (!nodes[i].refs)     // every node but the head must be in the tree
+            err = EINVAL;
+    if (err) {
+        free(r);
+        goto fail;
+    }
+    m->addr = addr;
+    m->length = st.st_size;
+    m->refs = count;
+    m->nodes = nodes;
+    r->head = &nodes[count-1];
+    r->head->refs = 1;
+    return r;
+fail:
+    free(nodes);
+    free(m);
+    munmap(addr, st.st_size);
+    errno = err;
+    return NULL;
+}
+
+/* Compaction thresholds; 0 turns a check off. See rope_set_compaction.
+   Edits on any thread read them, so both are loaded and stored atomically. */
+static double rope_compact_depth = 0;
+static double rope_compact_tiny = 0;
+
+/** Turn automatic compaction on or off
+    While on, ropes made by rope_concat, rope_insert and rope_delete are
+    checked against the thresholds every so many edits, and once either is
+    exceeded their tree is rebuilt balanced, with runs of small leaves
+    copied into chunks.
+    The setting is process-wide and applies to every rope. Set it before
+    ropes are shared between threads: changing it is not a data race, but
+    edits already running on other threads may see the old thresholds, or
+    one old and one new.
+    @param depth_ratio Compact ropes deeper than this times log2 of their
+           length, or 0 to never compact for depth
+    @param tiny_fraction Compact ropes where more than this fraction of the
+           leaves are shorter than ROPE_TINY_LEAF, or 0 to never compact for it
+*/
+void rope_set_compaction(double depth_ratio, double tiny_fraction)
+{
+    depth_ratio = depth_ratio > 0 ? depth_ratio : 0;
+    tiny_fraction = tiny_fraction > 0 ? tiny_fraction : 0;
+    __atomic_store(&rope_compact_depth, &depth_ratio, __ATOMIC_RELAXED);
+    __atomic_store(&rope_compact_tiny, &tiny_fraction, __ATOMIC_RELAXED);
+}
+
+/** Add n to a set of nodes, an open addressing table of *slots pointers
+    @return 1 if n was added, 0 if it was already there, -1 if out of memory
+*/
+static int stats_visit(struct rope_node ***set, int64_t *slots, int64_t *count, struct rope_node *n)
+{
+    struct rope_node **table = *set;
+    int64_t i;
+    if (2*(*count+1) > *slots) {    // keep it at most half full
+        int64_t size = *slots ? 2 * *slots : 64;
+        struct rope_node **grown = (struct rope_node **)calloc(size, sizeof(*grown));
+        if (!grown)
+            return -1;
+        for (int64_t j = 0; j < *slots; ++j) {
+            if (table[j]) {
+                for (i = pointer_hash(table[j]) & (size-1); grown[i]; i = (i+1) & (size-1))
+                    ;
+                grown[i] = table[j];
+            }
+        }
+        free(table);
+        *set = table = grown;
+        *slots = size;
+    }
+    for (i = pointer_hash(n) & (*slots-1); table[i]; i = (i+1) & (*slots-1)) {
+        if (table[i] == n)
+            return 0;
+    }
+    table[i] = n;
+    ++*count;
+    return 1;
+}
+
+/** Measure the shape and memory use of r's tree
+    The tree is walked iteratively, and each node counted once however many
+    times it is shared within it. Only shared nodes are looked up in a set,
+    so the walk costs little more than reading the nodes.
+    @return false if out of memory
+*/
+bool rope_stats(struct rope *r, struct rope_stats *s)
+{
+    struct rope_node *n = r ? r->head : NULL, *tree = NULL, **stack, **seen = NULL;
+    bool *shared;       // whether each node on the stack is under a shared one
+    int64_t slots = 0, count = 0;
+    int top = 0, added;
+    memset(s, 0, sizeof(*s));
+    if (!n)
+        return true;
+    s->length = n->weight;
+    if (n->flags & ROPE_NODE_SLICE) {   // the slice is a node of its own over the sliced tree
+        s->nodes = 1;
+        s->node_bytes = sizeof(struct rope_node);
+        s->pinned_bytes = n->left->weight - n->weight;
+        tree = __atomic_load_n(&n->right, __ATOMIC_ACQUIRE);   // and the tree rope_root built for it, if any
+        n = n->left;
+        s->depth = 1;
+    }
+    s->depth += MAX(n->depth, node_depth(tree));
+    stack = (struct rope_node **)malloc(sizeof(*stack) * (s->depth+1));
+    shared = (bool *)malloc(sizeof(*shared) * (s->depth+1));
+    if (!stack || !shared) {
+        free(stack);
+        free(shared);
+        return false;
+    }
+    if (tree) {
+        stack[top] = tree;
+        shared[top++] = false;
+    }
+    stack[top] = n;
+    shared[top++] = false;
+    while (top) {
+        n = stack[--top];
+        bool under = shared[top];
+        if (__atomic_load_n(&n->refs, __ATOMIC_ACQUIRE) > 1) {   // other threads may be taking or dropping references
+            if ((added = stats_visit(&seen, &slots, &count, n)) < 0) {
+                top = -1;
+                break;
+            }
+            if (!added)
+                continue;
+            s->shared_nodes++;
+            if (!under)     // the outermost shared subtree
+                s->shared_bytes += n->weight;
+            under = true;
+        }
+        s->nodes++;
+        s->node_bytes += sizeof(struct rope_node);
+        if (!is_leaf_node(n)) {
+            stack[top] = n->right;
+            shared[top++] = under;
+            stack[top] = n->left;
+            shared[top++] = under;
+            continue;
+        }
+        int bucket = 0;
+        for (int64_t size = n->weight; size && bucket < ROPE_STATS_BUCKETS-1; size >>= 1)
+            bucket++;
+        s->leaves++;
+        s->leaf_sizes[bucket]++;
+        s->tiny_leaves += n->weight < ROPE_TINY_LEAF;
+        if (n->flags & ROPE_NODE_COMPRESSED) {
+            int64_t packed;
+            memcpy(&packed, n->data, sizeof(packed));
+            s->compressed_leaves++;
+            s->text_bytes += sizeof(packed) + packed;
+        } else {
+            s->text_bytes += n->weight;
+        }
+    }
+    free(stack);
+    free(shared);
+    free(seen);
+    return top == 0;
+}
+
+/** Write s as a JSON object, for dashboards and logs
+    @return the length of the whole object, like snprintf; it was truncated
+            to fit buf if that is size or more
+*/
+int rope_stats_json(const struct rope_stats *s, char *buf, size_t size)
+{
+    int len = snprintf(buf, size, "{\"length\":%lld,\"depth\":%d,\"nodes\":%lld,\"leaves\":%lld,"
+                       "\"tiny_leaves\":%lld,\"shared_nodes\":%lld,\"shared_bytes\":%lld,"
+                       "\"pinned_bytes\":%lld,\"node_bytes\":%lld,\"text_bytes\":%lld,"
+                       "\"compressed_leaves\":%lld,\"leaf_sizes\":[",
+                       (long long)s->length, s->depth, (long long)s->nodes, (long long)s->leaves,
+                       (long long)s->tiny_leaves, (long long)s->shared_nodes, (long long)s->shared_bytes,
+                       (long long)s->pinned_bytes, (long long)s->node_bytes, (long long)s->text_bytes,
+                       (long long)s->compressed_leaves);
+    for (int i = 0; i < ROPE_STATS_BUCKETS; ++i)
+        len += snprintf(buf ? buf + MIN((size_t)len, size) : NULL, (size_t)len < size ? size - len : 0,
+                        i ? ",%lld" : "%lld", (long long)s->leaf_sizes[i]);
+    len += snprintf(buf ? buf + MIN((size_t)len, size) : NULL, (size_t)len < size ? size - len : 0, "]}");
+    return len;
+}
+
+/** Check a rope just made by an edit of from against the compaction
+    thresholds, and compact it in place if it is past them
+    A check walks the whole tree, so it is only made once every so many
+    edits, in proportion to the size of the tree when it was last checked;
+    the count is carried from rope to rope as they are edited.
+    @return r
+*/
+static struct rope *after_edit(struct rope *from, struct rope *r)
+{
+    struct rope_stats s;
+    struct rope_node *root, *n;
+    double depth_ratio, tiny_fraction;
+    int size = chunk_size();
+    __atomic_load(&rope_compact_depth, &depth_ratio, __ATOMIC_RELAXED);
+    __atomic_load(&rope_compact_tiny, &tiny_fraction, __ATOMIC_RELAXED);
+    if (!r || !r->head || (!depth_ratio && !tiny_fraction))
+        return r;
+    if ((r->until_check = from->until_check - 1) > 0)
+        return r;
+    if (!rope_stats(r, &s))
+        return r;
+    r->until_check = MAX(ROPE_COMPACT_EDITS, s.nodes / ROPE_COMPACT_EDITS);
+    if (!(depth_ratio && s.depth > depth_ratio * log2((double)s.length + 1))
+        && !(tiny_fraction && s.tiny_leaves > tiny_fraction * s.leaves))
+        return r;
+    if ((root = rope_root(r)) && (n = rebalance_node(r->arena, root, size ? size : ROPE_BUILDER_CHUNK))) {
+        free_rope_node(r->head, false);
+        r->head = n;
+    }
+    return r;
+}
+
+/** Allocate a node holding a single reference
+    The new node takes over the caller's references to left and right.
+    @return The node, or NULL on error; with errno EINVAL if it would be
+            INT16_MAX or more levels deep, which only hand-built trees reach
+*/
+struct rope_node *alloc_rope_node(int64_t weight, struct rope_node *left, struct rope_node *right, char *data)
+{
+    return arena_rope_node(NULL, weight, left, right, data);
+}
+
+static struct rope_node *arena_rope_node(struct rope_arena *a, int64_t weight, struct rope_node *left,
+                                         struct rope_node *right, char *data)
+{
+    struct rope_node *ret;
+    if (MAX(node_depth(left), node_depth(right)) >= INT16_MAX - 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((ret = (struct rope_node *)rope_alloc(a, sizeof(struct rope_node))) == NULL)
+        return NULL;
+    return init_rope_node(ret, a, weight, left, right, data);
+}
+
+/** Fill in a node in memory from rope_alloc
+    @return ret
+*/
+static struct rope_node *init_rope_node(struct rope_node *ret, struct rope_arena *a, int64_t weight,
+                                        struct rope_node *left, struct rope_node *right, char *data)
+{
+    ret->weight = weight;
+    ret->left = left;
+    ret->right = right;
+    ret->data = data;
+    ret->depth = left || right ? 1 + MAX(node_depth(left), node_depth(right)) : 0;
+    if (left || right) {
+        ret->newlines = (left && __atomic_load_n(&left->newlines, __ATOMIC_RELAXED) < 0)
+                        || (right && __atomic_load_n(&right->newlines, __ATOMIC_RELAXED) < 0)
+                        ? -1 : node_newlines(left) + node_newlines(right);
+        ret->codepoints = (left && __atomic_load_n(&left->codepoints, __ATOMIC_RELAXED) < 0)
+                          || (right && __atomic_load_n(&right->codepoints, __ATOMIC_RELAXED) < 0)
+                          ? -1 : node_codepoints(left) + node_codepoints(right);
+    } else {
+        ret->newlines = data ? -1 : 0;     // counted on first use, which may never come
+        ret->codepoints = data ? -1 : 0;
+    }
+    ret->flags = a ? ROPE_NODE_ARENA : 0;
+    ret->hash_pow = 0;
+    if (left && right && node_is_hashed(left) && node_is_hashed(right))
+        node_hash(ret);     // two multiplications, cheaper than finding out later
+    ret->refs = 1;
+    ret->mapping = NULL;
+    ret->offset = 0;
+    return ret;
+}
+
+/** Build the subtree holding the text in [lo, hi) of n
+    Nodes that lie entirely inside the range are shared rather than copied, so
+    this allocates O(depth) nodes. Leaves cut at either end point into the
+    original text, except for owned chunks, whose text is copied.
+    @return A new reference to the subtree
+*/
+static struct rope_node *substring_node(struct rope_arena *a, struct rope_node *n, int64_t lo, int64_t hi)
+{
+    struct rope_node *left, *right, *ret;
+    if (lo <= 0 && hi >= n->weight)
+        return ref_node(n);
+    int size = chunk_size();
+    if (size && hi-lo <= size)
+        return new_chunk(a, n, lo, hi);
+    if (is_leaf_node(n)) {
+        if (n->flags & (ROPE_NODE_OWNED | ROPE_NODE_INLINE))
+            return new_chunk(a, n, lo, hi);
+        if ((ret = arena_rope_node(a, hi-lo, NULL, NULL, n->data+lo)) != NULL)
+            ret->mapping = ref_mapping(n->mapping);
+        return ret;
+    }
+    int64_t left_weight = n->left->weight;
+    if (hi <= left_weight)
+        return substring_node(a, n->left, lo, hi);
+    if (lo >= left_weight)
+        return substring_node(a, n->right, lo-left_weight, hi-left_weight);
+    if ((left = substring_node(a, n->left, lo, left_weight)) == NULL)
+        return NULL;
+    if ((right = substring_node(a, n->right, 0, hi-left_weight)) == NULL)
+        return NULL;
+    ret = concat_nodes(a, left, right);
+    free_rope_node(left, false);
+    free_rope_node(right, false);
+    return ret;
+}
+
+/** Concatenate two subtrees, either of which may be NULL
+    @return A new reference to the concatenation
+*/
+static struct rope_node *concat_maybe(struct rope_arena *a, struct rope_node *l, struct rope_node *r)
+{
+    if (!l)
+        return ref_node(r);
+    if (!r)
+        return ref_node(l);
+    return concat_nodes(a, l, r);
+}
+
+/** Concatenate two subtrees, either of which may be NULL, and drop the caller's references to them
+*/
+static struct rope_node *concat_consume(struct rope_arena *a, struct rope_node *l, struct rope_node *r)
+{
+    struct rope_node *ret = concat_maybe(a, l, r);
+    free_rope_node(l, false);
+    free_rope_node(r, false);
+    return ret;
+}
+
+/** Split n into new references to the text before and after index
+    Only the nodes on the path to index are rebuilt, joining the pieces cut off
+    on either side back together on the way up, so both halves stay balanced.
+*/
+static void split_node(struct rope_arena *a, struct rope_node *n, int64_t index,
+                       struct rope_node **left, struct rope_node **right)
+{
+    struct rope_node *part;
+    if (index <= 0 || index >= n->weight) {
+        *left = index <= 0 ? NULL : ref_node(n);
+        *right = index <= 0 ? ref_node(n) : NULL;
+        return;
+    }
+    if (is_leaf_node(n)) {
+        *left = substring_node(a, n, 0, index);
+        *right = substring_node(a, n, index, n->weight);
+        return;
+    }
+    int64_t left_weight = n->left->weight;
+    if (index < left_weight) {
+        split_node(a, n->left, index, left, &part);
+        *right = concat_consume(a, part, ref_node(n->right));
+    } else {
+        split_node(a, n->right, index-left_weight, &part, right);
+        *left = concat_consume(a, ref_node(n->left), part);
+    }
+}
+
+/** Insert leaf into n before index, taking over the caller's reference to leaf
+    Descends once, rejoining each level as it returns; a level grows by at most
+    two, so each join only touches a couple of nodes.
+    @return A new reference to the result
+*/
+static struct rope_node *insert_node(struct rope_arena *a, struct rope_node *n, int64_t index, struct rope_node *leaf)
+{
+    struct rope_node *before, *after;
+    if (index <= 0)
+        return concat_consume(a, leaf, ref_node(n));
+    if (index >= n->weight)
+        return concat_consume(a, ref_node(n), leaf);
+    if (is_leaf_node(n)) {
+        split_node(a, n, index, &before, &after);
+        return concat_consume(a, concat_consume(a, before, leaf), after);
+    }
+    int64_t left_weight = n->left->weight;
+    if (index <= left_weight)
+        return concat_consume(a, insert_node(a, n->left, index, leaf), ref_node(n->right));
+    return concat_consume(a, ref_node(n->left), insert_node(a, n->right, index-left_weight, leaf));
+}
+
+/** Remove the text in [lo, hi) from n, which must lie within n
+    @return A new reference to what is left, NULL if nothing is
+*/
+static struct rope_node *delete_node(struct rope_arena *a, struct rope_node *n, int64_t lo, int64_t hi)
+{
+    struct rope_node *left, *right;
+    if (lo <= 0 && hi >= n->weight)
+        return NULL;
+    if (is_leaf_node(n)) {
+        left = lo > 0 ? substring_node(a, n, 0, lo) : NULL;
+        right = hi < n->weight ? substring_node(a, n, hi, n->weight) : NULL;
+        return concat_consume(a, left, right);
+    }
+    int64_t left_weight = n->left->weight;
+    left = lo < left_weight ? delete_node(a, n->left, lo, hi < left_weight ? hi : left_weight) : ref_node(n->left);
+    right = hi > left_weight ? delete_node(a, n->right, lo > left_weight ? lo-left_weight : 0, hi-left_weight)
+                             : ref_node(n->right);
+    return concat_consume(a, left, right);
+}
+
+/** Split r in two at index
+    @param left Set to a new rope holding the characters before index
+    @param right Set to a new rope holding the rest
+    @return false on error
+*/
+bool rope_split(struct rope *r, int64_t index, struct rope **left, struct rope **right)
+{
+    if (!r)
+        return false;
+    struct rope_arena *a = r->arena;
+    struct rope_node *root = rope_root(r);
+    if (r->head && !root)
+        return false;
+    if ((*left = alloc_rope(a)) == NULL)
+        return false;
+    if ((*right = alloc_rope(a)) == NULL) {
+        rope_free(a, *left);
+        return false;
+    }
+    if (root)
+        split_node(a, root, index, &(*left)->head, &(*right)->head);
+    return true;
+}
+
+/** Create a rope with s inserted before index
+    Strings of up to ROPE_INLINE_MAX characters are copied into the new leaf;
+    longer ones are pointed into rather than copied, like new_rope.
+    @return A new rope sharing most of its nodes with r, or NULL on error
+*/
+struct rope *rope_insert(struct rope *r, int64_t index, char *s)
+{
+    struct rope *ret;
+    struct rope_node *leaf, *root;
+    if (!r)
+        return NULL;
+    struct rope_arena *a = r->arena;
+    if (!strcmp(s, ""))
+        return rope_copy(r);
+    if ((root = rope_root(r)) == NULL && r->head)
+        return NULL;
+    if ((ret = alloc_rope(a)) == NULL)
+        return NULL;
+    int64_t len = strlen(s);
+    struct rope_node *mem;
+    char *data;
+    if (len > ROPE_INLINE_MAX)
+        leaf = arena_rope_node(a, len, NULL, NULL, s);
+    else if ((data = alloc_leaf_text(a, len, &mem)) != NULL)
+        leaf = owned_leaf(a, mem, memcpy(data, s, len+1), len);
+    else
+        leaf = NULL;
+    if (leaf == NULL) {
+        rope_free(a, ret);
+        return NULL;
+    }
+    ret->head = root ? insert_node(a, root, index, leaf) : leaf;
+    return after_edit(r, ret);
+}
+
+/** Create a rope with the characters in [lo, hi) of r removed
+    The bounds are clamped to the rope.
+    @return A new rope sharing most of its nodes with r, or NULL on error
+*/
+struct rope *rope_delete(struct rope *r, int64_t lo, int64_t hi)
+{
+    struct rope *ret;
+    struct rope_node *root = NULL;
+    if (!r)
+        return NULL;
+    lo = lo < 0 ? 0 : lo;
+    hi = hi > rope_length(r) ? rope_length(r) : hi;
+    if (lo < hi && (root = rope_root(r)) == NULL)
+        return NULL;
+    if ((ret = alloc_rope(r->arena)) == NULL)
+        return NULL;
+    if (lo >= hi)
+        ret->head = ref_node(r->head);
+    else
+        ret->head = delete_node(r->arena, root, lo, hi);
+    return after_edit(r, ret);
+}
+
+/** Make a slice over the text in [lo, hi) of n, or the subtree itself when that is no dearer
+    A slice costs one node however large the range, but keeps all of n alive,
+    so ranges that are a small part of n are built as trees of their own.
+    @return A new reference to the slice or subtree
+*/
+static struct rope_node *slice_node(struct rope_arena *a, struct rope_node *n, int64_t lo, int64_t hi)
+{
+    struct rope_node *ret;
+    int size = chunk_size();
+    if (n->flags & ROPE_NODE_SLICE) {   // a slice of a slice is a slice of the original
+        lo += n->offset;
+        hi += n->offset;
+        n = n->left;
+    }
+    if (is_leaf_node(n) || (lo <= 0 && hi >= n->weight) || (hi-lo) * ROPE_SLICE_PIN < n->weight
+        || (size && hi-lo <= size))
+        return substring_node(a, n, lo, hi);
+    if ((ret = arena_rope_node(a, hi-lo, ref_node(n), NULL, NULL)) == NULL) {
+        free_rope_node(n, false);
+        return NULL;
+    }
+    ret->flags |= ROPE_NODE_SLICE;
+    ret->offset = lo;
+    ret->newlines = -1;     // rope_root counts them in the tree it builds
+    ret->codepoints = -1;
+    return ret;
+}
+
+/** Create a rope holding the characters in [lo, hi) of r
+    The new rope is a slice: one node pointing at the range of r's tree. It is
+    built into a tree of its own only when it is edited or searched, so taking
+    windows of a rope, and windows of those, costs O(1) nodes each. Reading
+    single characters or copying text out reads through the slice instead.
+    The tree is kept alongside the slice, which is never replaced, so a slice
+    can be read from several threads at once like any other rope.
+    The bounds are clamped to the rope.
+    @return A new rope sharing r's nodes, or NULL on error
+*/
+struct rope *rope_substring(struct rope *r, int64_t lo, int64_t hi)
+{
+    struct rope *ret;
+    if (!r)
+        return NULL;
+    struct rope_arena *a = r->arena;
+    if ((ret = alloc_rope(a)) == NULL)
+        return NULL;
+    lo = lo < 0 ? 0 : lo;
+    hi = hi > rope_length(r) ? rope_length(r) : hi;
+    if (lo < hi && (ret->head = slice_node(a, r->head, lo, hi)) == NULL) {
+        rope_free(a, ret);
+        return NULL;
+    }
+    return ret;
+}
+
+/** Start a cursor over r at pos
+    @return false with errno EINVAL if r is too deep to walk; rope_rebalance it first
+*/
+bool rope_iter_init(struct rope_iter *it, struct rope *r, int64_t pos)
+{
+    it->rope = r;
+    return rope_iter_seek(it, pos);
+}
+
+/** Move the cursor to pos, clamped to the rope, with a walk down from the head
+    @return false with errno EINVAL if the rope is too deep to walk
+*/
+bool rope_iter_seek(struct rope_iter *it, int64_t pos)
+{
+    struct rope_node *n = rope_root(it->rope);
+    int64_t length = rope_length(it->rope);
+    it->pos = pos = pos < 0 ? 0 : pos > length ? length : pos;
+    it->depth = 0;
+    it->leaf_start = 0;
+    if (!n)
+        return !it->rope || !it->rope->head;
+    if (n->depth > ROPE_MAX_DEPTH) {
+        errno = EINVAL;
+        return false;
+    }
+    it->path[it->depth] = n;
+    it->went_right[it->depth++] = false;
+    while (!is_leaf_node(n)) {
+        bool right = pos - it->leaf_start >= n->left->weight;
+        if (right)
+            it->leaf_start += n->left->weight;
+        n = right ? n->right : n->left;
+        it->path[it->depth] = n;
+        it->went_right[it->depth++] = right;
+    }
+    return true;
+}
+
+int64_t rope_iter_pos(struct rope_iter *it)
+{
+    return it->pos;
+}
+
+/** Move the cursor's path to the next (or previous) non-empty leaf
+    leaf_start is updated, pos is left alone.
+    @return false if there is no such leaf
+*/
+static bool iter_step_leaf(struct rope_iter *it, bool forward)
+{
+    struct rope_node *n;
+    int depth = it->depth;
+    int64_t leaf_start = it->leaf_start;
+    do {
+        n = it->path[depth-1];
+        if (forward)
+            leaf_start += n->weight;
+        // climb to the nearest ancestor we reached from the other side
+        while (depth > 1 && it->went_right[depth-1] == forward)
+            depth--;
+        if (depth <= 1)
+            return false;
+        n = forward ? it->path[depth-2]->right : it->path[depth-2]->left;
+        it->path[depth-1] = n;
+        it->went_right[depth-1] = forward;
+        while (!is_leaf_node(n)) {
+            n = forward ? n->left : n->right;
+            it->path[depth] = n;
+            it->went_right[depth++] = !forward;
+        }
+        if (!forward)
+            leaf_start -= n->weight;
+        it->depth = depth;
+        it->leaf_start = leaf_start;
+    } while (n->weight == 0);
+    return true;
+}
+
+/** Read the character under the cursor and move past it
+    @return the character as an unsigned char, or -1 at the end of the rope
+*/
+int rope_iter_next(struct rope_iter *it)
+{
+    struct rope_node *leaf;
+    if (!it->depth)
+        return -1;
+    leaf = it->path[it->depth-1];
+    if (it->pos - it->leaf_start >= leaf->weight) {
+        if (!iter_step_leaf(it, true))
+            return -1;
+        leaf = it->path[it->depth-1];
+    }
+    return (unsigned char)leaf_text(leaf)[it->pos++ - it->leaf_start];
+}
+
+/** Move the cursor back one character and read it
+    @return the character as an unsigned char, or -1 at the start of the rope
+*/
+int rope_iter_prev(struct rope_iter *it)
+{
+    struct rope_node *leaf;
+    if (!it->depth)
+        return -1;
+    if (it->pos == it->leaf_start && !iter_step_leaf(it, false))
+        return -1;
+    leaf = it->path[it->depth-1];
+    return (unsigned char)leaf_text(leaf)[--it->pos - it->leaf_start];
+}
+
+/** Read the rest of the leaf under the cursor and move past it
+    @param data Set to the first character read; not NUL terminated. Text
+           of a compressed leaf stays valid until ROPE_LEAF_CACHE other
+           compressed leaves have been read on this thread.
+    @return the number of characters read, 0 at the end of the rope
+*/
+int64_t rope_iter_next_chunk(struct rope_iter *it, const char **data)
+{
+    struct rope_node *leaf;
+    int64_t offset;
+    if (!it->depth)
+        return 0;
+    leaf = it->path[it->depth-1];
+    if (it->pos - it->leaf_start >= leaf->weight) {
+        if (!iter_step_leaf(it, true))
+            return 0;
+        leaf = it->path[it->depth-1];
+    }
+    offset = it->pos - it->leaf_start;
+    *data = leaf_text(leaf) + offset;
+    it->pos = it->leaf_start + leaf->weight;
+    return leaf->weight - offset;
+}
+
+/** Read the part of a leaf just before the cursor and move back over it
+    @param data Set to the first character read; not NUL terminated, and
+           valid as long as rope_iter_next_chunk's
+    @return the number of characters read, 0 at the start of the rope
+*/
+int64_t rope_iter_prev_chunk(struct rope_iter *it, const char **data)
+{
+    int64_t length;
+    if (!it->depth)
+        return 0;
+    if (it->pos == it->leaf_start && !iter_step_leaf(it, false))
+        return 0;
+    length = it->pos - it->leaf_start;
+    *data = leaf_text(it->path[it->depth-1]);
+    it->pos = it->leaf_start;
+    return length;
+}
+
+/** Find the first occurrence of needle, m >= 1 characters long, in s[0, len)
+    Candidates are filtered by comparing the first and last characters of
+    needle against a whole vector of positions at once; only positions where
+    both match are compared in full.
+    @return the offset of the match in s, or -1
+*/
+static int64_t find_in_chunk(const char *s, int64_t len, const char *needle, int64_t m)
+{
+    const char *p;
+    int64_t i = 0, rest = m > 2 ? m-2 : 0;
+#if defined(__AVX2__)
+    __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[m-1]);
+    for (; i + 32 + m-1 <= len; i += 32) {
+        __m256i f = _mm256_loadu_si256((const __m256i *)(s+i));
+        __m256i l = _mm256_loadu_si256((const __m256i *)(s+i+m-1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, f),
+                                                              _mm256_cmpeq_epi8(last, l)));
+        for (; mask; mask &= mask-1) {
+            int64_t j = i + __builtin_ctz(mask);
+            if (!memcmp(s+j+1, needle+1, rest))
+                return j;
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[m-1]);
+    for (; i + 16 + m-1 <= len; i += 16) {
+        __m128i f = _mm_loadu_si128((const __m128i *)(s+i));
+        __m128i l = _mm_loadu_si128((const __m128i *)(s+i+m-1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, f), _mm_cmpeq_epi8(last, l)));
+        for (; mask; mask &= mask-1) {
+            int64_t j = i + __builtin_ctz(mask);
+            if (!memcmp(s+j+1, needle+1, rest))
+                return j;
+        }
+    }
+#endif
+    for (; i + m <= len; i = p-s + 1) {    // the tail, or everything without SIMD
+        if ((p = (const char *)memchr(s+i, needle[0], len-m+1 - i)) == NULL)
+            return -1;
+        if (p[m-1] == needle[m-1] && !memcmp(p+1, needle+1, rest))
+            return p-s;
+    }
+    return -1;
+}
+
+/** Record the offsets of the matches of needle in s[0, len) that start before limit
+    @param base The offset of s in the rope
+    @return the new number of offsets recorded
+*/
+static int report_matches(const char *s, int64_t len, int64_t limit, const char *needle, int64_t m,
+                          int64_t base, int64_t *offsets, int found, int max)
+{
+    int64_t k;
+    for (int64_t start = 0; found < max && (k = find_in_chunk(s+start, len-start, needle, m)) >= 0
+                        && start+k < limit; start += k+1)
+        offsets[found++] = base + start+k;
+    return found;
+}
+
+/** Record the offsets of up to max occurrences of needle in r at or after from
+    Long leaves are searched in place. Short ones are gathered into a window
+    so the search doesn't stall on per-leaf overhead. A match straddling the
+    window and the next long leaf is found by keeping the last m-1 characters
+    seen and searching them together with the first m-1 characters of the
+    leaf, so the rope is never flattened.
+    @return the number of offsets recorded, or -1 on error
+*/
+static int find_matches(struct rope *r, const char *needle, int64_t from, int64_t *offsets, int max)
+{
+    struct rope_iter it;
+    const char *chunk;
+    char stack[ROPE_FIND_WINDOW], *win = stack;
+    int64_t m = strlen(needle), cap = ROPE_FIND_WINDOW - (m-1), wlen = 0, pos, len, head, keep;
+    int found = 0;
+    if (cap < 2*m) {    // room for the carried characters plus at least a needle's worth
+        cap = 2*m;
+        if ((win = (char *)malloc(cap + m-1)) == NULL)
+            return -1;
+    }
+    if (!rope_iter_init(&it, r, from)) {
+        if (win != stack)
+            free(win);
+        return -1;
+    }
+    pos = rope_iter_pos(&it);   // offset just past the window
+    while (found < max && (len = rope_iter_next_chunk(&it, &chunk)) > 0) {
+        if (len < ROPE_FIND_COPY && wlen + len <= cap) {
+            memcpy(win+wlen, chunk, len);
+            wlen += len;
+            pos += len;
+            continue;
+        }
+        // matches starting in the window, then inside this leaf
+        head = len < m-1 ? len : m-1;
+        memcpy(win+wlen, chunk, head);
+        found = report_matches(win, wlen+head, wlen, needle, m, pos-wlen, offsets, found, max);
+        found = report_matches(chunk, len, len, needle, m, pos, offsets, found, max);
+        // carry over the characters that could still start a match
+        if (len >= m-1) {
+            memcpy(win, chunk+len-(m-1), m-1);
+            wlen = m-1;
+        } else {
+            keep = wlen+len < m-1 ? wlen+len : m-1;
+            memmove(win, win+wlen+len-keep, keep);
+            wlen = keep;
+        }
+        pos += len;
+    }
+    if (found < max)
+        found = report_matches(win, wlen, wlen, needle, m, pos-wlen, offsets, found, max);
+    if (win != stack)
+        free(win);
+    return found;
+}
+
+/** Find the first occurrence of needle in r at or after from
+    @return the offset of the match, or -1 if there is none
+*/
+int64_t rope_find(struct rope *r, const char *needle, int64_t from)
+{
+    int64_t offset;
+    from = from < 0 ? 0 : from;
+    if (!*needle)
+        return from <= rope_length(r) ? from : -1;
+    return find_matches(r, needle, from, &offset, 1) == 1 ? offset : -1;
+}
+
+/** Find the occurrences of needle in r at or after from, overlapping ones included
+    @param offsets Filled with the offsets of the matches, in order
+    @param max The most matches to record; continue from the last one + 1 for more
+    @return the number of matches recorded, or -1 on error
+*/
+int rope_find_all(struct rope *r, const char *needle, int64_t from, int64_t *offsets, int max)
+{
+    if (!*needle || max <= 0)
+        return 0;
+    return find_matches(r, needle, from, offsets, max);
+}
+
+/* One participant's share of a job's tasks. The owner takes from the front,
+   thieves from the back. */
+struct rope_pool_deque {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+};
+
+struct rope_pool {
+    pthread_t *threads;
+    int nthreads;
+    struct rope_pool_deque *deques;     // one per thread, plus one for the caller
+    pthread_mutex_t lock;               // guards everything below
+    pthread_cond_t work;
+    pthread_cond_t done;
+    void (*task)(void *ctx, int index);
+    void *ctx;
+    unsigned generation;    // bumped for each job
+    int pending;            // tasks of the current job not yet finished
+    int busy;               // threads that haven't finished with the current job
+    bool stopping;
+};
+
+/** Take a task from me's own share, or steal one from the back of another's
+    @return false once there is nothing left anywhere
+*/
+static bool pool_next_task(struct rope_pool *p, int me, int *index)
+{
+    int participants = p->nthreads + 1;
+    for (int i = 0; i < participants; ++i) {
+        struct rope_pool_deque *d = &p->deques[(me + i) % participants];
+        pthread_mutex_lock(&d->lock);
+        bool found = d->head < d->tail;
+        if (found)
+            *index = i == 0 ? d->head++ : --d->tail;
+        pthread_mutex_unlock(&d->lock);
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+static void pool_work(struct rope_pool *p, int me, void (*task)(void *, int), void *ctx)
+{
+    int index;
+    while (pool_next_task(p, me, &index)) {
+        task(ctx, index);
+        pthread_mutex_lock(&p->lock);
+        if (--p->pending == 0)
+            pthread_cond_broadcast(&p->done);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+struct rope_pool_thread {
+    struct rope_pool *pool;
+    int me;
+};
+
+static void *pool_thread(void *arg)
+{
+    struct rope_pool *p = ((struct rope_pool_thread *)arg)->pool;
+    int me = ((struct rope_pool_thread *)arg)->me;
+    unsigned seen = 0;
+    free(arg);
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->generation == seen && !p->stopping)
+            pthread_cond_wait(&p->work, &p->lock);
+        if (p->stopping)
+            break;
+        seen = p->generation;
+        void (*task)(void *, int) = p->task;
+        void *ctx = p->ctx;
+        pthread_mutex_unlock(&p->lock);
+        pool_work(p, me, task, ctx);
+        pthread_mutex_lock(&p->lock);
+        if (--p->busy == 0)
+            pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/** Create a pool of threads for the parallel rope functions
+    The thread calling into the pool works alongside them, so a pool of 0
+    threads is valid and runs everything on the caller.
+    @param threads The number of threads to start, or -1 for one per online CPU but the caller's
+    @return A new pool, or NULL on error
+*/
+struct rope_pool *new_rope_pool(int threads)
+{
+    struct rope_pool *p;
+    if (threads < 0)
+        threads = MAX(sysconf(_SC_NPROCESSORS_ONLN) - 1, 0);
+    if ((p = (struct rope_pool *)calloc(1, sizeof(struct rope_pool))) == NULL)
+        return NULL;
+    p->threads = (pthread_t *)malloc(sizeof(pthread_t) * (threads ? threads : 1));
+    p->deques = (struct rope_pool_deque *)calloc(threads+1, sizeof(struct rope_pool_deque));
+    if (!p->threads || !p->deques) {
+        free(p->threads);
+        free(p->deques);
+        free(p);
+        return NULL;
+    }
+    for (int i = 0; i <= threads; ++i)
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+    for (; p->nthreads < threads; ++p->nthreads) {
+        struct rope_pool_thread *arg = (struct rope_pool_thread *)malloc(sizeof(struct rope_pool_thread));
+        if (!arg)
+            break;
+        arg->pool = p;
+        arg->me = p->nthreads;
+        if (pthread_create(&p->threads[p->nthreads], NULL, pool_thread, arg)) {
+            free(arg);
+            break;
+        }
+    }
+    if (p->nthreads < threads) {
+        free_rope_pool(p);
+        return NULL;
+    }
+    return p;
+}
+
+void free_rope_pool(struct rope_pool *p)
+{
+    if (!p)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->stopping = true;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; ++i)
+        pthread_join(p->threads[i], NULL);
+    for (int i = 0; i < p->nthreads + 1; ++i)
+        pthread_mutex_destroy(&p->deques[i].lock);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->done);
+    free(p->threads);
+    free(p->deques);
+    free(p);
+}
+
+/** Run task(ctx, i) for every i in [0, count) on the pool and the caller, and wait for them
+    Each participant starts on a contiguous share of the tasks and steals from
+    the others once it runs out. A pool runs one job at a time.
+*/
+static void pool_run(struct rope_pool *p, int count, void (*task)(void *, int), void *ctx)
+{
+    if (!p || !p->nthreads) {
+        for (int i = 0; i < count; ++i)
+            task(ctx, i);
+        return;
+    }
+    int participants = p->nthreads + 1;
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < participants; ++i) {
+        p->deques[i].head = (int64_t)count*i / participants;
+        p->deques[i].tail = (int64_t)count*(i+1) / participants;
+    }
+    p->task = task;
+    p->ctx = ctx;
+    p->pending = count;
+    p->busy = p->nthreads;
+    p->generation++;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    pool_work(p, p->nthreads, task, ctx);
+    // wait for the other threads to be done with this job before the next can start
+    pthread_mutex_lock(&p->lock);
+    while (p->pending || p->busy)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/** The number of ranges to split length characters into for p
+*/
+static int pool_ranges(struct rope_pool *p, int64_t length)
+{
+    int64_t ranges = p ? (int64_t)(p->nthreads + 1) * ROPE_POOL_TASKS : 1;
+    if (ranges > length / ROPE_POOL_MIN_RANGE)
+        ranges = length / ROPE_POOL_MIN_RANGE;
+    return ranges > 1 ? ranges : 1;
+}
+
+struct rope_tostring_job {
+    struct rope_node *root;
+    char *buf;
+    int64_t length;
+    int ranges;
+};
+
+static void tostring_range(void *ctx, int i)
+{
+    struct rope_tostring_job *job = (struct rope_tostring_job *)ctx;
+    int64_t lo = job->length * i / job->ranges, hi = job->length * (i+1) / job->ranges;
+    if (lo < hi)
+        copy_node_range(job->root, lo, hi, job->buf + lo);
+}
+
+/** Flatten r like rope_tostring, copying ranges of equal weight on the threads of p
+    Each range is copied straight to its offset in the result.
+    @param p The pool to use, or NULL to copy on the calling thread
+    @return A new NUL-terminated string, or NULL on error
+*/
+char *rope_tostring_parallel(struct rope *r, struct rope_pool *p)
+{
+    struct rope_tostring_job job = { .root = rope_root(r), .length = rope_length(r) };
+    if (job.length && !job.root)
+        return NULL;
+    if ((job.buf = (char *)malloc(job.length+1)) == NULL)
+        return NULL;
+    job.ranges = pool_ranges(p, job.length);
+    pool_run(p, job.ranges, tostring_range, &job);
+    job.buf[job.length] = '\0';
+    return job.buf;
+}
+
+struct rope_reduce_job {
+    struct rope *rope;
+    int64_t length;
+    int ranges;
+    rope_leaf_func leaf;
+    char *accs;         // one accumulator per range
+    size_t acc_size;
+};
+
+static void reduce_range(void *ctx, int i)
+{
+    struct rope_reduce_job *job = (struct rope_reduce_job *)ctx;
+    int64_t lo = job->length * i / job->ranges, hi = job->length * (i+1) / job->ranges, len;
+    struct rope_iter it;
+    const char *chunk;
+    void *acc = job->accs + job->acc_size*i;
+    rope_iter_init(&it, job->rope, lo);
+    while (rope_iter_pos(&it) < hi && (len = rope_iter_next_chunk(&it, &chunk)) > 0)
+        job->leaf(acc, chunk, it.pos > hi ? len - (it.pos-hi) : len);
+}
+
+/** Fold every piece of text in r into an accumulator, on the threads of p
+    The rope is split into ranges of equal weight. Each range gets its own copy
+    of *acc and folds its pieces into it left to right with leaf; the results
+    are then combined left to right with merge. *acc must therefore start out
+    as an identity for merge, but neither function has to be commutative.
+    @param leaf Called as leaf(range_acc, data, len) for each piece of a leaf in a range
+    @param merge Called as merge(acc, range_acc) for each range in order
+    @param acc The initial and the final value
+    @param acc_size The size of *acc
+    @return false on error, or if r is too deep to walk
+*/
+bool rope_reduce(struct rope *r, struct rope_pool *p, rope_leaf_func leaf, rope_merge_func merge,
+                 void *acc, size_t acc_size)
+{
+    struct rope_reduce_job job = { .rope = r, .length = rope_length(r), .leaf = leaf, .acc_size = acc_size };
+    struct rope_node *root = rope_root(r);
+    if (root && root->depth > ROPE_MAX_DEPTH)
+        return false;
+    job.ranges = pool_ranges(p, job.length);
+    if ((job.accs = (char *)malloc(acc_size * job.ranges)) == NULL)
+        return false;
+    for (int i = 0; i < job.ranges; ++i)
+        memcpy(job.accs + acc_size*i, acc, acc_size);
+    pool_run(p, job.ranges, reduce_range, &job);
+    for (int i = 0; i < job.ranges; ++i)
+        merge(acc, job.accs + acc_size*i);
+    free(job.accs);
+    return true;
+}
+
+/* A reader's slot in a rope_handle, on its own cache line so readers
+   announcing themselves don't contend. */
+struct rope_reader {
+    _Alignas(64) atomic_uint_fast64_t epoch;   // the epoch the reader entered in, 0 while it isn't reading
+    atomic_bool used;
+    struct rope_handle *handle;
+};
+
+/* A rope the writer has replaced, kept until no reader can still be using it */
+struct rope_retired {
+    struct rope *rope;
+    uint64_t epoch;     // the global epoch when it was replaced
+    struct rope_retired *next;
+};
+
+struct rope_handle {
+    _Atomic(struct rope *) current;
+    atomic_uint_fast64_t epoch;
+    struct rope_retired *retired;   // only touched by the writer
+    struct rope_reader readers[ROPE_HANDLE_READERS];
+};
+
+/** Create a handle through which one writer publishes versions of a rope to many readers
+    @param r The first version, which the handle takes over
+    @return A new handle, or NULL on error
+*/
+struct rope_handle *new_rope_handle(struct rope *r)
+{
+    struct rope_handle *h;
+    if ((h = (struct rope_handle *)aligned_alloc(64, sizeof(struct rope_handle))) == NULL)
+        return NULL;
+    rope_root(r);   // readers must never have to build a slice's tree
+    atomic_init(&h->current, r);
+    atomic_init(&h->epoch, 1);
+    h->retired = NULL;
+    for (int i = 0; i < ROPE_HANDLE_READERS; ++i) {
+        atomic_init(&h->readers[i].epoch, 0);
+        atomic_init(&h->readers[i].used, false);
+        h->readers[i].handle = h;
+    }
+    return h;
+}
+
+/** Free a handle, its current version and any it still keeps for readers
+    No reader may be using it any more.
+*/
+void free_rope_handle(struct rope_handle *h)
+{
+    struct rope_retired *next;
+    if (!h)
+        return;
+    for (struct rope_retired *t = h->retired; t; t = next) {
+        next = t->next;
+        free_rope(t->rope, false);
+        free(t);
+    }
+    free_rope(atomic_load(&h->current), false);
+    free(h);
+}
+
+/** The current version, for the writer to derive the next one from
+*/
+struct rope *rope_handle_get(struct rope_handle *h)
+{
+    return atomic_load_explicit(&h->current, memory_order_relaxed);
+}
+
+/** Free the versions the writer has replaced that no reader can still be using
+    A reader that entered in epoch e may hold any version replaced at epoch e
+    or later; versions replaced earlier were gone before it looked.
+*/
+static void reclaim_retired(struct rope_handle *h)
+{
+    uint64_t oldest = atomic_load(&h->epoch), e;
+    struct rope_retired **link = &h->retired, *t;
+    for (int i = 0; i < ROPE_HANDLE_READERS; ++i)
+        if ((e = atomic_load(&h->readers[i].epoch)) != 0 && e < oldest)
+            oldest = e;
+    while ((t = *link) != NULL) {
+        if (t->epoch < oldest) {
+            *link = t->next;
+            free_rope(t->rope, false);
+            free(t);
+        } else {
+            link = &t->next;
+        }
+    }
+}
+
+/** Make r the current version, without waiting for readers of the old one
+    The old version is freed once the last reader that could have seen it is
+    done. Only one thread may publish to a handle.
+    @param r The new version, which the handle takes over
+    @return false on error, in which case r has not been published
+*/
+bool rope_handle_publish(struct rope_handle *h, struct rope *r)
+{
+    struct rope_retired *t;
+    if (!r || (r->head && !rope_root(r)))
+        return false;
+    if ((t = (struct rope_retired *)malloc(sizeof(struct rope_retired))) == NULL)
+        return false;
+    t->rope = atomic_exchange(&h->current, r);
+    t->epoch = atomic_fetch_add(&h->epoch, 1);
+    t->next = h->retired;
+    h->retired = t;
+    reclaim_retired(h);
+    return true;
+}
+
+/** Register a reader of h, for use by one thread at a time
+    @return The reader, or NULL if h already has ROPE_HANDLE_READERS of them
+*/
+struct rope_reader *rope_handle_reader(struct rope_handle *h)
+{
+    for (int i = 0; i < ROPE_HANDLE_READERS; ++i) {
+        bool unused = false;
+        if (atomic_compare_exchange_strong(&h->readers[i].used, &unused, true))
+            return &h->readers[i];
+    }
+    return NULL;
+}
+
+/** Give up a reader's slot
+*/
+void free_rope_reader(struct rope_reader *rd)
+{
+    if (rd) {
+        atomic_store(&rd->epoch, 0);
+        atomic_store(&rd->used, false);
+    }
+}
+
+/** Take a snapshot of the current version
+    This costs two atomic stores and a load, and never waits for the writer.
+    The snapshot stays valid, and unchanged, until rope_read_end. Readers may
+    query it, copy it and derive ropes from it, but mustn't free it.
+    @return The snapshot
+*/
+struct rope *rope_read_begin(struct rope_reader *rd)
+{
+    atomic_store(&rd->epoch, atomic_load(&rd->handle->epoch));
+    return atomic_load(&rd->handle->current);
+}
+
+/** Release the snapshot from rope_read_begin
+*/
+void rope_read_end(struct rope_reader *rd)
+{
+    atomic_store_explicit(&rd->epoch, 0, memory_order_release);
+}
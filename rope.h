@@ -1,27 +1,185 @@
 #ifndef ROPE_H
 #define ROPE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Most readers a rope_handle can have registered at once */
+#define ROPE_HANDLE_READERS 128
+
+/* Leaves shorter than this count as tiny in rope_stats and for compaction */
+#define ROPE_TINY_LEAF 64
+
+/* Buckets in rope_stats' histogram of leaf sizes: bucket 0 counts empty
+   leaves, bucket i those of 2^(i-1) to 2^i - 1 bytes, and the last one also
+   everything bigger. */
+#define ROPE_STATS_BUCKETS 24
+
+/* Compressed leaves each thread keeps decompressed at once; text read
+   from a compressed leaf stays valid until this many others have been read
+   on the same thread */
+#define ROPE_LEAF_CACHE 4
+
+/* Deepest tree the balancing code will leave alone; anything deeper is
+   rebuilt from its leaves regardless of length. */
+#define ROPE_MAX_DEPTH 90
+
+enum rope_node_flags {
+    ROPE_NODE_OWNED = 1 << 0,   // data was allocated by the rope and is freed with the node
+    ROPE_NODE_ARENA = 1 << 1,   // node lives in a rope_arena and is only freed by resetting it
+    ROPE_NODE_INLINE = 1 << 2,  // data is stored right after the node, in the same allocation
+    ROPE_NODE_SLICE = 1 << 3,   // the text in [offset, offset+weight) of left, only ever a rope's head; right is the tree built from it, once there is one
+    ROPE_NODE_LOADED = 1 << 4,  // node is part of the block rope_load built, freed with its mapping
+    ROPE_NODE_COMPRESSED = 1 << 5,  // data holds the text compressed, offset an id for the decompression cache
+};
+
 struct rope_node {
     struct rope_node *left;
     struct rope_node *right;
-    int weight;
+    int64_t weight;
+    int16_t depth;  // height of this subtree, 0 for leaves; below INT16_MAX, see alloc_rope_node
+    uint16_t flags; // enum rope_node_flags
+    int refs;       // ropes and nodes pointing at this one
+    int64_t newlines;   // '\n's in this subtree, -1 until counted
+    int64_t codepoints; // UTF-8 code points in this subtree, -1 until counted
+    uint64_t hash;      // polynomial hash of the text, see rope_hash
+    uint64_t hash_pow;  // the hash base to the power of weight, to extend hashes past this text; 0 until hashed
     char *data;
+    struct rope_mapping *mapping;   // file data points into, kept mapped while the leaf lives
+    int64_t offset;     // where a slice's text starts in left
 };
 
+struct rope_arena;
+struct rope_mapping;
+struct rope_pool;
+struct rope_builder;
+struct rope_handle;
+struct rope_reader;
+struct iovec;
+
 struct rope {
     struct rope_node *head;
+    struct rope_arena *arena;   // where nodes derived from this rope are allocated, NULL for the heap;
+                                // ropes combined by rope_concat must share it
+    int64_t until_check;        // edits left before ropes derived from this one are checked for compaction
+};
+
+/* A change found by rope_diff: [old_lo, old_hi) of the old rope was
+   replaced by [new_lo, new_hi) of the new one */
+struct rope_edit {
+    int64_t old_lo, old_hi;
+    int64_t new_lo, new_hi;
 };
 
+/* The shape and memory use of a rope, see rope_stats */
+struct rope_stats {
+    int64_t length;
+    int depth;
+    int64_t nodes;          // distinct nodes, each counted once however often it is shared
+    int64_t leaves;
+    int64_t tiny_leaves;    // leaves shorter than ROPE_TINY_LEAF
+    int64_t shared_nodes;   // nodes also pointed at by other ropes, or twice within this one
+    int64_t shared_bytes;   // text under shared subtrees, which freeing this rope alone won't release
+    int64_t pinned_bytes;   // text kept alive by a slice but not part of the rope
+    int64_t node_bytes;     // memory taken by the nodes themselves
+    int64_t text_bytes;     // text the leaves point at, as stored for compressed ones
+    int64_t compressed_leaves;
+    int64_t leaf_sizes[ROPE_STATS_BUCKETS];
+};
+
+/* A cursor over a rope. It remembers the path from the head to the leaf
+   it is in, so moving to a neighbouring character or leaf is amortized O(1). */
+struct rope_iter {
+    struct rope *rope;
+    struct rope_node *path[ROPE_MAX_DEPTH+1];  // path[0] is the head, path[depth-1] the current leaf
+    bool went_right[ROPE_MAX_DEPTH+1];         // which child path[i] is of path[i-1]
+    int depth;
+    int64_t leaf_start; // offset of the current leaf in the rope
+    int64_t pos;
+};
+
+/* Callbacks for rope_reduce */
+typedef void (*rope_leaf_func)(void *acc, const char *data, int64_t len);
+typedef void (*rope_merge_func)(void *acc, const void *from);
+
 struct rope *new_rope(char *s);
-struct rope_node *alloc_rope_node(int weight, struct rope_node *left, struct rope_node *right, char *data);
+struct rope_node *alloc_rope_node(int64_t weight, struct rope_node *left, struct rope_node *right, char *data);
 struct rope *new_ropev(int argc, ...);
 void free_rope(struct rope *r, bool free_strings);
+void rope_set_chunk_size(int size);
+
+struct rope_builder *new_rope_builder(struct rope_arena *a);
+bool rope_builder_push(struct rope_builder *b, char *s, int64_t len);
+bool rope_builder_push_copy(struct rope_builder *b, const char *s, int64_t len);
+struct rope *rope_builder_finish(struct rope_builder *b);
+void free_rope_builder(struct rope_builder *b);
+
+struct rope_arena *new_rope_arena(size_t slab_size);
+void rope_arena_reset(struct rope_arena *a);
+void free_rope_arena(struct rope_arena *a);
+struct rope *new_arena_rope(struct rope_arena *a, char *s);
+struct rope *rope_from_file(const char *path);
 
 bool is_rope(struct rope *r);
-char rope_index(struct rope *r, int index);
+char rope_index(struct rope *r, int64_t index);
+bool rope_index_batch(struct rope *r, const int64_t *offsets, int64_t n, char *out);
+int64_t rope_length(struct rope *r);
+int64_t rope_line_count(struct rope *r);
+int64_t rope_line_to_offset(struct rope *r, int64_t line);
+int64_t rope_offset_to_line(struct rope *r, int64_t offset);
+int64_t rope_cp_length(struct rope *r);
+int64_t rope_cp_to_offset(struct rope *r, int64_t cp);
+int64_t rope_offset_to_cp(struct rope *r, int64_t offset);
+int32_t rope_index_cp(struct rope *r, int64_t cp);
+struct rope *rope_substring_cp(struct rope *r, int64_t lo, int64_t hi);
+struct rope *rope_copy(struct rope *r);
 struct rope *rope_concat(struct rope *r1, struct rope *r2);
+struct rope *rope_rebalance(struct rope *r);
+struct rope *rope_compress(struct rope *r, int64_t min_leaf);
+bool rope_stats(struct rope *r, struct rope_stats *s);
+int rope_stats_json(const struct rope_stats *s, char *buf, size_t size);
+void rope_set_compaction(double depth_ratio, double tiny_fraction);
+
+bool rope_iter_init(struct rope_iter *it, struct rope *r, int64_t pos);
+bool rope_iter_seek(struct rope_iter *it, int64_t pos);
+int64_t rope_iter_pos(struct rope_iter *it);
+int rope_iter_next(struct rope_iter *it);
+int rope_iter_prev(struct rope_iter *it);
+int64_t rope_iter_next_chunk(struct rope_iter *it, const char **data);
+int64_t rope_iter_prev_chunk(struct rope_iter *it, const char **data);
 bool rope_equal(struct rope *r1, struct rope *r2);
+int rope_compare(struct rope *r1, struct rope *r2, int64_t *mismatch);
+int rope_compare_range(struct rope *r1, int64_t lo1, int64_t hi1,
+                       struct rope *r2, int64_t lo2, int64_t hi2, int64_t *mismatch);
+struct rope_edit *rope_diff(struct rope *r1, struct rope *r2, int64_t *count);
+uint64_t rope_hash(struct rope *r);
 char *rope_tostring(struct rope *r);
-struct rope *rope_substring(struct rope *r, int lo, int hi);
+int64_t rope_copy_range(struct rope *r, int64_t lo, int64_t hi, char *buf);
+int rope_iovec(struct rope *r, int64_t lo, int64_t hi, struct iovec *iov, int iovcnt);
+int64_t rope_write(struct rope *r, int fd);
+bool rope_save(struct rope *r, int fd, bool checksum);
+struct rope *rope_load(const char *path);
+struct rope *rope_substring(struct rope *r, int64_t lo, int64_t hi);
+bool rope_split(struct rope *r, int64_t index, struct rope **left, struct rope **right);
+struct rope *rope_insert(struct rope *r, int64_t index, char *s);
+struct rope *rope_delete(struct rope *r, int64_t lo, int64_t hi);
+int64_t rope_find(struct rope *r, const char *needle, int64_t from);
+int rope_find_all(struct rope *r, const char *needle, int64_t from, int64_t *offsets, int max);
+
+struct rope_pool *new_rope_pool(int threads);
+void free_rope_pool(struct rope_pool *p);
+char *rope_tostring_parallel(struct rope *r, struct rope_pool *p);
+bool rope_reduce(struct rope *r, struct rope_pool *p, rope_leaf_func leaf, rope_merge_func merge,
+                 void *acc, size_t acc_size);
+
+struct rope_handle *new_rope_handle(struct rope *r);
+void free_rope_handle(struct rope_handle *h);
+struct rope *rope_handle_get(struct rope_handle *h);
+bool rope_handle_publish(struct rope_handle *h, struct rope *r);
+struct rope_reader *rope_handle_reader(struct rope_handle *h);
+void free_rope_reader(struct rope_reader *rd);
+struct rope *rope_read_begin(struct rope_reader *rd);
+void rope_read_end(struct rope_reader *rd);
 
 #endif /* ROPE_H */
\ No newline at end of file
@@ -0,0 +1,1204 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <malloc.h>
+
+#include "rope.h"
+
+// Benchmarks for the rope. Build with optimizations for meaningful numbers:
+//     make bench CFLAGS="-O2 -std=c11"
+// or build and run the edit traces and size sweep with latency percentiles:
+//     make bench-traces
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/** Advance a splitmix64 generator and return an offset uniform over [0, n)
+    rand() only yields 31 bits, too few to reach every offset of a large rope.
+*/
+static int64_t random_below(uint64_t *state, int64_t n)
+{
+    uint64_t x = (*state += UINT64_C(0x9e3779b97f4a7c15));
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    x ^= x >> 31;
+    return (int64_t)(((unsigned __int128)x * (uint64_t)n) >> 64);
+}
+
+/** Grow a rope one single-character leaf at a time, the way a log appender would,
+    then measure random access into the result.
+    @param chunk_size passed to rope_set_chunk_size for the run
+*/
+void bench_append_index(int appends, int lookups, int chunk_size)
+{
+    struct rope *r = new_rope(""), *piece = new_rope("x"), *next;
+    rope_set_chunk_size(chunk_size);
+    double start = now();
+    for (int i = 0; i < appends; ++i) {
+        next = rope_concat(r, piece);
+        free_rope(r, false);
+        r = next;
+    }
+    double append_time = now() - start;
+    rope_set_chunk_size(0);
+
+    volatile char sink;
+    srand(1);
+    start = now();
+    for (int i = 0; i < lookups; ++i)
+        sink = rope_index(r, rand() % appends);
+    (void)sink;
+    double index_time = now() - start;
+
+    printf("append_index chunk=%d: %d appends in %.3fs (%.0f ns/append), depth %d\n",
+           chunk_size, appends, append_time, append_time*1e9/appends, r->head->depth);
+    printf("append_index chunk=%d: %d random rope_index calls, %.0f ns/call\n",
+           chunk_size, lookups, index_time*1e9/lookups);
+    free_rope(piece, false);
+    free_rope(r, false);
+}
+
+/** Build a rope of appended pieces on the heap or in an arena, then tear it down.
+    The arena never reuses the nodes of the versions each append drops, so
+    building writes to fresh memory throughout and only the teardown is cheaper.
+*/
+void bench_arena(int appends, bool use_arena)
+{
+    struct rope_arena *a = use_arena ? new_rope_arena(0) : NULL;
+    struct rope *r = new_arena_rope(a, ""), *piece, *next;
+    double start = now();
+    for (int i = 0; i < appends; ++i) {
+        piece = new_arena_rope(a, "xyz");
+        next = rope_concat(r, piece);
+        free_rope(piece, false);
+        free_rope(r, false);
+        r = next;
+    }
+    double build_time = now() - start;
+
+    start = now();
+    if (use_arena)
+        free_rope_arena(a);
+    else
+        free_rope(r, false);
+    double free_time = now() - start;
+
+    printf("arena %s: %d appends in %.3fs (%.0f ns/append), teardown %.3fs\n",
+           use_arena ? "on" : "off", appends, build_time, build_time*1e9/appends, free_time);
+}
+
+/** Heap bytes in use, from glibc's allocator statistics
+*/
+static size_t heap_in_use(void)
+{
+    return mallinfo2().uordblks;
+}
+
+/** Measure the heap a rope of single-character leaves takes, with the text of each
+    leaf in the same allocation as its node, as rope_insert makes them, and in a
+    buffer of its own
+*/
+void bench_memory(int leaves)
+{
+    struct rope *r, *piece, *next;
+    size_t before;
+    printf("memory: struct rope_node is %zu bytes\n", sizeof(struct rope_node));
+    before = heap_in_use();
+    r = new_rope("");
+    for (int i = 0; i < leaves; ++i) {
+        next = rope_insert(r, i, "x");
+        free_rope(r, false);
+        r = next;
+    }
+    double inline_bytes = (double)(heap_in_use() - before) / leaves;
+    free_rope(r, false);
+
+    before = heap_in_use();
+    r = new_rope("");
+    for (int i = 0; i < leaves; ++i) {
+        piece = new_rope(strdup("x"));
+        next = rope_concat(r, piece);
+        free_rope(piece, false);
+        free_rope(r, false);
+        r = next;
+    }
+    double separate_bytes = (double)(heap_in_use() - before) / leaves;
+    free_rope(r, true);
+    printf("memory: %d 1-character leaves, %.1f bytes/leaf with inline text, %.1f with separate text\n",
+           leaves, inline_bytes, separate_bytes);
+}
+
+/** Build a rope by appending 16-byte pieces
+*/
+struct rope *build_pieces(int pieces)
+{
+    struct rope *r = new_rope(""), *piece = new_rope("0123456789abcdef"), *next;
+    for (int i = 0; i < pieces; ++i) {
+        next = rope_concat(r, piece);
+        free_rope(r, false);
+        r = next;
+    }
+    free_rope(piece, false);
+    return r;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/** Sample random offsets of a large rope with one rope_index call each and
+    with rope_index_batch, given the offsets shuffled and sorted
+*/
+void bench_index_batch(int pieces, int lookups)
+{
+    struct rope *r = build_pieces(pieces);
+    int64_t *offsets = malloc(lookups * sizeof(int64_t));
+    char *out = malloc(lookups);
+    uint64_t state = 21;
+    for (int i = 0; i < lookups; ++i)
+        offsets[i] = random_below(&state, rope_length(r));
+    uint64_t sum = 0;
+
+    double start = now();
+    for (int i = 0; i < lookups; ++i)
+        sum += rope_index(r, offsets[i]);
+    printf("index_batch rope_index: %d lookups, %.0f ns/lookup (sum %llu)\n",
+           lookups, (now()-start)*1e9/lookups, (unsigned long long)sum);
+    start = now();
+    rope_index_batch(r, offsets, lookups, out);
+    for (int i = 0; i < lookups; ++i)
+        sum += out[i];
+    printf("index_batch unsorted: %d lookups, %.0f ns/lookup (sum %llu)\n",
+           lookups, (now()-start)*1e9/lookups, (unsigned long long)sum);
+    qsort(offsets, lookups, sizeof(int64_t), compare_offsets);
+    start = now();
+    rope_index_batch(r, offsets, lookups, out);
+    for (int i = 0; i < lookups; ++i)
+        sum += out[i];
+    printf("index_batch sorted: %d lookups, %.0f ns/lookup (sum %llu)\n",
+           lookups, (now()-start)*1e9/lookups, (unsigned long long)sum);
+    free(offsets);
+    free(out);
+    free_rope(r, false);
+}
+
+/** Checksum a rope one character at a time with rope_index, a cursor and chunks
+*/
+void bench_scan(int pieces)
+{
+    struct rope *r = build_pieces(pieces);
+    struct rope_iter it;
+    const char *chunk;
+    int length = rope_length(r), len, c;
+    unsigned sum;
+    double start;
+
+    start = now();
+    sum = 0;
+    for (int i = 0; i < length; ++i)
+        sum += (unsigned char)rope_index(r, i);
+    printf("scan rope_index: %d bytes, %.2f ns/byte (sum %u)\n", length, (now()-start)*1e9/length, sum);
+
+    start = now();
+    sum = 0;
+    rope_iter_init(&it, r, 0);
+    while ((c = rope_iter_next(&it)) != -1)
+        sum += c;
+    printf("scan rope_iter_next: %d bytes, %.2f ns/byte (sum %u)\n", length, (now()-start)*1e9/length, sum);
+
+    start = now();
+    sum = 0;
+    rope_iter_init(&it, r, 0);
+    while ((len = rope_iter_next_chunk(&it, &chunk)) > 0)
+        for (int i = 0; i < len; ++i)
+            sum += (unsigned char)chunk[i];
+    printf("scan rope_iter_next_chunk: %d bytes, %.2f ns/byte (sum %u)\n", length, (now()-start)*1e9/length, sum);
+    free_rope(r, false);
+}
+
+/** Random inserts and deletes into a document, on a rope and on a flat buffer
+*/
+void bench_edits(int pieces, int edits)
+{
+    struct rope *r = build_pieces(pieces), *next;
+    int length = rope_length(r), pos, hi;
+    char *flat = rope_tostring(r);
+    double start;
+
+    flat = (char *)realloc(flat, length + edits*8 + 1);
+    srand(7);
+    start = now();
+    for (int i = 0; i < edits; ++i) {
+        pos = rand() % (length+1);
+        if (i % 2) {
+            next = rope_insert(r, pos, "inserted");
+        } else {
+            hi = pos + 4 > length ? length : pos + 4;
+            next = rope_delete(r, pos, hi);
+        }
+        free_rope(r, false);
+        r = next;
+    }
+    printf("edits rope: %d bytes, %.0f ns/edit, depth %d\n", (int)rope_length(r),
+           (now()-start)*1e9/edits, r->head->depth);
+
+    srand(7);
+    length = pieces*16;
+    start = now();
+    for (int i = 0; i < edits; ++i) {
+        pos = rand() % (length+1);
+        if (i % 2) {
+            memmove(flat+pos+8, flat+pos, length-pos);
+            memcpy(flat+pos, "inserted", 8);
+            length += 8;
+        } else {
+            hi = pos + 4 > length ? length : pos + 4;
+            memmove(flat+pos, flat+hi, length-hi);
+            length -= hi-pos;
+        }
+    }
+    printf("edits flat: %d bytes, %.0f ns/edit\n", length, (now()-start)*1e9/edits);
+    free(flat);
+    free_rope(r, false);
+}
+
+/** Time a rope_stats sample of a large rope, then type characters one at a
+    time into a document with compaction off and on, and compare the cost
+    of an edit and the shape it leaves behind
+*/
+void bench_stats(int pieces, int edits)
+{
+    struct rope *r = build_pieces(pieces), *next;
+    struct rope_stats stats;
+    char json[1024];
+    double start = now();
+    rope_stats(r, &stats);
+    printf("stats rope_stats: %lld nodes in %.3f ms\n", (long long)stats.nodes, (now()-start)*1e3);
+    free_rope(r, false);
+
+    for (int compact = 0; compact < 2; ++compact) {
+        rope_set_compaction(compact ? 2.0 : 0, compact ? 0.5 : 0);
+        r = new_rope("");
+        srand(7);
+        start = now();
+        for (int i = 0; i < edits; ++i) {
+            next = rope_insert(r, rand() % (rope_length(r)+1), "x");
+            free_rope(r, false);
+            r = next;
+        }
+        double edit_time = now() - start;
+        rope_stats(r, &stats);
+        rope_stats_json(&stats, json, sizeof(json));
+        printf("stats compaction %s: %.0f ns/edit, %s\n", compact ? "on" : "off", edit_time*1e9/edits, json);
+        free_rope(r, false);
+    }
+    rope_set_compaction(0, 0);
+}
+
+/** Send a rope to /dev/null by flattening it first and by gathering its leaves
+    @param chunk_size if not 0, the rope's leaves are first coalesced into chunks this big
+*/
+void bench_output(int pieces, int rounds, int chunk_size)
+{
+    struct rope *r = build_pieces(pieces), *packed;
+    if (chunk_size) {
+        rope_set_chunk_size(chunk_size);
+        packed = rope_rebalance(r);
+        rope_set_chunk_size(0);
+        free_rope(r, false);
+        r = packed;
+    }
+    int fd = open("/dev/null", O_WRONLY), length = rope_length(r);
+    char *flat, *slice = (char *)malloc(4096);
+    double start;
+
+    start = now();
+    for (int i = 0; i < rounds; ++i) {
+        flat = rope_tostring(r);
+        if (write(fd, flat, length) != length)
+            perror("write");
+        free(flat);
+    }
+    printf("output chunk=%d tostring+write: %d bytes, %.3f ms/round\n",
+           chunk_size, length, (now()-start)*1e3/rounds);
+
+    start = now();
+    for (int i = 0; i < rounds; ++i)
+        rope_write(r, fd);
+    printf("output chunk=%d rope_write: %d bytes, %.3f ms/round\n",
+           chunk_size, length, (now()-start)*1e3/rounds);
+
+    srand(3);
+    start = now();
+    for (int i = 0; i < rounds*1000; ++i) {
+        int lo = rand() % (length-4096);
+        rope_copy_range(r, lo, lo+4096, slice);
+    }
+    printf("output chunk=%d rope_copy_range: 4096 byte slices, %.0f ns/slice\n",
+           chunk_size, (now()-start)*1e9/(rounds*1000));
+    free(slice);
+    close(fd);
+    free_rope(r, false);
+}
+
+/** Compare document versions: one edited back to the original, one with a character changed
+*/
+void bench_equal(int pieces, int rounds)
+{
+    struct rope *r = build_pieces(pieces), *tmp = rope_insert(r, pieces*8, "x");
+    struct rope *same = rope_delete(tmp, pieces*8, pieces*8+1), *changed;
+    free_rope(tmp, false);
+    tmp = rope_delete(r, pieces*8, pieces*8+1);
+    changed = rope_insert(tmp, pieces*8, "x");
+    free_rope(tmp, false);
+
+    double start = now();
+    int equal = 0;
+    for (int i = 0; i < rounds; ++i) {
+        char *s1 = rope_tostring(r), *s2 = rope_tostring(same), *s3 = rope_tostring(changed);
+        equal += !strcmp(s1, s2) + !strcmp(s1, s3);
+        free(s1);
+        free(s2);
+        free(s3);
+    }
+    printf("equal tostring+strcmp: %.3f ms/pair (%d equal)\n", (now()-start)*1e3/(2*rounds), equal);
+    start = now();
+    equal = rope_equal(r, same) + rope_equal(r, changed);
+    printf("equal first rope_equal, hashing: %.3f ms/pair (%d equal)\n", (now()-start)*1e3/2, equal);
+    start = now();
+    equal = 0;
+    for (int i = 0; i < rounds*1000; ++i)
+        equal += rope_equal(r, same) + rope_equal(r, changed);
+    printf("equal rope_equal: %.3f us/pair (%d equal)\n", (now()-start)*1e6/(2*rounds*1000), equal);
+    free_rope(r, false);
+    free_rope(same, false);
+    free_rope(changed, false);
+}
+
+/** Order a rope against a copy with one edit near the end and against an
+    independently built rope with the same text, flattening them for memcmp
+    and comparing them in place
+*/
+void bench_compare(int pieces, int rounds)
+{
+    struct rope *r = build_pieces(pieces), *tmp = rope_delete(r, pieces*7, pieces*7+1);
+    struct rope *changed = rope_insert(tmp, pieces*7, "~"), *rebuilt = build_pieces(pieces);
+    int64_t length = rope_length(r), mismatch = 0;
+    free_rope(tmp, false);
+
+    double start = now();
+    int order = 0;
+    for (int i = 0; i < rounds; ++i) {
+        char *s1 = rope_tostring(r), *s2 = rope_tostring(changed), *s3 = rope_tostring(rebuilt);
+        order += (memcmp(s1, s2, length) < 0) + (memcmp(s1, s3, length) < 0);
+        free(s1);
+        free(s2);
+        free(s3);
+    }
+    printf("compare tostring+memcmp: %.3f ms/pair (%d before)\n", (now()-start)*1e3/(2*rounds), order);
+    start = now();
+    for (int i = 0; i < rounds; ++i)
+        order += (rope_compare(r, rebuilt, &mismatch) < 0);
+    printf("compare rope_compare, unshared: %.3f ms/pair (mismatch at %lld)\n",
+           (now()-start)*1e3/rounds, (long long)mismatch);
+    start = now();
+    for (int i = 0; i < rounds*1000; ++i)
+        order += (rope_compare(r, changed, &mismatch) < 0);
+    printf("compare rope_compare, shared: %.3f us/pair (mismatch at %lld, %d before)\n",
+           (now()-start)*1e6/(rounds*1000), (long long)mismatch, order);
+    free_rope(r, false);
+    free_rope(changed, false);
+    free_rope(rebuilt, false);
+}
+
+/** Diff a large document against a version with a few scattered edits, by
+    flattening both and trimming their common prefix and suffix, the least
+    a flat diff has to do, and with rope_diff
+*/
+void bench_diff(int64_t size, int edits, int rounds)
+{
+    static char line[] = "the quick brown fox jumps over the lazy dog\n";
+    struct rope_builder *b = new_rope_builder(NULL);
+    for (int64_t i = 0; i < size; i += sizeof(line)-1)
+        rope_builder_push_copy(b, line, sizeof(line)-1);
+    struct rope *r = rope_builder_finish(b), *edited = rope_copy(r), *next;
+    struct rope_edit *diff;
+    int64_t count = 0, length = rope_length(r);
+    srand(24);
+    for (int i = 0; i < edits; ++i) {
+        next = rope_insert(edited, rand() % length, "edited");
+        free_rope(edited, false);
+        edited = next;
+    }
+
+    double start = now();
+    int64_t changed = 0;
+    for (int i = 0; i < rounds; ++i) {
+        char *s1 = rope_tostring(r), *s2 = rope_tostring(edited);
+        int64_t l1 = rope_length(r), l2 = rope_length(edited), lo = 0, hi = 0;
+        while (lo < l1 && lo < l2 && s1[lo] == s2[lo])
+            lo++;
+        while (hi < l1-lo && hi < l2-lo && s1[l1-1-hi] == s2[l2-1-hi])
+            hi++;
+        changed = l2 - lo - hi;
+        free(s1);
+        free(s2);
+    }
+    printf("diff tostring+trim: %lld bytes, %.3f ms/diff, one edit of %lld bytes\n",
+           (long long)length, (now()-start)*1e3/rounds, (long long)changed);
+    start = now();
+    for (int i = 0; i < rounds*100; ++i) {
+        diff = rope_diff(r, edited, &count);
+        free(diff);
+    }
+    printf("diff rope_diff: %lld bytes, %.3f ms/diff, %lld edits\n",
+           (long long)length, (now()-start)*1e3/(rounds*100), (long long)count);
+    free_rope(r, false);
+    free_rope(edited, false);
+}
+
+/** Compress a log-like rope and compare its memory and read costs with the original
+    Random lookups mostly miss the decompression cache; lookups near each
+    other, as an editor or a log tail makes them, mostly hit it.
+*/
+void bench_compress(int64_t size, int lookups)
+{
+    struct rope_builder *b = new_rope_builder(NULL);
+    struct rope_stats before, after;
+    char line[128];
+    for (int64_t i = 0; i < size; ) {
+        int len = snprintf(line, sizeof(line), "2026-10-18 12:%02d:%02d INFO request %lld served in %d ms\n",
+                           (int)(i/60 % 60), (int)(i % 60), (long long)(i/50), (int)(i % 97));
+        rope_builder_push_copy(b, line, len);
+        i += len;
+    }
+    struct rope *r = rope_builder_finish(b), *c;
+    int64_t length = rope_length(r), sum;
+    double start = now();
+    c = rope_compress(r, 1024);
+    printf("compress rope_compress: %lld bytes in %.1f ms\n", (long long)length, (now()-start)*1e3);
+    rope_stats(r, &before);
+    rope_stats(c, &after);
+    printf("compress memory: %lld text bytes -> %lld (%.1fx smaller), %lld compressed leaves\n",
+           (long long)before.text_bytes, (long long)after.text_bytes,
+           (double)before.text_bytes / after.text_bytes, (long long)after.compressed_leaves);
+    for (int k = 0; k < 2; ++k) {
+        struct rope *x = k ? c : r;
+        const char *name = k ? "compressed" : "plain";
+        srand(25);
+        sum = 0;
+        start = now();
+        for (int i = 0; i < lookups; ++i)
+            sum += rope_index(x, (int64_t)rand() * rand() % length);
+        printf("compress %s random rope_index: %.1f ns/lookup (%lld)\n", name, (now()-start)*1e9/lookups, (long long)sum);
+        int64_t at = length/2;
+        start = now();
+        for (int i = 0; i < lookups; ++i)
+            sum += rope_index(x, at = (at + rand() % 64) % length);
+        printf("compress %s local rope_index: %.1f ns/lookup (%lld)\n", name, (now()-start)*1e9/lookups, (long long)sum);
+        start = now();
+        char *flat = rope_tostring(x);
+        printf("compress %s rope_tostring: %.1f ms\n", name, (now()-start)*1e3);
+        free(flat);
+    }
+    free_rope(c, false);
+    free_rope(r, false);
+}
+
+/** Look for a needle planted at the end of a rope, flattening it for strstr
+    and searching it in place
+    @param chunk_size if not 0, the rope's leaves are first coalesced into chunks this big
+*/
+void bench_find(int pieces, int rounds, int chunk_size)
+{
+    struct rope *r = build_pieces(pieces), *needle = new_rope("cdef01234!"), *next;
+    rope_set_chunk_size(chunk_size);
+    next = rope_concat(r, needle);
+    free_rope(r, false);
+    r = chunk_size ? rope_rebalance(next) : next;
+    rope_set_chunk_size(0);
+    if (r != next)
+        free_rope(next, false);
+    double start = now();
+    int found = 0;
+    for (int i = 0; i < rounds; ++i) {
+        char *s = rope_tostring(r);
+        found += strstr(s, "cdef01234!") - s;
+        free(s);
+    }
+    printf("find chunk=%d tostring+strstr: %.3f ms/search (at %d)\n",
+           chunk_size, (now()-start)*1e3/rounds, found/rounds);
+    start = now();
+    found = 0;
+    for (int i = 0; i < rounds; ++i)
+        found += rope_find(r, "cdef01234!", 0);
+    printf("find chunk=%d rope_find: %.3f ms/search (at %d)\n",
+           chunk_size, (now()-start)*1e3/rounds, found/rounds);
+    free_rope(needle, false);
+    free_rope(r, false);
+}
+
+/** Look up lines in a mapped file of 80-character lines, by scanning and by the line index
+*/
+void bench_lines(int size, int lookups)
+{
+    char path[] = "/tmp/rope_benchXXXXXX", *buf = (char *)malloc(size);
+    int fd = mkstemp(path), lines, found = 0;
+    for (int i = 0; i < size; ++i)
+        buf[i] = i % 80 == 79 ? '\n' : 'a' + i % 26;
+    if (write(fd, buf, size) != size) {
+        perror("write");
+        exit(1);
+    }
+    close(fd);
+    free(buf);
+    struct rope *r = rope_from_file(path);
+    struct rope_iter it;
+    int c;
+
+    double start = now();
+    lines = rope_line_count(r);
+    printf("lines first rope_line_count: %d lines, %.3f ms\n", lines, (now()-start)*1e3);
+
+    srand(3);
+    start = now();
+    for (int i = 0; i < 10; ++i) {
+        int line = rand() % lines, pos = 0;
+        rope_iter_init(&it, r, 0);
+        for (int seen = 0; seen < line && (c = rope_iter_next(&it)) != -1; ++pos)
+            seen += c == '\n';
+        found += pos;
+    }
+    printf("lines scan to line: %.3f ms/lookup\n", (now()-start)*1e3/10);
+    start = now();
+    for (int i = 0; i < lookups; ++i)
+        found += rope_line_to_offset(r, rand() % lines);
+    printf("lines rope_line_to_offset: %.0f ns/lookup\n", (now()-start)*1e9/lookups);
+    start = now();
+    for (int i = 0; i < lookups; ++i)
+        found += rope_offset_to_line(r, rand() % size);
+    printf("lines rope_offset_to_line: %.0f ns/lookup (%d)\n", (now()-start)*1e9/lookups, found & 1);
+    free_rope(r, false);
+    unlink(path);
+}
+
+static void count_leaf(void *acc, const char *data, int64_t len)
+{
+    int64_t *count = (int64_t *)acc;
+    for (int64_t i = 0; i < len; ++i)
+        *count += data[i] == 'a';
+}
+
+static void count_merge(void *acc, const void *from)
+{
+    *(int64_t *)acc += *(const int64_t *)from;
+}
+
+/** Flatten and count characters of a rope of megabyte leaves with pools of increasing size
+*/
+void bench_parallel(int megabytes, int rounds)
+{
+    char *text = (char *)malloc((1 << 20) + 1);
+    for (int i = 0; i < 1 << 20; ++i)
+        text[i] = 'a' + i % 26;
+    text[1 << 20] = '\0';
+    struct rope *r = new_rope(""), *leaf = new_rope(text), *next;
+    for (int i = 0; i < megabytes; ++i) {
+        next = rope_concat(r, leaf);
+        free_rope(r, false);
+        r = next;
+    }
+    int threads[] = { 0, 1, 3, 7 };
+    for (int t = 0; t < sizeof(threads)/sizeof(threads[0]); ++t) {
+        struct rope_pool *pool = new_rope_pool(threads[t]);
+        double start = now();
+        for (int i = 0; i < rounds; ++i)
+            free(rope_tostring_parallel(r, pool));
+        double flatten = (now()-start)*1e3/rounds;
+        int64_t count = 0;
+        start = now();
+        for (int i = 0; i < rounds; ++i) {
+            count = 0;
+            rope_reduce(r, pool, count_leaf, count_merge, &count, sizeof(count));
+        }
+        printf("parallel %d+1 threads: %d MB, tostring %.3f ms, reduce %.3f ms (%ld)\n", threads[t],
+               megabytes, flatten, (now()-start)*1e3/rounds, (long)count);
+        free_rope_pool(pool);
+    }
+    free_rope(leaf, false);
+    free_rope(r, false);
+    free(text);
+}
+
+/** Open a file of size bytes by reading it onto the heap and by mapping it,
+    touching one byte per page afterwards
+*/
+void bench_from_file(int size)
+{
+    char path[] = "/tmp/rope_benchXXXXXX", *buf = (char *)malloc(size+1);
+    int fd = mkstemp(path);
+    memset(buf, 'x', size);
+    if (write(fd, buf, size) != size) {
+        perror("write");
+        exit(1);
+    }
+    close(fd);
+    volatile char sink;
+
+    double start = now();
+    fd = open(path, O_RDONLY);
+    if (read(fd, buf, size) != size) {
+        perror("read");
+        exit(1);
+    }
+    close(fd);
+    buf[size] = '\0';
+    struct rope *r = new_rope(buf);
+    double open_time = now() - start;
+    start = now();
+    for (int i = 0; i < size; i += 4096)
+        sink = rope_index(r, i);
+    printf("from_file read+new_rope: %d bytes, open %.3f ms, touch %.3f ms\n",
+           size, open_time*1e3, (now()-start)*1e3);
+    free_rope(r, false);
+
+    start = now();
+    r = rope_from_file(path);
+    open_time = now() - start;
+    start = now();
+    for (int i = 0; i < size; i += 4096)
+        sink = rope_index(r, i);
+    printf("from_file rope_from_file: %d bytes, open %.3f ms, touch %.3f ms\n",
+           size, open_time*1e3, (now()-start)*1e3);
+    (void)sink;
+    free_rope(r, false);
+    unlink(path);
+    free(buf);
+}
+
+/** Build a rope of short pieces by appending with rope_concat, then with a
+    rope_builder, both referencing the pieces and copying them.
+*/
+void bench_builder(int pieces)
+{
+    static char text[] = "the quick brown fox ";
+    struct rope *r = new_rope(""), *piece = new_rope(text), *next;
+    double start = now();
+    for (int i = 0; i < pieces; ++i) {
+        next = rope_concat(r, piece);
+        free_rope(r, false);
+        r = next;
+    }
+    printf("builder rope_concat: %d pieces in %.3fs, depth %d\n", pieces, now()-start, r->head->depth);
+    free_rope(r, false);
+    free_rope(piece, false);
+
+    for (int copy = 0; copy < 2; ++copy) {
+        struct rope_builder *b = new_rope_builder(NULL);
+        start = now();
+        for (int i = 0; i < pieces; ++i) {
+            if (copy)
+                rope_builder_push_copy(b, text, sizeof(text)-1);
+            else
+                rope_builder_push(b, text, sizeof(text)-1);
+        }
+        r = rope_builder_finish(b);
+        printf("builder %s: %d pieces in %.3fs, depth %d\n", copy ? "push_copy" : "push",
+               pieces, now()-start, r->head->depth);
+        free_rope(r, false);
+    }
+}
+
+/** Page through a rope the way a viewer would: take a window, then a smaller
+    window of that, and read it, either just its first character or all of it.
+*/
+void bench_pages(int pieces, int windows, int page)
+{
+    struct rope *r = build_pieces(pieces), *win, *sub;
+    int64_t length = rope_length(r), pos;
+    char *buf = (char *)malloc(page);
+    volatile char sink;
+    for (int copy = 0; copy < 2; ++copy) {
+        srand(9);
+        double start = now();
+        for (int i = 0; i < windows; ++i) {
+            pos = rand() % (length - 2*page);
+            win = rope_substring(r, pos, pos + 2*page);
+            sub = rope_substring(win, page/2, page/2 + page);
+            if (copy)
+                rope_copy_range(sub, 0, page, buf);
+            else
+                sink = rope_index(sub, 0);
+            free_rope(sub, false);
+            free_rope(win, false);
+        }
+        printf("pages %s: %d windows of %d bytes, %.0f ns/window\n", copy ? "copy" : "peek",
+               windows, page, (now()-start)*1e9/windows);
+    }
+    (void)sink;
+    free(buf);
+    free_rope(r, false);
+}
+
+/** Find code points in mixed-width UTF-8 by decoding from the start and with the cached counts
+*/
+void bench_cp(int size, int lookups)
+{
+    static const char *glyphs[] = { "a", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80" };
+    struct rope_builder *b = new_rope_builder(NULL);
+    for (int i = 0; i < size; ++i)
+        rope_builder_push_copy(b, glyphs[i % 4], i % 4 + 1);
+    struct rope *r = rope_builder_finish(b);
+    struct rope_iter it;
+    int64_t cps, found = 0;
+    int c;
+
+    double start = now();
+    cps = rope_cp_length(r);
+    printf("cp rope_cp_length: %d code points in %d bytes, %.3f ms\n",
+           (int)cps, (int)rope_length(r), (now()-start)*1e3);
+
+    srand(5);
+    start = now();
+    for (int i = 0; i < 10; ++i) {
+        int64_t cp = rand() % cps, seen = -1;
+        rope_iter_init(&it, r, 0);
+        while ((c = rope_iter_next(&it)) != -1 && (seen += (c & 0xC0) != 0x80) < cp)
+            ;
+        found += rope_iter_pos(&it);
+    }
+    printf("cp scan to code point: %.3f ms/lookup\n", (now()-start)*1e3/10);
+    start = now();
+    for (int i = 0; i < lookups; ++i)
+        found += rope_index_cp(r, rand() % cps);
+    printf("cp rope_index_cp: %.0f ns/lookup\n", (now()-start)*1e9/lookups);
+    start = now();
+    for (int i = 0; i < lookups; ++i)
+        found += rope_offset_to_cp(r, rand() % rope_length(r));
+    printf("cp rope_offset_to_cp: %.0f ns/lookup (%d)\n", (now()-start)*1e9/lookups, (int)(found & 1));
+    free_rope(r, false);
+}
+
+struct handle_bench {
+    struct rope_handle *handle;
+    atomic_bool *stop;
+    long reads;
+};
+
+/* Take snapshots and read a few random characters from each, until stopped */
+static void *handle_bench_read(void *arg)
+{
+    struct handle_bench *hb = (struct handle_bench *)arg;
+    struct rope_reader *rd = rope_handle_reader(hb->handle);
+    unsigned seed = (unsigned)(size_t)arg;
+    volatile char sink;
+    while (!atomic_load_explicit(hb->stop, memory_order_relaxed)) {
+        struct rope *r = rope_read_begin(rd);
+        int64_t length = rope_length(r);
+        for (int i = 0; i < 16; ++i)
+            sink = rope_index(r, rand_r(&seed) % length);
+        rope_read_end(rd);
+        hb->reads++;
+    }
+    (void)sink;
+    free_rope_reader(rd);
+    return NULL;
+}
+
+/** Measure snapshot reads per second with 1 to max_threads readers, while one
+    writer keeps inserting into and deleting from the rope behind them.
+*/
+void bench_handle(int pieces, int max_threads, double seconds)
+{
+    struct rope_handle *h = new_rope_handle(build_pieces(pieces));
+    struct handle_bench *readers = (struct handle_bench *)calloc(max_threads, sizeof(struct handle_bench));
+    pthread_t *threads = (pthread_t *)malloc(max_threads * sizeof(pthread_t));
+    atomic_bool stop;
+    srand(13);
+    for (int n = 1; n <= max_threads; n *= 2) {
+        atomic_store(&stop, false);
+        for (int i = 0; i < n; ++i) {
+            readers[i] = (struct handle_bench){ .handle = h, .stop = &stop };
+            pthread_create(&threads[i], NULL, handle_bench_read, &readers[i]);
+        }
+        long edits = 0, reads = 0;
+        double start = now();
+        while (now() - start < seconds) {
+            struct rope *r = rope_handle_get(h);
+            int64_t pos = rand() % (rope_length(r) - 8);
+            rope_handle_publish(h, edits % 2 ? rope_insert(r, pos, "inserted") : rope_delete(r, pos, pos+8));
+            edits++;
+        }
+        atomic_store(&stop, true);
+        for (int i = 0; i < n; ++i) {
+            pthread_join(threads[i], NULL);
+            reads += readers[i].reads;
+        }
+        double elapsed = now() - start;
+        printf("handle %d readers: %.0f snapshots/s, %.0f edits/s\n", n, reads/elapsed, edits/elapsed);
+    }
+    free(threads);
+    free(readers);
+    free_rope_handle(h);
+}
+
+/** Save an edited rope of many pieces, then compare reopening it with
+    rope_load against reading the plain text back and rebuilding it with a
+    rope_builder.
+*/
+void bench_save(int pieces, int rounds)
+{
+    static char text[] = "the quick brown fox\n";
+    struct rope_builder *b = new_rope_builder(NULL);
+    for (int i = 0; i < pieces; ++i)
+        rope_builder_push_copy(b, text, sizeof(text) - 1);
+    struct rope *r = rope_builder_finish(b), *next;
+    srand(7);
+    for (int i = 0; i < pieces / 16; ++i) {
+        next = rope_insert(r, rand() % rope_length(r), "edit");
+        free_rope(r, false);
+        r = next;
+    }
+    int64_t length = rope_length(r);
+    char path[] = "/tmp/rope_benchXXXXXX", *buf = (char *)malloc(length + 1);
+    int fd = mkstemp(path);
+    double start = now();
+    if (!rope_save(r, fd, false)) {
+        perror("rope_save");
+        exit(1);
+    }
+    double save_time = now() - start;
+    off_t size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    char text_path[] = "/tmp/rope_benchXXXXXX";
+    fd = mkstemp(text_path);
+    rope_write(r, fd);
+    close(fd);
+    volatile uint64_t sink = 0;
+
+    start = now();
+    for (int i = 0; i < rounds; ++i) {
+        fd = open(text_path, O_RDONLY);
+        if (read(fd, buf, length) != length) {
+            perror("read");
+            exit(1);
+        }
+        close(fd);
+        b = new_rope_builder(NULL);
+        rope_builder_push_copy(b, buf, length);
+        next = rope_builder_finish(b);
+        sink += rope_line_count(next) + rope_hash(next);
+        free_rope(next, false);
+    }
+    printf("save read+builder: %d pieces, %.3f ms per open\n", pieces, (now()-start)*1e3/rounds);
+
+    start = now();
+    for (int i = 0; i < rounds; ++i) {
+        next = rope_load(path);
+        sink += rope_line_count(next) + rope_hash(next);
+        free_rope(next, false);
+    }
+    printf("save rope_load: %d pieces, %lld byte file, save %.3f ms, %.3f ms per open\n",
+           pieces, (long long)size, save_time*1e3, (now()-start)*1e3/rounds);
+    (void)sink;
+    unlink(path);
+    unlink(text_path);
+    free_rope(r, false);
+    free(buf);
+}
+
+/* Latencies of one operation over a run, in seconds */
+struct latencies {
+    double *samples;
+    int count;
+};
+
+/** Make the compiler assume p is read, so copies into it aren't optimized away
+*/
+static void escape(void *p)
+{
+    __asm__ volatile("" : : "g"(p) : "memory");
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/** Print the throughput and median and 99th percentile latency of a run
+    @param bytes Bytes each operation handles, for MB/s, or 0 to leave it out
+*/
+static void report(const char *name, struct latencies *l, int64_t bytes)
+{
+    double total = 0;
+    for (int i = 0; i < l->count; ++i)
+        total += l->samples[i];
+    qsort(l->samples, l->count, sizeof(double), compare_doubles);
+    printf("%-32s %9d ops %12.0f ops/s", name, l->count, l->count / total);
+    if (bytes)
+        printf(" %10.1f MB/s", bytes * (double)l->count / total / 1e6);
+    else
+        printf(" %15s", "");
+    printf("   p50 %10.0f ns   p99 %10.0f ns\n", l->samples[l->count/2]*1e9, l->samples[l->count*99/100]*1e9);
+    l->count = 0;
+}
+
+/** Build a rope of size bytes of printable text, in chunks
+*/
+static struct rope *build_text(int64_t size)
+{
+    char line[64];
+    struct rope_builder *b = new_rope_builder(NULL);
+    for (int64_t i = 0; i < size; i += sizeof(line)) {
+        for (int j = 0; j < sizeof(line); ++j)
+            line[j] = j == sizeof(line)-1 ? '\n' : 'a' + (i/64 + j) % 26;
+        rope_builder_push_copy(b, line, size-i < sizeof(line) ? size-i : sizeof(line));
+    }
+    return rope_builder_finish(b);
+}
+
+/** Replay a typing session on a document of size bytes: runs of typed
+    characters and backspaces at a cursor that mostly stays put and now and
+    then jumps somewhere else, like clicking in an editor
+*/
+static void trace_typing(int64_t size, int edits, struct latencies *rope_l, struct latencies *flat_l)
+{
+    struct rope *r = build_text(size), *next;
+    int64_t length = size, cursor = size/2;
+    char *flat = rope_tostring(r);
+    static char letters[] = "etaoin shrdlu";
+    double start;
+    flat = realloc(flat, size + edits + 1);
+    srand(23);
+    for (int i = 0; i < edits; ++i) {
+        int action = rand() % 100;
+        if (action < 2)
+            cursor = rand() % (length+1);
+        start = now();
+        if (action < 90 || cursor == 0) {
+            next = rope_insert(r, cursor, (char []){ letters[i % 13], '\0' });
+        } else {
+            next = rope_delete(r, cursor-1, cursor);
+        }
+        rope_l->samples[rope_l->count++] = now() - start;
+        free_rope(r, false);
+        r = next;
+
+        start = now();
+        if (action < 90 || cursor == 0) {
+            memmove(flat+cursor+1, flat+cursor, length-cursor);
+            flat[cursor++] = letters[i % 13];
+            length++;
+        } else {
+            memmove(flat+cursor-1, flat+cursor, length-cursor);
+            cursor--;
+            length--;
+        }
+        flat_l->samples[flat_l->count++] = now() - start;
+    }
+    free(flat);
+    free_rope(r, false);
+}
+
+/** Replay a log being appended to a line at a time, starting empty
+*/
+static void trace_log(int lines, struct latencies *rope_l, struct latencies *flat_l)
+{
+    char *text = malloc((int64_t)lines * 81), *flat = NULL;
+    struct rope *r = new_rope(""), *line, *next;
+    int64_t length = 0, capacity = 0;
+    double start;
+    for (int i = 0; i < lines; ++i) {
+        char *s = text + (int64_t)i*81;
+        snprintf(s, 81, "%010d INFO request handled in %3d us by worker %2d, status ok\n", i, i % 977, i % 16);
+        start = now();
+        line = new_rope(s);
+        next = rope_concat(r, line);
+        rope_l->samples[rope_l->count++] = now() - start;
+        free_rope(line, false);
+        free_rope(r, false);
+        r = next;
+
+        int64_t n = strlen(s);
+        start = now();
+        if (length + n > capacity) {    // grow by doubling, like a string builder
+            capacity = capacity ? 2*capacity : 4096;
+            flat = realloc(flat, capacity);
+        }
+        memcpy(flat + length, s, n);
+        escape(flat);
+        length += n;
+        flat_l->samples[flat_l->count++] = now() - start;
+    }
+    free(flat);
+    free_rope(r, false);
+    free(text);
+}
+
+/** Replay random cut-and-paste of blocks of up to 1 KB in a document of size bytes
+*/
+static void trace_splice(int64_t size, int edits, struct latencies *rope_l, struct latencies *flat_l)
+{
+    struct rope *r = build_text(size), *piece, *rest, *left, *right, *joined;
+    char *flat = rope_tostring(r), *block = malloc(1024);
+    double start;
+    srand(23);
+    for (int i = 0; i < edits; ++i) {
+        int64_t len = 1 + rand() % 1024, lo = rand() % (size - len + 1), to = rand() % (size - len + 1);
+        start = now();
+        piece = rope_substring(r, lo, lo + len);
+        rest = rope_delete(r, lo, lo + len);
+        rope_split(rest, to, &left, &right);
+        joined = rope_concat(left, piece);
+        free_rope(r, false);
+        r = rope_concat(joined, right);
+        rope_l->samples[rope_l->count++] = now() - start;
+        free_rope(piece, false);
+        free_rope(rest, false);
+        free_rope(left, false);
+        free_rope(right, false);
+        free_rope(joined, false);
+
+        start = now();
+        memcpy(block, flat + lo, len);
+        memmove(flat + lo, flat + lo + len, size - lo - len);
+        memmove(flat + to + len, flat + to, size - len - to);
+        memcpy(flat + to, block, len);
+        flat_l->samples[flat_l->count++] = now() - start;
+    }
+    free(block);
+    free(flat);
+    free_rope(r, false);
+}
+
+/** Time concat, substring, index and tostring on a rope of size bytes and
+    the same operations on a flat buffer: joining two buffers, copying out
+    a range, reading a byte and copying the whole buffer
+*/
+static void micro_sizes(int64_t size, struct latencies *l)
+{
+    struct rope *r = build_text(size), *half = rope_substring(r, 0, size/2), *next;
+    char *flat = rope_tostring(r), *copy, name[64];
+    int ops = size >= 64*1024*1024 ? 10 : size >= 1024*1024 ? 100 : 10000;
+    int lookups = 100000;
+    volatile char sink;
+    double start;
+    const char *unit = size >= 1024*1024*1024 ? "GB" : size >= 1024*1024 ? "MB" : "KB";
+    int64_t scaled = size >= 1024*1024*1024 ? size >> 30 : size >= 1024*1024 ? size >> 20 : size >> 10;
+
+#define RUN(what, times, bytes, body) do {                              \
+        for (int i = 0; i < (times); ++i) {                             \
+            start = now();                                              \
+            body;                                                       \
+            l->samples[l->count++] = now() - start;                     \
+        }                                                               \
+        snprintf(name, sizeof(name), "%s %lld %s", what, (long long)scaled, unit); \
+        report(name, l, bytes);                                         \
+    } while (0)
+
+    RUN("concat rope", ops, 0, next = rope_concat(half, half); free_rope(next, false));
+    RUN("concat flat", ops, size, copy = malloc(size); memcpy(copy, flat, size/2);
+        memcpy(copy + size/2, flat, size/2); escape(copy); free(copy));
+    // rope_substring only builds a slice; copying the text out is what matches the flat copy
+    srand(23);
+    RUN("slice rope", ops, 0, int64_t lo = rand() % (size - size/4 + 1);
+        next = rope_substring(r, lo, lo + size/4); free_rope(next, false));
+    srand(23);
+    RUN("substring rope", ops, size/4, int64_t lo = rand() % (size - size/4 + 1);
+        next = rope_substring(r, lo, lo + size/4); copy = malloc(size/4);
+        rope_copy_range(next, 0, size/4, copy); escape(copy); free(copy); free_rope(next, false));
+    srand(23);
+    RUN("substring flat", ops, size/4, int64_t lo = rand() % (size - size/4 + 1);
+        copy = malloc(size/4); memcpy(copy, flat + lo, size/4); escape(copy); free(copy));
+    srand(23);
+    RUN("index rope", lookups, 0, sink = rope_index(r, rand() % size));
+    srand(23);
+    RUN("index flat", lookups, 0, sink = flat[rand() % size]);
+    RUN("tostring rope", ops, size, free(rope_tostring(r)));
+    RUN("tostring flat", ops, size, copy = malloc(size+1); memcpy(copy, flat, size+1); escape(copy); free(copy));
+#undef RUN
+    (void)sink;
+    free(flat);
+    free_rope(half, false);
+    free_rope(r, false);
+}
+
+/** The regression suite: edit traces replayed on a rope and on a flat
+    buffer, then microbenchmarks over sizes from 1 KB up to max_size
+*/
+static void bench_traces(int64_t max_size)
+{
+    int edits = 100000;
+    struct latencies rope_l, flat_l;
+    rope_l.samples = malloc(edits * sizeof(double));
+    flat_l.samples = malloc(edits * sizeof(double));
+    rope_l.count = flat_l.count = 0;
+    int64_t document = max_size < 4096 ? 4096 : max_size < 16*1024*1024 ? max_size : 16*1024*1024;
+
+    trace_typing(document, edits, &rope_l, &flat_l);
+    report("trace typing rope", &rope_l, 0);
+    report("trace typing flat", &flat_l, 0);
+    trace_log(edits, &rope_l, &flat_l);
+    report("trace log append rope", &rope_l, 66);
+    report("trace log append flat", &flat_l, 66);
+    trace_splice(document, edits/10, &rope_l, &flat_l);
+    report("trace splice rope", &rope_l, 0);
+    report("trace splice flat", &flat_l, 0);
+    for (int64_t size = 1024; size <= max_size; size *= 32)
+        micro_sizes(size, &rope_l);
+    free(rope_l.samples);
+    free(flat_l.samples);
+}
+
+/** Run the feature benchmarks, or with "traces" the regression suite
+        rope_bench [appends]
+        rope_bench traces [max_size]
+*/
+int main(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "traces")) {
+        bench_traces(argc > 2 ? atoll(argv[2]) : 32*1024*1024);
+        return 0;
+    }
+    int appends = argc > 1 ? atoi(argv[1]) : 1000000;
+    bench_append_index(appends, 1000000, 0);
+    bench_append_index(appends, 1000000, 256);
+    bench_arena(appends, false);
+    bench_arena(appends, true);
+    bench_memory(appends);
+    bench_scan(appends);
+    bench_index_batch(appends, 1000000);
+    bench_edits(appends, 100000);
+    bench_stats(appends, 200000);
+    bench_output(appends, 10, 0);
+    bench_output(appends, 10, 4096);
+    bench_equal(appends, 10);
+    bench_compare(appends, 10);
+    bench_diff(64*1024*1024, 10, 5);
+    bench_compress(64*1024*1024, 1000000);
+    bench_find(appends, 10, 0);
+    bench_find(appends, 10, 4096);
+    bench_lines(64*1024*1024, 1000000);
+    bench_parallel(256, 5);
+    bench_from_file(256*1024*1024);
+    bench_builder(appends);
+    bench_pages(appends, 1000000, 4096);
+    bench_handle(appends, 64, 0.5);
+    bench_cp(16*1024*1024, 1000000);
+    bench_save(appends, 10);
+    return 0;
+}
@@ -1,10 +1,18 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
 
 #include "rope.h"
 
+#define NELEM(arr) (sizeof(arr)/sizeof(arr[0]))
+
 // Functions to create test values
 
 /** Return null
@@ -44,7 +52,7 @@ struct rope *create_ab(void)
 {
     struct rope_node *left = alloc_rope_node(1, NULL, NULL, "a");
     struct rope_node *right = alloc_rope_node(1, NULL, NULL, "b");
-    struct rope *r = (struct rope *)malloc(sizeof(struct rope));
+    struct rope *r = (struct rope *)calloc(1, sizeof(struct rope));
     r->head = alloc_rope_node(2, left, right, NULL);
     return r;
 }
@@ -64,7 +72,7 @@ struct rope *create_multichar_single_node1(void)
 */
 struct rope *create_broken_rope_non_leaf(void)
 {
-    struct rope *r = (struct rope *)malloc(sizeof(struct rope));
+    struct rope *r = (struct rope *)calloc(1, sizeof(struct rope));
     struct rope_node *left = alloc_rope_node(1, NULL, NULL, "a");
     r->head = alloc_rope_node(1, left, NULL, NULL);
     return r;
@@ -74,7 +82,7 @@ struct rope *create_broken_rope_non_leaf(void)
 */
 struct rope *create_broken_rope_leaf(void)
 {
-    struct rope *r = (struct rope *)malloc(sizeof(struct rope));
+    struct rope *r = (struct rope *)calloc(1, sizeof(struct rope));
     struct rope_node *valid = alloc_rope_node(1, NULL, NULL, "c");
     struct rope_node *left = alloc_rope_node(1, valid, NULL, "a");
     struct rope_node *right = alloc_rope_node(1, NULL, NULL, "b");
@@ -87,7 +95,7 @@ struct rope *create_broken_rope_leaf(void)
 */
 struct rope *create_broken_rope_leaf_weight(void)
 {
-    struct rope *r = (struct rope *)malloc(sizeof(struct rope));
+    struct rope *r = (struct rope *)calloc(1, sizeof(struct rope));
     struct rope_node *right = alloc_rope_node(2, NULL, NULL, "a");
     struct rope_node *left = alloc_rope_node(1, NULL, NULL, "a");
     r->head = alloc_rope_node(3, left, right, NULL);
@@ -99,7 +107,7 @@ struct rope *create_broken_rope_leaf_weight(void)
 */
 struct rope *create_broken_rope_non_leaf_weight(void)
 {
-    struct rope *r = (struct rope *)malloc(sizeof(struct rope));
+    struct rope *r = (struct rope *)calloc(1, sizeof(struct rope));
     struct rope_node *right = alloc_rope_node(1, NULL, NULL, "a");
     struct rope_node *left = alloc_rope_node(1, NULL, NULL, "a");
     r->head = alloc_rope_node(3, left, right, NULL);
@@ -114,7 +122,7 @@ struct rope *create_single_char_left(void)
     struct rope_node *left = alloc_rope_node(1, NULL, NULL, "e");
     struct rope_node *right = alloc_rope_node(10, NULL, NULL, "fficiently");
     struct rope_node *head = alloc_rope_node(11, left, right, NULL);
-    struct rope *r = (struct rope *)malloc(sizeof(struct rope));
+    struct rope *r = (struct rope *)calloc(1, sizeof(struct rope));
     r->head = head;
     return r;
 }
@@ -124,7 +132,7 @@ struct rope *create_single_char_right(void)
     struct rope_node *left = alloc_rope_node(10, NULL, NULL, "efficientl");
     struct rope_node *right = alloc_rope_node(1, NULL, NULL, "y");
     struct rope_node *head = alloc_rope_node(11, left, right, NULL);
-    struct rope *r = (struct rope *)malloc(sizeof(struct rope));
+    struct rope *r = (struct rope *)calloc(1, sizeof(struct rope));
     r->head = head;
     return r;
 }
@@ -136,7 +144,7 @@ struct rope *create_height2_chars3(void)
     struct rope_node *left = alloc_rope_node(3, NULL, NULL, "foo");
     struct rope_node *right = alloc_rope_node(3, NULL, NULL, "bar");
     struct rope_node *head = alloc_rope_node(6, left, right, NULL);
-    struct rope *r = (struct rope *)malloc(sizeof(struct rope));
+    struct rope *r = (struct rope *)calloc(1, sizeof(struct rope));
     r->head = head;
     return r;  
 }
@@ -189,6 +197,246 @@ struct rope *substring_height_0_to_2(void)
     return new_rope("foo");
 }
 
+/** Create a rope of eight leaves where every concatenation node hangs off the left
+    @return a rope of depth 7 containing "abcdefgh"
+*/
+struct rope *create_left_spine(void)
+{
+    static char *leaves[] = { "a", "b", "c", "d", "e", "f", "g", "h" };
+    struct rope_node *n = alloc_rope_node(1, NULL, NULL, leaves[0]);
+    for (int i = 1; i < NELEM(leaves); ++i)
+        n = alloc_rope_node(i+1, n, alloc_rope_node(1, NULL, NULL, leaves[i]), NULL);
+    struct rope *r = (struct rope *)calloc(1, sizeof(struct rope));
+    r->head = n;
+    return r;
+}
+
+/** Create a left spine of single characters deeper than ROPE_MAX_DEPTH
+*/
+struct rope *create_too_deep(void)
+{
+    struct rope_node *n = alloc_rope_node(1, NULL, NULL, "a");
+    for (int i = 1; i <= ROPE_MAX_DEPTH+1; ++i)
+        n = alloc_rope_node(i+1, n, alloc_rope_node(1, NULL, NULL, "a"), NULL);
+    struct rope *r = (struct rope *)calloc(1, sizeof(struct rope));
+    r->head = n;
+    return r;
+}
+
+/** Create a rope by appending 64 single characters one at a time with rope_concat
+*/
+struct rope *create_appended_64(void)
+{
+    static char *alphabet = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/";
+    static char chars[64][2];
+    struct rope *r = new_rope(""), *piece, *next;
+    for (int i = 0; i < 64; ++i) {
+        chars[i][0] = alphabet[i];
+        piece = new_rope(chars[i]);
+        next = rope_concat(r, piece);
+        free_rope(piece, false);
+        free_rope(r, false);
+        r = next;
+    }
+    return r;
+}
+
+/** Create a rope by prepending 64 single characters one at a time with rope_concat
+*/
+struct rope *create_prepended_64(void)
+{
+    static char *alphabet = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/";
+    static char chars[64][2];
+    struct rope *r = new_rope(""), *piece, *next;
+    for (int i = 63; i >= 0; --i) {
+        chars[i][0] = alphabet[i];
+        piece = new_rope(chars[i]);
+        next = rope_concat(piece, r);
+        free_rope(piece, false);
+        free_rope(r, false);
+        r = next;
+    }
+    return r;
+}
+
+struct rope *create_appended_64_substring_3_to_40(void)
+{
+    return rope_substring(create_appended_64(), 3, 40);
+}
+
+struct rope *create_appended_64_substring_5_to_15(void)
+{
+    return rope_substring(create_appended_64(), 5, 15);
+}
+
+struct rope *create_left_spine_rebalanced(void)
+{
+    return rope_rebalance(create_left_spine());
+}
+
+int count_leaves(struct rope_node *n)
+{
+    if (!n)
+        return 0;
+    if (!n->left && !n->right)
+        return 1;
+    return count_leaves(n->left) + count_leaves(n->right);
+}
+
+/** Create the rope "foobar" with three concatenations in an arena
+*/
+struct rope *create_arena_foobar(struct rope_arena *a)
+{
+    struct rope *f = new_arena_rope(a, "f"), *oo = new_arena_rope(a, "oo");
+    struct rope *bar = new_arena_rope(a, "bar");
+    return rope_concat(rope_concat(f, oo), bar);
+}
+
+struct rope *create_arena_substring(struct rope_arena *a)
+{
+    return rope_substring(create_arena_foobar(a), 2, 5);
+}
+
+struct rope *create_arena_chunked(struct rope_arena *a)
+{
+    rope_set_chunk_size(8);
+    struct rope *r = create_arena_foobar(a);
+    rope_set_chunk_size(0);
+    return r;
+}
+
+struct rope *create_arena_appended(struct rope_arena *a)
+{
+    struct rope *r = new_arena_rope(a, "");
+    for (int i = 0; i < 1000; ++i)
+        r = rope_concat(r, new_arena_rope(a, "x"));
+    return rope_substring(r, 997, 1000);
+}
+
+/** Whether the depths of the children of every node under n differ by at most one
+*/
+bool is_avl(struct rope_node *n)
+{
+    if (!n || !n->left || !n->right)
+        return true;
+    return abs(n->left->depth - n->right->depth) <= 1 && is_avl(n->left) && is_avl(n->right);
+}
+
+bool all_in_arena(struct rope_node *n)
+{
+    if (!n)
+        return true;
+    return (n->flags & ROPE_NODE_ARENA) && all_in_arena(n->left) && all_in_arena(n->right);
+}
+
+/** Take a substring of a rope, then free the rope it came from
+*/
+struct rope *create_substring_outliving_source(void)
+{
+    struct rope *r = create_appended_64();
+    struct rope *sub = rope_substring(r, 3, 40);
+    free_rope(r, false);
+    return sub;
+}
+
+struct rope *create_chunked_substring_outliving_source(void)
+{
+    rope_set_chunk_size(16);
+    struct rope *r = create_appended_64();
+    struct rope *sub = rope_substring(r, 3, 40);
+    rope_set_chunk_size(0);
+    free_rope(r, false);
+    return sub;
+}
+
+/** Concatenate a rope with a substring of itself, then free both inputs
+*/
+struct rope *create_concat_outliving_inputs(void)
+{
+    struct rope *r = create_height2_chars3();
+    struct rope *sub = rope_substring(r, 1, 4);
+    struct rope *ret = rope_concat(r, sub);
+    free_rope(r, false);
+    free_rope(sub, false);
+    return ret;
+}
+
+struct rope *create_copy_outliving_source(void)
+{
+    struct rope *r = create_rope_height_3();
+    struct rope *copy = rope_copy(r);
+    bool shared = copy->head == r->head;
+    free_rope(r, false);
+    return shared ? copy : NULL;
+}
+
+struct rope *create_rebalanced_outliving_source(void)
+{
+    struct rope *r = create_left_spine();
+    struct rope *balanced = rope_rebalance(r);
+    free_rope(r, false);
+    return balanced;
+}
+
+struct rope *create_concat_self(void)
+{
+    struct rope *r = create_height2_chars3();
+    struct rope *ret = rope_concat(r, r);
+    free_rope(r, false);
+    return ret;
+}
+
+/** Create a rope whose repeats straddle its leaves
+    @return a rope containing "aabaabaaab"
+*/
+struct rope *create_repeated_aab(void)
+{
+    return new_ropev(4, "aab", "aa", "ba", "aab");
+}
+
+/** Create a rope with newlines at both ends of leaves and two in a row
+    @return a rope containing "ab\nc\nde\n\nfg\n"
+*/
+struct rope *create_lines(void)
+{
+    return new_ropev(4, "ab\nc", "\n", "de\n\nf", "g\n");
+}
+
+struct rope *create_abcdefghijkl_flat(void)
+{
+    return new_rope("abcdefghijkl");
+}
+
+struct rope *create_abcdefghijkm(void)
+{
+    return new_ropev(4, "abc", "def", "ghi", "jkm");
+}
+
+/** Create "foobarfoobar" by editing create_concat_self back to what it was
+    @return a rope sharing most of its nodes with the original, in a different shape
+*/
+struct rope *create_concat_self_edited(void)
+{
+    struct rope *r = create_concat_self();
+    struct rope *inserted = rope_insert(r, 3, "xyz");
+    struct rope *ret = rope_delete(inserted, 3, 6);
+    free_rope(inserted, false);
+    free_rope(r, false);
+    return ret;
+}
+
+/** Create the appended 64 character rope with one character in the middle replaced
+*/
+struct rope *create_appended_64_replaced(void)
+{
+    struct rope *r = create_appended_64();
+    struct rope *deleted = rope_delete(r, 40, 41);
+    struct rope *ret = rope_insert(deleted, 40, "!");
+    free_rope(deleted, false);
+    free_rope(r, false);
+    return ret;
+}
+
 // Types to describe single tests
 typedef struct rope *(*create_rope_func)(void);
 
@@ -209,6 +457,19 @@ struct rope_concat_test {
     create_rope_func expected;
 };
 
+struct rope_equal_test {
+    create_rope_func arg1;
+    create_rope_func arg2;
+    bool expected;
+};
+
+struct rope_compare_test {
+    create_rope_func arg1;
+    create_rope_func arg2;
+    int expected;       // the sign of the result
+    int64_t mismatch;
+};
+
 struct rope_tostring_test {
     create_rope_func setup;
     char *expected;
@@ -221,8 +482,99 @@ struct rope_substring_test {
     create_rope_func expected;
 };
 
+struct rope_balance_test {
+    create_rope_func setup;
+    bool rebalance;
+    int max_depth;
+    char *expected;
+};
+
+typedef struct rope *(*create_arena_rope_func)(struct rope_arena *a);
+
+struct rope_arena_test {
+    create_arena_rope_func setup;
+    char *expected;
+};
+
+struct rope_iter_test {
+    create_rope_func setup;
+    int pos;
+    char *expected;     // the whole rope
+};
+
+struct rope_split_test {
+    create_rope_func setup;
+    int index;
+    char *expected_left;
+    char *expected_right;
+};
+
+struct rope_insert_test {
+    create_rope_func setup;
+    int index;
+    char *s;
+    char *expected;
+};
+
+struct rope_delete_test {
+    create_rope_func setup;
+    int lo;
+    int hi;
+    char *expected;
+};
+
+struct rope_copy_range_test {
+    create_rope_func setup;
+    int lo;
+    int hi;
+    char *expected;
+};
+
+struct rope_chunk_test {
+    int chunk_size;
+    create_rope_func setup;
+    int max_leaves;
+    char *expected;
+};
+
+struct rope_find_test {
+    create_rope_func setup;
+    char *needle;
+    int from;
+    int count;          // matches expected, overlapping ones included
+    int expected[8];    // their offsets
+};
+
+struct rope_lines_test {
+    create_rope_func setup;
+    int count;          // lines expected
+    int starts[8];      // the offset each line starts at
+};
+
+struct rope_builder_test {
+    int pieces;         // strings pushed into the builder
+    int length;         // characters in each
+    int copy_every;     // push every nth piece with rope_builder_push_copy, 0 for never
+    bool arena;
+    int max_depth;
+};
+
+struct rope_save_test {
+    create_rope_func setup;
+    bool checksum;
+    int damage;     // offset of a byte to flip in the saved file, or -1 for none
+    int damage_end; // offset from the end of the file of another byte to flip, or 0 for none
+    int truncate;   // bytes to cut off the end of the saved file
+    bool loads;
+};
+
+struct rope_from_file_test {
+    int length;     // bytes to write to the file, or -1 for no file at all
+    int lo;         // substring kept after the rope itself is freed
+    int hi;
+};
+
 // tables of tests
-#define NELEM(arr) (sizeof(arr)/sizeof(arr[0]))
 
 struct is_rope_test is_rope_tests[] = {
     { // An empty rope
@@ -346,6 +698,60 @@ struct rope_concat_test rope_concat_tests[] = {
     }
 };
 
+struct rope_compare_test rope_compare_tests[] = {
+    { .arg1 = create_null_rope, .arg2 = create_empty_rope, .expected = 0, .mismatch = 0 },
+    { .arg1 = create_rope_height_3, .arg2 = create_abcdefghijkl_flat, .expected = 0, .mismatch = 12 },
+    { .arg1 = create_rope_height_3, .arg2 = create_abcdefghijkm, .expected = -1, .mismatch = 11 },
+    { .arg1 = create_appended_64_replaced, .arg2 = create_appended_64, .expected = -1, .mismatch = 40 },
+    { .arg1 = create_concat_self, .arg2 = create_concat_self_edited, .expected = 0, .mismatch = 12 },
+    { .arg1 = create_single_charactera, .arg2 = create_ab, .expected = -1, .mismatch = 1 },
+    { .arg1 = create_appended_64_substring_3_to_40, .arg2 = create_appended_64, .expected = 1, .mismatch = 0 },
+    { .arg1 = create_lines, .arg2 = create_empty_rope, .expected = 1, .mismatch = 0 },
+};
+
+struct rope_equal_test rope_equal_tests[] = {
+    {
+        .arg1 = create_null_rope,
+        .arg2 = create_empty_rope,
+        .expected = true
+    },
+    { // same text, different shapes
+        .arg1 = create_rope_height_3,
+        .arg2 = create_abcdefghijkl_flat,
+        .expected = true
+    },
+    {
+        .arg1 = create_height2_chars3,
+        .arg2 = create_multichar_single_node1,
+        .expected = true
+    },
+    {
+        .arg1 = create_appended_64,
+        .arg2 = create_prepended_64,
+        .expected = true
+    },
+    {
+        .arg1 = create_concat_self,
+        .arg2 = create_concat_self_edited,
+        .expected = true
+    },
+    { // last character differs
+        .arg1 = create_rope_height_3,
+        .arg2 = create_abcdefghijkm,
+        .expected = false
+    },
+    {
+        .arg1 = create_appended_64,
+        .arg2 = create_appended_64_replaced,
+        .expected = false
+    },
+    {
+        .arg1 = create_appended_64,
+        .arg2 = create_appended_64_substring_3_to_40,
+        .expected = false
+    }
+};
+
 struct rope_tostring_test rope_tostring_tests[] = {
     {
         .setup = create_empty_rope,
@@ -458,58 +864,625 @@ struct rope_substring_test rope_substring_tests[] = {
     }
 };
 
-int main_is_rope()
-{
-    struct rope *r;
-    bool result;
-    struct is_rope_test *test;
-    int failed = 0;
-    for (int i = 0; i < NELEM(is_rope_tests); ++i) {
-        test = &is_rope_tests[i];
-        r = test->setup();
-        result = is_rope(r);
-        if (result != test->expected) {
-            printf("is_rope failed test %d: expected %d, got %d\n", i, test->expected, result);
-            failed++;
-        } else {
-            printf("is_rope passed test %d\n", i);
-        }
-        free_rope(r, false);
+struct rope_balance_test rope_balance_tests[] = {
+    { // concatenation keeps appends logarithmic
+        .setup = create_appended_64,
+        .rebalance = false,
+        .max_depth = 8,
+        .expected = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"
+    },
+    { // and prepends
+        .setup = create_prepended_64,
+        .rebalance = false,
+        .max_depth = 8,
+        .expected = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"
+    },
+    { // explicit rebalance of a degenerate rope
+        .setup = create_left_spine,
+        .rebalance = true,
+        .max_depth = 3,
+        .expected = "abcdefgh"
+    },
+    { // rebalancing an already balanced rope
+        .setup = create_rope_height_3,
+        .rebalance = true,
+        .max_depth = 2,
+        .expected = "abcdefghijkl"
+    },
+    {
+        .setup = create_empty_rope,
+        .rebalance = true,
+        .max_depth = 0,
+        .expected = ""
     }
-    return failed;
-}
+};
 
-int main_rope_index()
-{
-    struct rope *r;
-    int index;
-    char result;
-    struct rope_index_test *test;
-    int failed = 0;
-    for (int i = 0; i < NELEM(rope_index_tests); ++i) {
-        test = &rope_index_tests[i];
-        r = test->setup();
-        index = test->index;
-        result = rope_index(r, index);
-        if (result != test->expected) {
-            printf("rope_index failed test %d: expected %c, got %c\n", i, test->expected, result);
-            failed++;
-        } else {
-            printf("rope_index passed test %d\n", i);
-        }
-        free_rope(r, false);
+struct rope_chunk_test rope_chunk_tests[] = {
+    { // appended characters collapse into a single chunk
+        .chunk_size = 64,
+        .setup = create_appended_64,
+        .max_leaves = 1,
+        .expected = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"
+    },
+    {
+        .chunk_size = 16,
+        .setup = create_appended_64,
+        .max_leaves = 4,
+        .expected = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"
+    },
+    {
+        .chunk_size = 16,
+        .setup = create_prepended_64,
+        .max_leaves = 4,
+        .expected = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"
+    },
+    { // chunking off keeps one leaf per piece
+        .chunk_size = 0,
+        .setup = create_appended_64,
+        .max_leaves = 64,
+        .expected = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"
+    },
+    { // small substrings become a single chunk
+        .chunk_size = 16,
+        .setup = create_appended_64_substring_5_to_15,
+        .max_leaves = 1,
+        .expected = "56789abcde"
+    },
+    {
+        .chunk_size = 16,
+        .setup = create_appended_64_substring_3_to_40,
+        .max_leaves = 4,
+        .expected = "3456789abcdefghijklmnopqrstuvwxyzABCD"
+    },
+    { // rebalancing coalesces small leaves
+        .chunk_size = 4,
+        .setup = create_left_spine_rebalanced,
+        .max_leaves = 2,
+        .expected = "abcdefgh"
     }
-    return failed;
-}
+};
 
-int main_rope_concat()
-{
-    struct rope *r1, *r2, *res, *expect;
-    struct rope_concat_test *test;
-    int failed = 0;
-    for (int i = 0; i < NELEM(rope_concat_tests); ++i) {
-        test = &rope_concat_tests[i];
-        r1 = test->arg1();
+struct rope_arena_test rope_arena_tests[] = {
+    {
+        .setup = create_arena_foobar,
+        .expected = "foobar"
+    },
+    {
+        .setup = create_arena_substring,
+        .expected = "oba"
+    },
+    {
+        .setup = create_arena_chunked,
+        .expected = "foobar"
+    },
+    {
+        .setup = create_arena_appended,
+        .expected = "xxx"
+    }
+};
+
+struct rope_tostring_test rope_sharing_tests[] = {
+    {
+        .setup = create_substring_outliving_source,
+        .expected = "3456789abcdefghijklmnopqrstuvwxyzABCD"
+    },
+    {
+        .setup = create_chunked_substring_outliving_source,
+        .expected = "3456789abcdefghijklmnopqrstuvwxyzABCD"
+    },
+    {
+        .setup = create_concat_outliving_inputs,
+        .expected = "foobaroob"
+    },
+    {
+        .setup = create_copy_outliving_source,
+        .expected = "abcdefghijkl"
+    },
+    {
+        .setup = create_rebalanced_outliving_source,
+        .expected = "abcdefgh"
+    }
+};
+
+struct rope_iter_test rope_iter_tests[] = {
+    {
+        .setup = create_empty_rope,
+        .pos = 0,
+        .expected = ""
+    },
+    {
+        .setup = create_single_charactera,
+        .pos = 0,
+        .expected = "a"
+    },
+    {
+        .setup = create_single_charactera,
+        .pos = 1,
+        .expected = "a"
+    },
+    {
+        .setup = create_rope_height_3,
+        .pos = 0,
+        .expected = "abcdefghijkl"
+    },
+    { // on a leaf boundary
+        .setup = create_rope_height_3,
+        .pos = 6,
+        .expected = "abcdefghijkl"
+    },
+    { // in the middle of a leaf
+        .setup = create_rope_height_3,
+        .pos = 7,
+        .expected = "abcdefghijkl"
+    },
+    { // at the end
+        .setup = create_rope_height_3,
+        .pos = 12,
+        .expected = "abcdefghijkl"
+    },
+    { // past the end is clamped
+        .setup = create_single_char_left,
+        .pos = 50,
+        .expected = "efficiently"
+    },
+    {
+        .setup = create_appended_64,
+        .pos = 31,
+        .expected = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"
+    },
+    { // concatenation of a rope with itself has the same node on both sides
+        .setup = create_concat_self,
+        .pos = 2,
+        .expected = "foobarfoobar"
+    }
+};
+
+struct rope_split_test rope_split_tests[] = {
+    {
+        .setup = create_empty_rope,
+        .index = 0,
+        .expected_left = "",
+        .expected_right = ""
+    },
+    {
+        .setup = create_single_charactera,
+        .index = 0,
+        .expected_left = "",
+        .expected_right = "a"
+    },
+    {
+        .setup = create_single_charactera,
+        .index = 1,
+        .expected_left = "a",
+        .expected_right = ""
+    },
+    { // inside a leaf
+        .setup = create_multichar_single_node1,
+        .index = 2,
+        .expected_left = "fo",
+        .expected_right = "obar"
+    },
+    { // on a leaf boundary
+        .setup = create_rope_height_3,
+        .index = 6,
+        .expected_left = "abcdef",
+        .expected_right = "ghijkl"
+    },
+    {
+        .setup = create_rope_height_3,
+        .index = 4,
+        .expected_left = "abcd",
+        .expected_right = "efghijkl"
+    },
+    {
+        .setup = create_appended_64,
+        .index = 37,
+        .expected_left = "0123456789abcdefghijklmnopqrstuvwxyzA",
+        .expected_right = "BCDEFGHIJKLMNOPQRSTUVWXYZ+/"
+    },
+    { // out of range is clamped
+        .setup = create_height2_chars3,
+        .index = 9,
+        .expected_left = "foobar",
+        .expected_right = ""
+    }
+};
+
+struct rope_insert_test rope_insert_tests[] = {
+    {
+        .setup = create_empty_rope,
+        .index = 0,
+        .s = "abc",
+        .expected = "abc"
+    },
+    {
+        .setup = create_height2_chars3,
+        .index = 0,
+        .s = "xyz",
+        .expected = "xyzfoobar"
+    },
+    {
+        .setup = create_height2_chars3,
+        .index = 6,
+        .s = "xyz",
+        .expected = "foobarxyz"
+    },
+    {
+        .setup = create_height2_chars3,
+        .index = 3,
+        .s = "xyz",
+        .expected = "fooxyzbar"
+    },
+    {
+        .setup = create_rope_height_3,
+        .index = 7,
+        .s = "xyz",
+        .expected = "abcdefgxyzhijkl"
+    },
+    {
+        .setup = create_single_char_left,
+        .index = 5,
+        .s = "",
+        .expected = "efficiently"
+    },
+    {
+        .setup = create_appended_64,
+        .index = 10,
+        .s = "-",
+        .expected = "0123456789-abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"
+    }
+};
+
+struct rope_delete_test rope_delete_tests[] = {
+    {
+        .setup = create_empty_rope,
+        .lo = 0,
+        .hi = 0,
+        .expected = ""
+    },
+    {
+        .setup = create_single_charactera,
+        .lo = 0,
+        .hi = 1,
+        .expected = ""
+    },
+    {
+        .setup = create_height2_chars3,
+        .lo = 2,
+        .hi = 2,
+        .expected = "foobar"
+    },
+    { // inside a leaf
+        .setup = create_multichar_single_node1,
+        .lo = 2,
+        .hi = 4,
+        .expected = "foar"
+    },
+    { // across leaves
+        .setup = create_rope_height_3,
+        .lo = 2,
+        .hi = 10,
+        .expected = "abkl"
+    },
+    {
+        .setup = create_rope_height_3,
+        .lo = 3,
+        .hi = 9,
+        .expected = "abcjkl"
+    },
+    {
+        .setup = create_rope_height_3,
+        .lo = 0,
+        .hi = 11,
+        .expected = "l"
+    },
+    {
+        .setup = create_appended_64,
+        .lo = 1,
+        .hi = 63,
+        .expected = "0/"
+    },
+    { // out of range is clamped
+        .setup = create_height2_chars3,
+        .lo = -4,
+        .hi = 2,
+        .expected = "obar"
+    }
+};
+
+struct rope_copy_range_test rope_copy_range_tests[] = {
+    {
+        .setup = create_empty_rope,
+        .lo = 0,
+        .hi = 0,
+        .expected = ""
+    },
+    {
+        .setup = create_single_charactera,
+        .lo = 0,
+        .hi = 1,
+        .expected = "a"
+    },
+    {
+        .setup = create_multichar_single_node1,
+        .lo = 1,
+        .hi = 4,
+        .expected = "oob"
+    },
+    {
+        .setup = create_rope_height_3,
+        .lo = 0,
+        .hi = 12,
+        .expected = "abcdefghijkl"
+    },
+    {
+        .setup = create_rope_height_3,
+        .lo = 2,
+        .hi = 7,
+        .expected = "cdefg"
+    },
+    {
+        .setup = create_rope_height_3,
+        .lo = 6,
+        .hi = 9,
+        .expected = "ghi"
+    },
+    {
+        .setup = create_appended_64,
+        .lo = 60,
+        .hi = 100,
+        .expected = "YZ+/"
+    },
+    {
+        .setup = create_height2_chars3,
+        .lo = 5,
+        .hi = 2,
+        .expected = ""
+    }
+};
+
+struct rope_find_test rope_find_tests[] = {
+    {
+        .setup = create_empty_rope,
+        .needle = "a",
+        .count = 0
+    },
+    {
+        .setup = create_multichar_single_node1,
+        .needle = "ob",
+        .count = 1,
+        .expected = { 2 }
+    },
+    { // across two leaves
+        .setup = create_height2_chars3,
+        .needle = "oba",
+        .count = 1,
+        .expected = { 2 }
+    },
+    { // across four leaves
+        .setup = create_rope_height_3,
+        .needle = "cdefghij",
+        .count = 1,
+        .expected = { 2 }
+    },
+    {
+        .setup = create_rope_height_3,
+        .needle = "jkm",
+        .count = 0
+    },
+    {
+        .setup = create_repeated_aab,
+        .needle = "aab",
+        .count = 3,
+        .expected = { 0, 3, 7 }
+    },
+    {
+        .setup = create_repeated_aab,
+        .needle = "aab",
+        .from = 1,
+        .count = 2,
+        .expected = { 3, 7 }
+    },
+    { // overlapping
+        .setup = create_repeated_aab,
+        .needle = "aa",
+        .count = 4,
+        .expected = { 0, 3, 6, 7 }
+    },
+    { // one character per leaf
+        .setup = create_appended_64,
+        .needle = "xyzA",
+        .count = 1,
+        .expected = { 33 }
+    },
+    { // longer than the carry buffer on the stack
+        .setup = create_appended_64,
+        .needle = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/",
+        .count = 1,
+        .expected = { 0 }
+    },
+    { // longer than the rope
+        .setup = create_height2_chars3,
+        .needle = "foobarfoo",
+        .count = 0
+    }
+};
+
+struct rope_builder_test rope_builder_tests[] = {
+    { .pieces = 0, .length = 5, .copy_every = 0, .arena = false, .max_depth = 0 },
+    { .pieces = 1, .length = 5, .copy_every = 0, .arena = false, .max_depth = 0 },
+    { .pieces = 3, .length = 1, .copy_every = 0, .arena = false, .max_depth = 2 },
+    { .pieces = 1000, .length = 7, .copy_every = 0, .arena = false, .max_depth = 10 },
+    { .pieces = 1023, .length = 3, .copy_every = 0, .arena = true, .max_depth = 10 },
+    { .pieces = 1000, .length = 10, .copy_every = 1, .arena = false, .max_depth = 2 },
+    { .pieces = 777, .length = 50, .copy_every = 3, .arena = false, .max_depth = 10 },
+    { .pieces = 777, .length = 50, .copy_every = 2, .arena = true, .max_depth = 10 },
+    { .pieces = 200, .length = 5000, .copy_every = 1, .arena = false, .max_depth = 8 },
+    { .pieces = 10, .length = 0, .copy_every = 2, .arena = false, .max_depth = 0 },
+};
+
+struct rope_lines_test rope_lines_tests[] = {
+    {
+        .setup = create_empty_rope,
+        .count = 1,
+        .starts = { 0 }
+    },
+    {
+        .setup = create_height2_chars3,
+        .count = 1,
+        .starts = { 0 }
+    },
+    {
+        .setup = create_lines,
+        .count = 6,
+        .starts = { 0, 3, 5, 8, 9, 12 }
+    }
+};
+
+struct rope_save_test rope_save_tests[] = {
+    { .setup = create_empty_rope, .checksum = false, .damage = -1, .truncate = 0, .loads = true },
+    { .setup = create_single_charactera, .checksum = true, .damage = -1, .truncate = 0, .loads = true },
+    { .setup = create_lines, .checksum = false, .damage = -1, .truncate = 0, .loads = true },
+    { .setup = create_concat_self, .checksum = true, .damage = -1, .truncate = 0, .loads = true },
+    { .setup = create_concat_self_edited, .checksum = false, .damage = -1, .truncate = 0, .loads = true },
+    { .setup = create_appended_64_replaced, .checksum = true, .damage = -1, .truncate = 0, .loads = true },
+    { .setup = create_left_spine, .checksum = false, .damage = -1, .truncate = 0, .loads = true },
+    { .setup = create_appended_64_substring_3_to_40, .checksum = false, .damage = -1, .truncate = 0, .loads = true },
+    { .setup = create_lines, .checksum = true, .damage = 18, .truncate = 0, .loads = false },    // in the text
+    { .setup = create_lines, .checksum = false, .damage = 0, .truncate = 0, .loads = false },    // in the magic
+    { .setup = create_lines, .checksum = false, .damage = -1, .truncate = 8, .loads = false },
+    // the head's newline and code point counts, which are recounted from the text
+    { .setup = create_lines, .checksum = false, .damage = -1, .damage_end = 72, .truncate = 0, .loads = true },
+    { .setup = create_lines, .checksum = false, .damage = -1, .damage_end = 64, .truncate = 0, .loads = true },
+    { .setup = create_too_deep, .checksum = false, .damage = -1, .truncate = 0, .loads = false },
+};
+
+struct rope_from_file_test rope_from_file_tests[] = {
+    { // missing file
+        .length = -1
+    },
+    {
+        .length = 0,
+        .lo = 0,
+        .hi = 0
+    },
+    {
+        .length = 300,
+        .lo = 250,
+        .hi = 260
+    },
+    { // several spans, cut across the first boundary
+        .length = 200000,
+        .lo = 65530,
+        .hi = 65546
+    }
+};
+
+int main_is_rope()
+{
+    struct rope *r;
+    bool result;
+    struct is_rope_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(is_rope_tests); ++i) {
+        test = &is_rope_tests[i];
+        r = test->setup();
+        result = is_rope(r);
+        if (result != test->expected) {
+            printf("is_rope failed test %d: expected %d, got %d\n", i, test->expected, result);
+            failed++;
+        } else {
+            printf("is_rope passed test %d\n", i);
+        }
+        free_rope(r, false);
+    }
+
+    // node depths are 16 bits, so hand-built trees stop short of overflowing them
+    struct rope_node *n = alloc_rope_node(1, NULL, NULL, "a"), *next, *leaf;
+    errno = 0;
+    while ((next = alloc_rope_node(n->weight+1, n, leaf = alloc_rope_node(1, NULL, NULL, "a"), NULL)) != NULL)
+        n = next;
+    if (n->depth != INT16_MAX-1 || errno != EINVAL) {
+        printf("is_rope failed depth limit test: stopped at depth %d\n", n->depth);
+        failed++;
+    } else {
+        printf("is_rope passed depth limit test\n");
+    }
+    struct rope *ropes[2] = { calloc(1, sizeof(struct rope)), calloc(1, sizeof(struct rope)) };
+    ropes[0]->head = n;
+    ropes[1]->head = leaf;
+    free_rope(ropes[0], false);
+    free_rope(ropes[1], false);
+    return failed;
+}
+
+int main_rope_index()
+{
+    struct rope *r;
+    int index;
+    char result;
+    struct rope_index_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_index_tests); ++i) {
+        test = &rope_index_tests[i];
+        r = test->setup();
+        index = test->index;
+        result = rope_index(r, index);
+        if (result != test->expected) {
+            printf("rope_index failed test %d: expected %c, got %c\n", i, test->expected, result);
+            failed++;
+        } else {
+            printf("rope_index passed test %d\n", i);
+        }
+        free_rope(r, false);
+    }
+    return failed;
+}
+
+int main_rope_index_batch()
+{
+    static create_rope_func setups[] = {
+        create_null_rope, create_empty_rope, create_single_charactera, create_rope_height_3,
+        create_left_spine, create_appended_64, create_appended_64_substring_3_to_40,
+        create_appended_64_substring_5_to_15, create_concat_self_edited, create_lines,
+    };
+    int64_t offsets[200];
+    char out[200];
+    int failed = 0;
+    srand(21);
+    for (int i = 0; i < NELEM(setups); ++i) {
+        struct rope *r = setups[i]();
+        int64_t length = rope_length(r);
+        bool ok = true;
+        for (int order = 0; order < 3; ++order) {   // ascending, descending, random with repeats
+            int n = 0;
+            for (int64_t j = -2; j < length + 2; ++j)
+                offsets[n++] = order == 0 ? j : order == 1 ? length + 1 - j : rand() % (length + 4) - 2;
+            memset(out, 'x', sizeof(out));
+            ok = ok && rope_index_batch(r, offsets, n, out);
+            for (int j = 0; j < n; ++j)
+                ok = ok && out[j] == rope_index(r, offsets[j]);
+            ok = ok && out[n] == 'x';
+        }
+        if (!ok) {
+            printf("rope_index_batch failed test %d\n", i);
+            failed++;
+        } else {
+            printf("rope_index_batch passed test %d\n", i);
+        }
+        free_rope(r, false);
+    }
+    return failed;
+}
+
+int main_rope_concat()
+{
+    struct rope *r1, *r2, *res, *expect;
+    struct rope_concat_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_concat_tests); ++i) {
+        test = &rope_concat_tests[i];
+        r1 = test->arg1();
         r2 = test->arg2();
         expect = test->expected();
         res = rope_concat(r1, r2);
@@ -517,60 +1490,1696 @@ int main_rope_concat()
             printf("rope_concat failed test %d\n", i);
             failed++;
         } else {
-            printf("rope_concat passed test %d\n", i);
+            printf("rope_concat passed test %d\n", i);
+        }
+        free_rope(expect, false);
+        free_rope(res, false);
+        free_rope(r1, false);
+        free_rope(r2, false);
+    }
+    return failed;
+}
+
+/** Check rope_equal both ways round, and that equal ropes hash the same
+*/
+int main_rope_equal()
+{
+    struct rope *r1, *r2;
+    struct rope_equal_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_equal_tests); ++i) {
+        test = &rope_equal_tests[i];
+        r1 = test->arg1();
+        r2 = test->arg2();
+        bool result = rope_equal(r1, r2);
+        if (result != test->expected || rope_equal(r2, r1) != result
+            || (rope_hash(r1) == rope_hash(r2)) != test->expected) {
+            printf("rope_equal failed test %d: expected %d, got %d\n", i, test->expected, result);
+            failed++;
+        } else {
+            printf("rope_equal passed test %d\n", i);
+        }
+        free_rope(r1, false);
+        free_rope(r2, false);
+    }
+    return failed;
+}
+
+struct rope_diff_test {
+    create_rope_func arg1;
+    create_rope_func arg2;
+    int count;
+    struct rope_edit expected[2];
+};
+
+struct rope_stats_test {
+    create_rope_func setup;
+    struct rope_stats expected;
+};
+
+struct rope_stats_test rope_stats_tests[] = {
+    { .setup = create_null_rope, .expected = { 0 } },
+    {
+        .setup = create_rope_height_3,
+        .expected = { .length = 12, .depth = 2, .nodes = 7, .leaves = 4, .tiny_leaves = 4,
+                      .node_bytes = 7*sizeof(struct rope_node), .text_bytes = 12, .leaf_sizes = { [2] = 4 } }
+    },
+    { // one subtree, used twice
+        .setup = create_concat_self,
+        .expected = { .length = 12, .depth = 2, .nodes = 4, .leaves = 2, .tiny_leaves = 2, .shared_nodes = 1,
+                      .shared_bytes = 6, .node_bytes = 4*sizeof(struct rope_node), .text_bytes = 6,
+                      .leaf_sizes = { [2] = 2 } }
+    },
+    { // a slice over the 64 leaves, which the source rope still holds too
+        .setup = create_appended_64_substring_3_to_40,
+        .expected = { .length = 37, .depth = 7, .nodes = 128, .leaves = 64, .tiny_leaves = 64,
+                      .shared_nodes = 1, .shared_bytes = 64, .pinned_bytes = 27, .node_bytes = 128*sizeof(struct rope_node), .text_bytes = 64,
+                      .leaf_sizes = { [1] = 64 } }
+    },
+};
+
+struct rope *create_appended_64_inserted(void)
+{
+    struct rope *r = create_appended_64();
+    struct rope *ret = rope_insert(r, 10, "inserted");
+    free_rope(r, false);
+    return ret;
+}
+
+struct rope *create_abc(void)
+{
+    return new_rope("abc");
+}
+
+struct rope *create_xyz(void)
+{
+    return new_rope("xyz");
+}
+
+struct rope_diff_test rope_diff_tests[] = {
+    { .arg1 = create_null_rope, .arg2 = create_empty_rope, .count = 0 },
+    { .arg1 = create_rope_height_3, .arg2 = create_abcdefghijkl_flat, .count = 0 },
+    { .arg1 = create_concat_self, .arg2 = create_concat_self_edited, .count = 0 },
+    { .arg1 = create_null_rope, .arg2 = create_lines, .count = 1, .expected = { { 0, 0, 0, 12 } } },
+    { .arg1 = create_lines, .arg2 = create_empty_rope, .count = 1, .expected = { { 0, 12, 0, 0 } } },
+    { .arg1 = create_rope_height_3, .arg2 = create_abcdefghijkm, .count = 1, .expected = { { 11, 12, 11, 12 } } },
+    { .arg1 = create_appended_64, .arg2 = create_appended_64_replaced, .count = 1, .expected = { { 40, 41, 40, 41 } } },
+    { .arg1 = create_appended_64, .arg2 = create_appended_64_inserted, .count = 1, .expected = { { 10, 10, 10, 18 } } },
+    { .arg1 = create_appended_64, .arg2 = create_prepended_64, .count = 0 },
+    { .arg1 = create_abc, .arg2 = create_xyz, .count = 1, .expected = { { 0, 3, 0, 3 } } },  // nothing shared
+};
+
+/** Check that applying edits to r1 gives r2
+*/
+static bool diff_applies(struct rope *r1, struct rope *r2, struct rope_edit *edits, int64_t count)
+{
+    char *s1 = rope_tostring(r1), *s2 = rope_tostring(r2);
+    char *out = malloc(rope_length(r1) + rope_length(r2) + 1), *p = out;
+    int64_t at = 0;
+    bool ok = true;
+    for (int64_t i = 0; i < count; ++i) {
+        ok = ok && edits[i].old_lo >= at && edits[i].old_lo <= edits[i].old_hi && edits[i].new_lo <= edits[i].new_hi
+             && edits[i].new_hi <= rope_length(r2) && (i == 0 || edits[i].old_lo > edits[i-1].old_hi
+                                                       || edits[i].new_lo > edits[i-1].new_hi);
+        if (!ok)
+            break;
+        memcpy(p, s1 + at, edits[i].old_lo - at);
+        p += edits[i].old_lo - at;
+        memcpy(p, s2 + edits[i].new_lo, edits[i].new_hi - edits[i].new_lo);
+        p += edits[i].new_hi - edits[i].new_lo;
+        at = edits[i].old_hi;
+    }
+    if (ok) {
+        strcpy(p, s1 + at);
+        ok = !strcmp(out, s2);
+    }
+    free(s1);
+    free(s2);
+    free(out);
+    return ok;
+}
+
+int main_rope_diff()
+{
+    struct rope *r1, *r2, *next;
+    struct rope_edit *edits;
+    struct rope_diff_test *test;
+    int64_t count;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_diff_tests); ++i) {
+        test = &rope_diff_tests[i];
+        r1 = test->arg1();
+        r2 = test->arg2();
+        edits = rope_diff(r1, r2, &count);
+        if (!edits || count != test->count || memcmp(edits, test->expected, count * sizeof(*edits))
+            || !diff_applies(r1, r2, edits, count)) {
+            printf("rope_diff failed test %d: expected %d edits, got %lld\n", i, test->count, (long long)count);
+            failed++;
+        } else {
+            printf("rope_diff passed test %d\n", i);
+        }
+        free(edits);
+        free_rope(r1, false);
+        free_rope(r2, false);
+    }
+
+    // two edits far apart in a rope derived from the first
+    r1 = create_appended_64();
+    next = rope_delete(r1, 5, 9);
+    r2 = rope_insert(next, 50, "xy");
+    free_rope(next, false);
+    edits = rope_diff(r1, r2, &count);
+    bool ok = edits && count == 2 && !memcmp(edits, (struct rope_edit []){ { 5, 9, 5, 5 }, { 54, 54, 50, 52 } },
+                                             2 * sizeof(*edits));
+    free(edits);
+    free_rope(r1, false);
+    free_rope(r2, false);
+
+    // random edits, block moves and substrings of a large rope
+    static char text[] = "the quick brown fox jumps over the lazy dog\n";
+    struct rope_builder *b = new_rope_builder(NULL);
+    for (int i = 0; i < 2000; ++i)
+        rope_builder_push(b, text, sizeof(text)-1);
+    r1 = rope_builder_finish(b);
+    srand(24);
+    for (int round = 0; round < 40 && ok; ++round) {
+        r2 = rope_copy(r1);
+        for (int i = 0; i < round % 5 + 1; ++i) {
+            int64_t length = rope_length(r2), lo = rand() % length, hi = lo + rand() % 100;
+            switch (rand() % 4) {
+            case 0:
+                next = rope_insert(r2, lo, "edit");
+                break;
+            case 1:
+                next = rope_delete(r2, lo, hi);
+                break;
+            case 2: {   // move [lo, hi) to the end
+                struct rope *piece = rope_substring(r2, lo, hi), *rest = rope_delete(r2, lo, hi);
+                next = rope_concat(rest, piece);
+                free_rope(piece, false);
+                free_rope(rest, false);
+                break;
+            }
+            default:
+                next = rope_substring(r2, lo / 2, length - lo / 2);
+            }
+            free_rope(r2, false);
+            r2 = next;
+        }
+        edits = rope_diff(r1, r2, &count);
+        ok = edits && diff_applies(r1, r2, edits, count) && count <= 2 * (round % 5 + 1);
+        free(edits);
+        free_rope(r2, false);
+    }
+    if (!ok) {
+        printf("rope_diff failed derived test\n");
+        failed++;
+    } else {
+        printf("rope_diff passed derived test\n");
+    }
+    free_rope(r1, false);
+    return failed;
+}
+
+int main_rope_stats()
+{
+    struct rope *r, *next;
+    struct rope_stats stats;
+    struct rope_stats_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_stats_tests); ++i) {
+        test = &rope_stats_tests[i];
+        r = test->setup();
+        if (!rope_stats(r, &stats) || memcmp(&stats, &test->expected, sizeof(stats))) {
+            printf("rope_stats failed test %d: got %lld nodes, %lld leaves, depth %d\n", i,
+                   (long long)stats.nodes, (long long)stats.leaves, stats.depth);
+            failed++;
+        } else {
+            printf("rope_stats passed test %d\n", i);
+        }
+        free_rope(r, false);
+    }
+
+    // a copy shares the whole tree
+    r = create_rope_height_3();
+    next = rope_copy(r);
+    bool ok = rope_stats(r, &stats) && stats.shared_nodes == 1 && stats.shared_bytes == 12 && stats.nodes == 7;
+    free_rope(next, false);
+
+    char json[512], expected_json[512], small[16];
+    rope_stats(r, &stats);
+    int len = rope_stats_json(&stats, json, sizeof(json));
+    snprintf(expected_json, sizeof(expected_json), "{\"length\":12,\"depth\":2,\"nodes\":7,\"leaves\":4,"
+             "\"tiny_leaves\":4,\"shared_nodes\":0,\"shared_bytes\":0,\"pinned_bytes\":0,\"node_bytes\":%d,"
+             "\"text_bytes\":12,\"compressed_leaves\":0,\"leaf_sizes\":[0,0,4,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0]}",
+             (int)(7*sizeof(struct rope_node)));
+    ok = ok && len == strlen(json) && rope_stats_json(&stats, small, sizeof(small)) == len
+         && rope_stats_json(&stats, NULL, 0) == len && !strncmp(json, small, sizeof(small)-1)
+         && !strcmp(json, expected_json);
+    free_rope(r, false);
+    if (!ok) {
+        printf("rope_stats failed sharing and json test: %s\n", json);
+        failed++;
+    } else {
+        printf("rope_stats passed sharing and json test\n");
+    }
+
+    // too deep for its length
+    rope_set_compaction(1.5, 0);
+    r = create_left_spine();
+    next = rope_insert(r, 8, "i");
+    ok = rope_stats(next, &stats) && stats.depth <= 4 && rope_length(next) == 9 && rope_index(next, 8) == 'i';
+    free_rope(next, false);
+    free_rope(r, false);
+
+    // too many tiny leaves, from inserting one character at a time
+    rope_set_compaction(0, 0.5);
+    char expected[1001] = "";
+    r = new_rope("");
+    srand(22);
+    for (int i = 0; i < 1000; ++i) {
+        int at = rand() % (i+1);
+        memmove(expected+at+1, expected+at, i-at+1);
+        expected[at] = 'a' + i % 26;
+        next = rope_insert(r, at, (char []){ expected[at], '\0' });
+        free_rope(r, false);
+        r = next;
+    }
+    rope_set_compaction(0, 0);
+    char *result = rope_tostring(r);
+    ok = ok && rope_stats(r, &stats) && stats.leaves < 200 && !strcmp(result, expected);
+    free(result);
+    free_rope(r, false);
+    if (!ok) {
+        printf("rope_stats failed compaction test: %lld leaves\n", (long long)stats.leaves);
+        failed++;
+    } else {
+        printf("rope_stats passed compaction test\n");
+    }
+    return failed;
+}
+
+int main_rope_compare()
+{
+    struct rope *r1, *r2;
+    struct rope_compare_test *test;
+    int64_t mismatch, swapped;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_compare_tests); ++i) {
+        test = &rope_compare_tests[i];
+        r1 = test->arg1();
+        r2 = test->arg2();
+        int result = rope_compare(r1, r2, &mismatch);
+        int sign = (result > 0) - (result < 0);
+        if (sign != test->expected || mismatch != test->mismatch
+            || -sign != (rope_compare(r2, r1, &swapped) > 0) - (rope_compare(r2, r1, NULL) < 0)
+            || swapped != mismatch) {
+            printf("rope_compare failed test %d: expected %d at %lld, got %d at %lld\n", i, test->expected,
+                   (long long)test->mismatch, sign, (long long)mismatch);
+            failed++;
+        } else {
+            printf("rope_compare passed test %d\n", i);
+        }
+        free_rope(r1, false);
+        free_rope(r2, false);
+    }
+
+    // every pair of ranges of two ropes sharing most of their nodes, against memcmp
+    r1 = create_appended_64();
+    r2 = create_appended_64_replaced();
+    char *s1 = rope_tostring(r1), *s2 = rope_tostring(r2);
+    bool ok = true;
+    for (int lo1 = 0; lo1 <= 64; lo1 += 3) {
+        for (int hi1 = lo1; hi1 <= 64; hi1 += 5) {
+            for (int lo2 = 0; lo2 <= 64; lo2 += 7) {
+                for (int hi2 = lo2; hi2 <= 64; hi2 += 4) {
+                    int len = hi1-lo1 < hi2-lo2 ? hi1-lo1 : hi2-lo2, at = 0;
+                    while (at < len && s1[lo1+at] == s2[lo2+at])
+                        at++;
+                    int expected = at < len ? (unsigned char)s1[lo1+at] - (unsigned char)s2[lo2+at]
+                                            : (hi1-lo1 > len) - (hi2-lo2 > len);
+                    int result = rope_compare_range(r1, lo1, hi1, r2, lo2, hi2, &mismatch);
+                    ok = ok && (result > 0) == (expected > 0) && (result < 0) == (expected < 0) && mismatch == at;
+                }
+            }
+        }
+    }
+    ok = ok && rope_compare_range(r1, -5, 100, r2, 0, 64, &mismatch) > 0 && mismatch == 40;
+    if (!ok) {
+        printf("rope_compare failed range test\n");
+        failed++;
+    } else {
+        printf("rope_compare passed range test\n");
+    }
+    free(s1);
+    free(s2);
+    free_rope(r1, false);
+    free_rope(r2, false);
+    return failed;
+}
+
+int main_rope_tostring()
+{
+    struct rope *r;
+    char *result, *expected;
+    struct rope_tostring_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_tostring_tests); ++i) {
+        test = &rope_tostring_tests[i];
+        expected = test->expected;
+        r = test->setup();
+        result = rope_tostring(r);
+        if (strcmp(result, expected)) {
+            printf("rope_tostring failed test %d: expected %s, got %s\n", i, expected, result);
+            failed++;
+        } else {
+            printf("rope_tostring passed test %d\n", i);
+        }
+    }
+    return failed;
+}
+
+int main_rope_substring()
+{
+    struct rope *r, *expect, *result;
+    int lo, hi;
+    struct rope_substring_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_substring_tests); ++i) {
+        test = &rope_substring_tests[i];
+        r = test->setup();
+        lo = test->lo;
+        hi = test->hi;
+        result = rope_substring(r, lo, hi);
+        expect = test->expected();
+        if (!rope_equal(result, expect)) {
+            printf("rope_substring failed test %d\n", i);
+            failed++;
+        } else {
+            printf("rope_substring passed test %d\n", i);
+        }
+    }
+    return failed;
+}
+
+int main_rope_balance()
+{
+    struct rope *r, *balanced;
+    char *result;
+    int depth;
+    struct rope_balance_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_balance_tests); ++i) {
+        test = &rope_balance_tests[i];
+        r = test->setup();
+        balanced = test->rebalance ? rope_rebalance(r) : r;
+        result = rope_tostring(balanced);
+        depth = balanced->head ? balanced->head->depth : 0;
+        if (depth > test->max_depth || strcmp(result, test->expected) || !is_rope(balanced)) {
+            printf("rope_balance failed test %d: expected %s at depth <= %d, got %s at depth %d\n",
+                   i, test->expected, test->max_depth, result, depth);
+            failed++;
+        } else {
+            printf("rope_balance passed test %d\n", i);
+        }
+        free(result);
+    }
+    return failed;
+}
+int main_rope_chunk()
+{
+    struct rope *r;
+    char *result;
+    int leaves;
+    struct rope_chunk_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_chunk_tests); ++i) {
+        test = &rope_chunk_tests[i];
+        rope_set_chunk_size(test->chunk_size);
+        r = test->setup();
+        rope_set_chunk_size(0);
+        result = rope_tostring(r);
+        leaves = count_leaves(r->head);
+        if (leaves > test->max_leaves || strcmp(result, test->expected) || !is_rope(r)) {
+            printf("rope_chunk failed test %d: expected %s in <= %d leaves, got %s in %d\n",
+                   i, test->expected, test->max_leaves, result, leaves);
+            failed++;
+        } else {
+            printf("rope_chunk passed test %d\n", i);
+        }
+        free(result);
+    }
+    return failed;
+}
+
+int main_rope_arena()
+{
+    struct rope_arena *a = new_rope_arena(256);
+    struct rope *r;
+    char *result;
+    struct rope_arena_test *test;
+    int failed = 0;
+    // run everything twice to check the arena is still usable after a reset
+    for (int i = 0; i < 2*NELEM(rope_arena_tests); ++i) {
+        test = &rope_arena_tests[i % NELEM(rope_arena_tests)];
+        r = test->setup(a);
+        result = rope_tostring(r);
+        if (strcmp(result, test->expected) || r->arena != a || !all_in_arena(r->head)) {
+            printf("rope_arena failed test %d: expected %s, got %s\n", i, test->expected, result);
+            failed++;
+        } else {
+            printf("rope_arena passed test %d\n", i);
+        }
+        free(result);
+        free_rope(r, false);    // no-op for arena ropes
+        rope_arena_reset(a);
+    }
+    // ropes from different arenas, or an arena and the heap, can't be joined
+    struct rope_arena *b = new_rope_arena(256);
+    struct rope *heap = new_rope("heap"), *in_a = new_arena_rope(a, "a"), *in_b = new_arena_rope(b, "b");
+    struct rope *pairs[][2] = { { heap, in_a }, { in_a, heap }, { in_a, in_b } };
+    for (int i = 0; i < NELEM(pairs); ++i) {
+        errno = 0;
+        if ((r = rope_concat(pairs[i][0], pairs[i][1])) != NULL || errno != EINVAL) {
+            printf("rope_arena failed mixed concat %d\n", i);
+            failed++;
+        } else {
+            printf("rope_arena passed mixed concat %d\n", i);
+        }
+    }
+    free_rope(heap, false);
+    free_rope_arena(b);
+    free_rope_arena(a);
+    return failed;
+}
+
+int main_rope_sharing()
+{
+    struct rope *r;
+    char *result;
+    struct rope_tostring_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_sharing_tests); ++i) {
+        test = &rope_sharing_tests[i];
+        r = test->setup();
+        result = r ? rope_tostring(r) : NULL;
+        if (!result || strcmp(result, test->expected) || !is_rope(r)) {
+            printf("rope_sharing failed test %d: expected %s, got %s\n", i, test->expected, result);
+            failed++;
+        } else {
+            printf("rope_sharing passed test %d\n", i);
+        }
+        free(result);
+        free_rope(r, false);
+    }
+    return failed;
+}
+
+/** Check every way of moving a cursor started at test->pos
+    @return the number of checks that failed
+*/
+int check_rope_iter(struct rope_iter_test *test, struct rope *r)
+{
+    struct rope_iter it;
+    const char *chunk;
+    char buf[128], *p;
+    int c, len, pos = test->pos;
+    int length = strlen(test->expected);
+    int failed = 0;
+    if (pos > length)
+        pos = length;
+    // forward by character
+    rope_iter_init(&it, r, test->pos);
+    for (p = buf; (c = rope_iter_next(&it)) != -1; )
+        *p++ = c;
+    *p = '\0';
+    failed += strcmp(buf, test->expected+pos) != 0 || rope_iter_pos(&it) != length;
+    // backward by character
+    rope_iter_seek(&it, test->pos);
+    for (p = buf+pos, *p = '\0'; (c = rope_iter_prev(&it)) != -1; )
+        *--p = c;
+    failed += p != buf || strncmp(buf, test->expected, pos) != 0 || rope_iter_pos(&it) != 0;
+    // forward by chunk
+    rope_iter_seek(&it, test->pos);
+    for (p = buf; (len = rope_iter_next_chunk(&it, &chunk)) > 0; p += len)
+        memcpy(p, chunk, len);
+    *p = '\0';
+    failed += strcmp(buf, test->expected+pos) != 0;
+    // backward by chunk
+    rope_iter_seek(&it, test->pos);
+    for (p = buf+pos; (len = rope_iter_prev_chunk(&it, &chunk)) > 0; )
+        memcpy(p -= len, chunk, len);
+    failed += p != buf || strncmp(buf, test->expected, pos) != 0;
+    // back and forth across the starting point
+    rope_iter_seek(&it, test->pos);
+    if ((c = rope_iter_prev(&it)) != -1)
+        failed += c != rope_iter_next(&it);
+    failed += rope_iter_pos(&it) != pos;
+    return failed;
+}
+
+int main_rope_iter()
+{
+    struct rope *r;
+    struct rope_iter_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_iter_tests); ++i) {
+        test = &rope_iter_tests[i];
+        r = test->setup();
+        if (check_rope_iter(test, r)) {
+            printf("rope_iter failed test %d\n", i);
+            failed++;
+        } else {
+            printf("rope_iter passed test %d\n", i);
+        }
+        free_rope(r, false);
+    }
+    return failed;
+}
+
+int main_rope_split()
+{
+    struct rope *r, *left, *right;
+    char *left_result, *right_result;
+    struct rope_split_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_split_tests); ++i) {
+        test = &rope_split_tests[i];
+        r = test->setup();
+        rope_split(r, test->index, &left, &right);
+        free_rope(r, false);
+        left_result = rope_tostring(left);
+        right_result = rope_tostring(right);
+        if (strcmp(left_result, test->expected_left) || strcmp(right_result, test->expected_right)
+            || !is_rope(left) || !is_rope(right)) {
+            printf("rope_split failed test %d: expected %s|%s, got %s|%s\n", i,
+                   test->expected_left, test->expected_right, left_result, right_result);
+            failed++;
+        } else {
+            printf("rope_split passed test %d\n", i);
         }
-        free_rope(expect, false);
+        free(left_result);
+        free(right_result);
+        free_rope(left, false);
+        free_rope(right, false);
+    }
+    return failed;
+}
+
+int main_rope_insert()
+{
+    struct rope *r, *res;
+    char *result;
+    struct rope_insert_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_insert_tests); ++i) {
+        test = &rope_insert_tests[i];
+        r = test->setup();
+        res = rope_insert(r, test->index, test->s);
+        free_rope(r, false);
+        result = rope_tostring(res);
+        if (strcmp(result, test->expected) || !is_rope(res)) {
+            printf("rope_insert failed test %d: expected %s, got %s\n", i, test->expected, result);
+            failed++;
+        } else {
+            printf("rope_insert passed test %d\n", i);
+        }
+        free(result);
         free_rope(res, false);
-        free(r1);
-        free(r2);
     }
     return failed;
 }
 
-int main_rope_tostring()
+int main_rope_delete()
+{
+    struct rope *r, *res;
+    char *result;
+    struct rope_delete_test *test;
+    int failed = 0;
+    for (int i = 0; i < NELEM(rope_delete_tests); ++i) {
+        test = &rope_delete_tests[i];
+        r = test->setup();
+        res = rope_delete(r, test->lo, test->hi);
+        free_rope(r, false);
+        result = rope_tostring(res);
+        if (strcmp(result, test->expected) || !is_rope(res)) {
+            printf("rope_delete failed test %d: expected %s, got %s\n", i, test->expected, result);
+            failed++;
+        } else {
+            printf("rope_delete passed test %d\n", i);
+        }
+        free(result);
+        free_rope(res, false);
+    }
+    return failed;
+}
+
+/** Apply random inserts and deletes to a rope and a flat buffer side by side
+    and check they agree and the rope stays balanced.
+*/
+int main_rope_edit_random()
+{
+    static char *words[] = { "a", "bc", "def", "ghij", "klmnopqrstuvwxyz" };
+    char flat[4096], *result;
+    struct rope *r = new_rope(""), *next;
+    int length = 0, failed = 0, depth_limit;
+    srand(42);
+    for (int i = 0; i < 2000; ++i) {
+        int pos = rand() % (length+1);
+        if (length < 2000 && rand() % 3) {
+            char *w = words[rand() % NELEM(words)];
+            int n = strlen(w);
+            memmove(flat+pos+n, flat+pos, length-pos);
+            memcpy(flat+pos, w, n);
+            length += n;
+            next = rope_insert(r, pos, w);
+        } else {
+            int hi = pos + rand() % 8;
+            hi = hi > length ? length : hi;
+            memmove(flat+pos, flat+hi, length-hi);
+            length -= hi-pos;
+            next = rope_delete(r, pos, hi);
+        }
+        free_rope(r, false);
+        r = next;
+    }
+    flat[length] = '\0';
+    result = rope_tostring(r);
+    // an AVL tree over n leaves is at most 1.44 log2(n+2) deep
+    for (depth_limit = 0; (1 << depth_limit) < length+2; ++depth_limit)
+        ;
+    depth_limit = depth_limit*3/2 + 1;
+    if (strcmp(result, flat) || !is_rope(r) || (r->head && r->head->depth > depth_limit)) {
+        printf("rope_edit_random failed: depth %d\n", r->head ? r->head->depth : 0);
+        failed++;
+    } else {
+        printf("rope_edit_random passed\n");
+    }
+    free(result);
+    free_rope(r, false);
+    return failed;
+}
+
+/** Check rope_copy_range, and that rope_iovec and rope_write produce the same text
+*/
+int main_rope_copy_range()
 {
     struct rope *r;
-    char *result, *expected;
-    struct rope_tostring_test *test;
+    struct rope_copy_range_test *test;
+    struct iovec iov[2];
+    char buf[128], *p;
+    int len, count, failed = 0;
+    FILE *f;
+    for (int i = 0; i < NELEM(rope_copy_range_tests); ++i) {
+        test = &rope_copy_range_tests[i];
+        r = test->setup();
+        bool ok = true;
+        // copy
+        len = rope_copy_range(r, test->lo, test->hi, buf);
+        buf[len] = '\0';
+        ok = ok && !strcmp(buf, test->expected);
+        // gather, two entries at a time
+        p = buf;
+        for (int lo = test->lo; (count = rope_iovec(r, lo, test->hi, iov, NELEM(iov))) > 0; ) {
+            for (int j = 0; j < count; lo += iov[j++].iov_len) {
+                memcpy(p, iov[j].iov_base, iov[j].iov_len);
+                p += iov[j].iov_len;
+            }
+        }
+        *p = '\0';
+        ok = ok && !strcmp(buf, test->expected);
+        // write the substring out to a file
+        struct rope *sub = rope_substring(r, test->lo, test->hi);
+        f = tmpfile();
+        len = rope_write(sub, fileno(f));
+        rewind(f);
+        buf[fread(buf, 1, sizeof(buf)-1, f)] = '\0';
+        fclose(f);
+        ok = ok && len == strlen(test->expected) && !strcmp(buf, test->expected);
+        if (!ok) {
+            printf("rope_copy_range failed test %d: expected %s, got %s\n", i, test->expected, buf);
+            failed++;
+        } else {
+            printf("rope_copy_range passed test %d\n", i);
+        }
+        free_rope(sub, false);
+        free_rope(r, false);
+    }
+
+    // a rope too deep to walk is refused rather than written in part
+    r = create_too_deep();
+    f = tmpfile();
+    errno = 0;
+    if (rope_write(r, fileno(f)) != -1 || errno != EINVAL || ftell(f) != 0) {
+        printf("rope_copy_range failed too-deep write test\n");
+        failed++;
+    } else {
+        printf("rope_copy_range passed too-deep write test\n");
+    }
+    fclose(f);
+    free_rope(r, false);
+    return failed;
+}
+
+/** Check rope_line_count, rope_line_to_offset and rope_offset_to_line against text
+    @return true if they all agree with it
+*/
+bool check_lines(struct rope *r, const char *text, int length)
+{
+    int line = 0;
+    bool ok = rope_line_to_offset(r, 0) == 0;
+    for (int i = 0; ok && i <= length; ++i) {
+        if (i == 0 || i == length || text[i] == '\n' || text[i-1] == '\n')    // either side of each line break
+            ok = rope_offset_to_line(r, i) == line;
+        if (i < length && text[i] == '\n')
+            ok = ok && rope_line_to_offset(r, ++line) == i+1;
+    }
+    return ok && rope_line_count(r) == line+1 && rope_line_to_offset(r, line+1) == -1;
+}
+
+/** Check the line index against the table, then against a flat buffer through
+    random edits of text with plenty of newlines
+*/
+int main_rope_builder()
+{
+    static char text[5027];
+    struct rope_builder_test *test;
+    struct rope_builder *b;
+    struct rope_arena *a;
+    struct rope *r;
+    char *flat, *str;
     int failed = 0;
-    for (int i = 0; i < NELEM(rope_tostring_tests); ++i) {
-        test = &rope_tostring_tests[i];
-        expected = test->expected;
+    for (int i = 0; i < (int)sizeof(text)-1; ++i)
+        text[i] = 'a' + i % 26;
+    for (int i = 0; i < NELEM(rope_builder_tests); ++i) {
+        test = &rope_builder_tests[i];
+        a = test->arena ? new_rope_arena(4096) : NULL;
+        b = new_rope_builder(a);
+        flat = malloc(test->pieces * test->length + 1);
+        for (int j = 0; j < test->pieces; ++j) {
+            char *piece = text + j % 26;
+            memcpy(flat + j*test->length, piece, test->length);
+            if (test->copy_every && j % test->copy_every == 0)
+                rope_builder_push_copy(b, piece, test->length);
+            else
+                rope_builder_push(b, piece, test->length);
+        }
+        flat[test->pieces * test->length] = '\0';
+        r = rope_builder_finish(b);
+        str = rope_tostring(r);
+        int depth = r->head ? r->head->depth : 0;
+        if (!is_rope(r) || !is_avl(r->head) || strcmp(str, flat) || depth > test->max_depth) {
+            printf("rope_builder failed test %d: expected depth at most %d, got %d\n", i, test->max_depth, depth);
+            failed++;
+        } else {
+            printf("rope_builder passed test %d\n", i);
+        }
+        free(str);
+        free(flat);
+        free_rope(r, false);
+        free_rope_arena(a);
+    }
+    b = new_rope_builder(NULL);
+    rope_builder_push(b, text, 10);
+    rope_builder_push_copy(b, text, 10);
+    free_rope_builder(b);
+    r = new_ropev(5, "a", "b", "c", "d", "e");
+    str = rope_tostring(r);
+    if (strcmp(str, "abcde") || r->head->depth > 3) {
+        printf("rope_builder failed new_ropev: got %s\n", str);
+        failed++;
+    } else {
+        printf("rope_builder passed new_ropev\n");
+    }
+    free(str);
+    free_rope(r, false);
+    return failed;
+}
+
+/* Counts leaves under n, and how many of them keep their text inline */
+static void count_inline(struct rope_node *n, int *leaves, int *inlined)
+{
+    if (n->left || n->right) {
+        count_inline(n->left, leaves, inlined);
+        count_inline(n->right, leaves, inlined);
+        return;
+    }
+    ++*leaves;
+    if (n->flags & ROPE_NODE_INLINE) {
+        ++*inlined;
+        if (n->data != (char *)(n+1))
+            ++*inlined;     // counted twice so the totals can't match
+    }
+}
+
+int main_rope_inline()
+{
+    char word[32], flat[4096];
+    struct rope_arena *a = new_rope_arena(0);
+    struct rope *ropes[2] = { new_rope(""), new_arena_rope(a, "") }, *next, *sub;
+    int failed = 0;
+    srand(5);
+    for (int k = 0; k < 2; ++k) {
+        struct rope *r = ropes[k];
+        int length = 0, leaves = 0, inlined = 0;
+        flat[0] = '\0';
+        for (int i = 0; i < 300; ++i) {
+            int pos = rand() % (length+1), n = 1 + rand() % 23;
+            for (int j = 0; j < n; ++j)
+                word[j] = 'a' + rand() % 26;
+            word[n] = '\0';
+            memmove(flat+pos+n, flat+pos, length-pos+1);
+            memcpy(flat+pos, word, n);
+            length += n;
+            next = rope_insert(r, pos, word);
+            if (!k)
+                free_rope(r, false);
+            r = next;
+            memset(word, '#', sizeof(word));    // the rope must not point into word
+            if (length > 3000) {
+                next = rope_delete(r, 100, 1100);
+                if (!k)
+                    free_rope(r, false);
+                r = next;
+                memmove(flat+100, flat+1100, length-1100+1);
+                length -= 1000;
+            }
+        }
+        count_inline(r->head, &leaves, &inlined);
+        char *str = rope_tostring(r);
+        bool ok = !strcmp(str, flat) && inlined == leaves;
+        for (int i = 0; ok && i < length; i += 7)
+            ok = rope_index(r, i) == flat[i];
+        sub = rope_substring(r, 3, length-3);
+        flat[length-3] = '\0';
+        next = new_rope(flat+3);
+        ok = ok && sub && rope_equal(sub, next);
+        free_rope(next, false);
+        free_rope(sub, false);
+        if (!ok) {
+            printf("rope_inline failed test %d: %d of %d leaves inline\n", k, inlined, leaves);
+            failed++;
+        } else {
+            printf("rope_inline passed test %d\n", k);
+        }
+        free(str);
+        if (!k)
+            free_rope(r, false);
+    }
+    free_rope_arena(a);
+    return failed;
+}
+
+/* A thread in main_rope_slice's threaded test, reading a slice no one has built a tree for yet */
+struct slice_reader {
+    struct rope *slice;
+    atomic_int *ready;
+    int64_t newlines;
+};
+
+static void *slice_read(void *arg)
+{
+    struct slice_reader *sr = (struct slice_reader *)arg;
+    atomic_fetch_add(sr->ready, 1);
+    while (atomic_load(sr->ready) < 4)  // start together, so the threads race to build the tree
+        ;
+    struct rope_iter it;
+    const char *chunk;
+    int64_t len;
+    rope_iter_init(&it, sr->slice, 0);
+    while ((len = rope_iter_next_chunk(&it, &chunk)) > 0) {
+        for (int64_t i = 0; i < len; ++i)
+            sr->newlines += chunk[i] == '\n';
+    }
+    return NULL;
+}
+
+int main_rope_slice()
+{
+    static char text[128*1024+1];
+    struct rope_builder *b = new_rope_builder(NULL);
+    struct rope *r, *win, *next, *flat;
+    int failed = 0;
+    for (int i = 0; i < (int)sizeof(text)-1; ++i)
+        text[i] = i % 61 ? 'a' + i % 26 : '\n';
+    for (int i = 0; i < (int)sizeof(text)-1; i += 100)
+        rope_builder_push(b, text+i, sizeof(text)-1-i < 100 ? sizeof(text)-1-i : 100);
+    r = rope_builder_finish(b);
+    srand(3);
+    for (int i = 0; i < 20; ++i) {
+        int64_t lo = rand() % 1000, hi = rope_length(r) - rand() % 1000;
+        win = rope_substring(r, lo, hi);
+        bool ok = true;
+        for (int j = 0; ok && j < 5; ++j) {     // windows of windows stay one node over r's tree
+            int64_t len = hi-lo, l = rand() % (len/8), h = len - rand() % (len/8);
+            next = rope_substring(win, l, h);
+            free_rope(win, false);
+            win = next;
+            lo += l;
+            hi = lo + (h-l);
+            ok = win->head->flags & ROPE_NODE_SLICE && win->head->left == r->head && is_rope(win);
+        }
+        char *str = rope_tostring(win);
+        ok = ok && rope_length(win) == hi-lo && !memcmp(str, text+lo, hi-lo) && !str[hi-lo];
+        for (int j = 0; ok && j < 50; ++j) {
+            int64_t k = rand() % (hi-lo);
+            ok = rope_index(win, k) == text[lo+k];
+        }
+        ok = ok && rope_index(win, -1) == -1 && rope_index(win, hi-lo) == -1;
+        flat = new_rope(str);
+        ok = ok && rope_equal(win, flat) && rope_hash(win) == rope_hash(flat)
+                && rope_line_count(win) == rope_line_count(flat)
+                && rope_find(win, "\nab", 0) == rope_find(flat, "\nab", 0);
+        ok = ok && win->head->flags & ROPE_NODE_SLICE && win->head->right && is_rope(win);  // searching built its tree
+        next = rope_insert(win, 10, "xyz");
+        ok = ok && rope_index(next, 10) == 'x' && rope_index(next, 13) == text[lo+10];
+        free_rope(next, false);
+        free_rope(flat, false);
+        free(str);
+        free_rope(win, false);
+        if (!ok) {
+            printf("rope_slice failed test %d: [%d, %d)\n", i, (int)lo, (int)hi);
+            failed++;
+        } else {
+            printf("rope_slice passed test %d\n", i);
+        }
+    }
+    win = rope_substring(r, 100, 101);      // too small a part of r to pin all of it
+    if (win->head->flags & ROPE_NODE_SLICE || rope_index(win, 0) != text[100]) {
+        printf("rope_slice failed small window\n");
+        failed++;
+    } else {
+        printf("rope_slice passed small window\n");
+    }
+    free_rope(win, false);
+
+    // threads reading a fresh slice at once all see the same tree
+    struct slice_reader readers[4];
+    pthread_t threads[4];
+    char *str;
+    bool ok = true;
+    for (int round = 0; ok && round < 50; ++round) {
+        atomic_int ready = 0;
+        win = rope_substring(r, 500, rope_length(r) - 500);
+        for (int i = 0; i < 4; ++i) {
+            readers[i] = (struct slice_reader){ .slice = win, .ready = &ready };
+            pthread_create(&threads[i], NULL, slice_read, &readers[i]);
+        }
+        for (int i = 0; i < 4; ++i)
+            pthread_join(threads[i], NULL);
+        str = rope_tostring(win);
+        flat = new_rope(str);
+        for (int i = 0; i < 4; ++i)
+            ok = ok && readers[i].newlines + 1 == rope_line_count(flat);
+        ok = ok && win->head->flags & ROPE_NODE_SLICE && win->head->right && is_rope(win);
+        free_rope(flat, false);
+        free(str);
+        free_rope(win, false);
+    }
+    if (!ok) {
+        printf("rope_slice failed threaded test\n");
+        failed++;
+    } else {
+        printf("rope_slice passed threaded test\n");
+    }
+    free_rope(r, false);
+    return failed;
+}
+
+/* What a reader thread in main_rope_handle checks snapshots with */
+struct handle_reader {
+    struct rope_handle *handle;
+    atomic_bool *stop;
+    int snapshots;
+    int bad;
+};
+
+/* The writer only ever swaps "ab" pairs in and out, so every version is (ab)* */
+static void *handle_read(void *arg)
+{
+    struct handle_reader *hr = (struct handle_reader *)arg;
+    struct rope_reader *rd = rope_handle_reader(hr->handle);
+    while (!atomic_load(hr->stop) || !hr->snapshots) {
+        struct rope *r = rope_read_begin(rd);
+        int64_t length = rope_length(r);
+        char *str = rope_tostring(r);
+        struct rope *flat = new_rope(str);
+        bool ok = length % 2 == 0 && rope_find(r, "aa", 0) == -1 && rope_find(r, "bb", 0) == -1
+                  && (!length || (rope_index(r, 0) == 'a' && rope_index(r, length-1) == 'b'))
+                  && rope_hash(r) == rope_hash(flat) && rope_equal(r, flat);
+        rope_read_end(rd);
+        hr->bad += !ok;
+        hr->snapshots++;
+        free_rope(flat, false);
+        free(str);
+    }
+    free_rope_reader(rd);
+    return NULL;
+}
+
+int main_rope_handle()
+{
+    static char text[] = "abababababababab";
+    struct rope_builder *b = new_rope_builder(NULL);
+    struct handle_reader readers[4];
+    pthread_t threads[4];
+    atomic_bool stop = false;
+    struct rope *r, *first, *next;
+    int failed = 0;
+    for (int i = 0; i < 256; ++i)
+        rope_builder_push(b, text, 16);
+    first = rope_builder_finish(b);
+    struct rope_handle *h = new_rope_handle(rope_copy(first));
+
+    // one reader on its own: its snapshot outlives the versions published after it
+    struct rope_reader *rd = rope_handle_reader(h);
+    r = rope_read_begin(rd);
+    for (int i = 0; i < 10; ++i)
+        rope_handle_publish(h, rope_insert(rope_handle_get(h), 0, "ab"));
+    bool ok = rope_equal(r, first) && rope_length(rope_handle_get(h)) == rope_length(first) + 20;
+    rope_read_end(rd);
+    r = rope_read_begin(rd);
+    ok = ok && r == rope_handle_get(h);
+    rope_read_end(rd);
+    free_rope_reader(rd);
+    if (!ok) {
+        printf("rope_handle failed snapshot test\n");
+        failed++;
+    } else {
+        printf("rope_handle passed snapshot test\n");
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        readers[i] = (struct handle_reader){ .handle = h, .stop = &stop };
+        pthread_create(&threads[i], NULL, handle_read, &readers[i]);
+    }
+    srand(17);
+    for (int i = 0; i < 2000; ++i) {
+        r = rope_handle_get(h);
+        int64_t pos = 2 * (rand() % (rope_length(r)/2));
+        if (i % 2)
+            next = rope_insert(r, pos, "ab");
+        else
+            next = rope_delete(r, pos, pos+2);
+        rope_handle_publish(h, next);
+    }
+    atomic_store(&stop, true);
+    int bad = 0;
+    for (int i = 0; i < 4; ++i) {
+        pthread_join(threads[i], NULL);
+        bad += readers[i].bad;
+    }
+    if (bad || rope_length(rope_handle_get(h)) != rope_length(first) + 20) {
+        printf("rope_handle failed concurrent test: %d bad snapshots\n", bad);
+        failed++;
+    } else {
+        printf("rope_handle passed concurrent test\n");
+    }
+    free_rope_handle(h);
+    free_rope(first, false);
+    return failed;
+}
+
+/* Checks that no leaf under n starts partway through a UTF-8 sequence */
+static bool leaves_start_codepoints(struct rope_node *n)
+{
+    if (n->left || n->right)
+        return leaves_start_codepoints(n->left) && leaves_start_codepoints(n->right);
+    return (n->data[0] & 0xC0) != 0x80;
+}
+
+int main_rope_cp()
+{
+    // a mix of 1 to 4 byte sequences, then malformed ones: a stray continuation,
+    // which is part of the code point before it, a truncated sequence, an
+    // overlong '/' and a surrogate
+    static char text[] = "a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80z\xe6\x97\xa5\xe6\x9c\xac"
+                         "\x80q\xe2\x82x\xc0\xaf\xed\xa0\x80!";
+    static int32_t expected[] = { 'a', 0xe9, 0x20ac, 0x1f600, 'z', 0x65e5, 0x672c,
+                                  'q', 0xfffd, 'x', 0xfffd, 0xfffd, '!' };
+    static int64_t offsets[] = { 0, 1, 3, 6, 10, 11, 14, 18, 19, 21, 22, 24, 27, 28 };
+    int length = strlen(text), failed = 0;
+    for (int split = 1; split <= length; ++split) {   // leaves of split bytes, cutting sequences apart
+        struct rope *r = new_rope(""), *piece, *next;
+        for (int i = 0; i < length; i += split) {
+            piece = new_rope(strndup(text+i, split));
+            next = rope_concat(r, piece);
+            free_rope(r, false);
+            free_rope(piece, false);
+            r = next;
+        }
+        bool ok = rope_cp_length(r) == NELEM(expected) && rope_cp_to_offset(r, -1) == -1
+                  && rope_cp_to_offset(r, NELEM(expected)+1) == -1 && rope_index_cp(r, NELEM(expected)) == -1;
+        for (int cp = 0; ok && cp <= NELEM(expected); ++cp)
+            ok = rope_cp_to_offset(r, cp) == offsets[cp] && rope_offset_to_cp(r, offsets[cp]) == cp
+                 && (cp == NELEM(expected) || rope_index_cp(r, cp) == expected[cp]);
+        for (int i = 0; ok && i <= length; ++i) {       // offsets inside a sequence belong to it
+            int cp = 0;
+            while (cp < NELEM(expected) && offsets[cp+1] <= i)
+                ++cp;
+            ok = rope_offset_to_cp(r, i) == cp + (i > offsets[cp]);
+        }
+        struct rope *sub = rope_substring_cp(r, 2, 7);
+        char *str = rope_tostring(sub);
+        ok = ok && !strcmp(str, "\xe2\x82\xac\xf0\x9f\x98\x80z\xe6\x97\xa5\xe6\x9c\xac\x80")
+                && rope_cp_length(sub) == 5;
+        free(str);
+        free_rope(sub, false);
+        free_rope(r, true);
+        if (!ok) {
+            printf("rope_cp failed test %d\n", split);
+            failed++;
+        } else {
+            printf("rope_cp passed test %d\n", split);
+        }
+    }
+
+    struct rope_builder *b = new_rope_builder(NULL);
+    for (int i = 0; i < 5000; ++i) {    // 3 byte sequences pushed in two parts, which never line up with the chunks
+        rope_builder_push_copy(b, "\xe6", 1);
+        rope_builder_push_copy(b, "\x97\xa5", 2);
+    }
+    struct rope *r = rope_builder_finish(b);
+    if (!leaves_start_codepoints(r->head) || rope_cp_length(r) != 5000 || rope_index_cp(r, 4321) != 0x65e5) {
+        printf("rope_cp failed builder test\n");
+        failed++;
+    } else {
+        printf("rope_cp passed builder test\n");
+    }
+    free_rope(r, false);
+    return failed;
+}
+
+int main_rope_lines()
+{
+    static char *words[] = { "\n", "a\n", "\n\nb", "cd", "e\nf\ng\nh", "ijklmnopqrstuvwxyz\n" };
+    char flat[4096];
+    struct rope *r, *next;
+    struct rope_lines_test *test;
+    int length = 0, failed = 0;
+    for (int i = 0; i < NELEM(rope_lines_tests); ++i) {
+        test = &rope_lines_tests[i];
         r = test->setup();
-        result = rope_tostring(r);
-        if (strcmp(result, expected)) {
-            printf("rope_tostring failed test %d: expected %s, got %s\n", i, expected, result);
+        bool ok = rope_line_count(r) == test->count && rope_line_to_offset(r, test->count) == -1;
+        for (int j = 0; ok && j < test->count; ++j)
+            ok = rope_line_to_offset(r, j) == test->starts[j] && rope_offset_to_line(r, test->starts[j]) == j;
+        if (!ok) {
+            printf("rope_lines failed test %d: expected %d lines, got %d\n", i, test->count, (int)rope_line_count(r));
             failed++;
         } else {
-            printf("rope_tostring passed test %d\n", i);
+            printf("rope_lines passed test %d\n", i);
         }
+        free_rope(r, false);
+    }
+    r = new_rope("");
+    srand(11);
+    bool ok = true;
+    for (int i = 0; ok && i < 1000; ++i) {
+        int pos = rand() % (length+1);
+        if (length < 2000 && rand() % 3) {
+            char *w = words[rand() % NELEM(words)];
+            int n = strlen(w);
+            memmove(flat+pos+n, flat+pos, length-pos);
+            memcpy(flat+pos, w, n);
+            length += n;
+            next = rope_insert(r, pos, w);
+        } else {
+            int hi = pos + rand() % 8;
+            hi = hi > length ? length : hi;
+            memmove(flat+pos, flat+hi, length-hi);
+            length -= hi-pos;
+            next = rope_delete(r, pos, hi);
+        }
+        free_rope(r, false);
+        r = next;
+        if (i % 50 == 0)
+            ok = check_lines(r, flat, length);
+    }
+    if (!ok || !check_lines(r, flat, length)) {
+        printf("rope_lines failed after edits\n");
+        failed++;
+    } else {
+        printf("rope_lines passed after edits\n");
     }
+    free_rope(r, false);
     return failed;
 }
 
-int main_rope_substring()
+/** Check rope_find and rope_find_all against the table, and both against strstr
+    on a long rope of short leaves.
+*/
+int main_rope_find()
 {
-    struct rope *r, *expect, *result;
-    int lo, hi;
-    struct rope_substring_test *test;
+    struct rope *r, *piece, *next;
+    struct rope_find_test *test;
+    int64_t offsets[8];
+    int count, failed = 0;
+    for (int i = 0; i < NELEM(rope_find_tests); ++i) {
+        test = &rope_find_tests[i];
+        r = test->setup();
+        count = rope_find_all(r, test->needle, test->from, offsets, NELEM(offsets));
+        bool ok = count == test->count
+                  && rope_find(r, test->needle, test->from) == (count ? test->expected[0] : -1);
+        for (int j = 0; ok && j < count; ++j)
+            ok = offsets[j] == test->expected[j];
+        if (!ok) {
+            printf("rope_find failed test %d: expected %d matches, got %d\n", i, test->count, count);
+            failed++;
+        } else {
+            printf("rope_find passed test %d\n", i);
+        }
+        free_rope(r, false);
+    }
+    // random leaves over a two letter alphabet, so there are many near misses;
+    // mostly short ones that get batched, some long enough to be searched in place
+    static char text[16384];
+    static char *needles[] = { "a", "ab", "abba", "bbbab", "abaabbbaabaab", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab" };
+    int length = 0, expected, pos;
+    r = new_rope("");
+    srand(7);
+    while (length < sizeof(text) - 1000) {
+        int n = rand() % 8 ? 1 + rand() % 37 : 256 + rand() % 400;
+        for (int j = 0; j < n; ++j)
+            text[length+j] = rand() % 4 ? 'a' : 'b';
+        piece = new_rope(text+length);
+        next = rope_concat(r, piece);
+        free_rope(piece, false);
+        free_rope(r, false);
+        r = next;
+        length += n;
+    }
+    for (int i = 0; i < NELEM(needles); ++i) {
+        bool ok = true;
+        for (pos = 0; ok; pos = expected+1) {
+            char *match = strstr(text+pos, needles[i]);
+            expected = match ? match - text : -1;
+            ok = rope_find(r, needles[i], pos) == expected;
+            if (expected < 0)
+                break;
+        }
+        if (!ok) {
+            printf("rope_find failed random needle %s at %d\n", needles[i], pos);
+            failed++;
+        } else {
+            printf("rope_find passed random needle %d\n", i);
+        }
+    }
+    free_rope(r, false);
+    return failed;
+}
+
+#define LARGE_LEAF (1 << 20)
+#define GIB (INT64_C(1) << 30)
+
+/** Check offsets past 4 GiB on an 8 GiB rope made by doubling one 1 MiB leaf
+    Only the leaf's text is allocated; every other node is shared.
+*/
+int main_rope_large()
+{
+    char *text = (char *)malloc(LARGE_LEAF+1), buf[32];
+    struct rope *r = new_rope(""), *next, *left, *right, *other;
     int failed = 0;
-    for (int i = 0; i < NELEM(rope_substring_tests); ++i) {
-        test = &rope_substring_tests[i];
+    bool ok = true;
+    for (int i = 0; i < LARGE_LEAF; ++i)
+        text[i] = i % 1000 == 999 ? '\n' : 'a' + i % 26;
+    memcpy(text+500000, "needle!", 7);
+    text[LARGE_LEAF] = '\0';
+    struct rope *leaf = new_rope(text);
+    r = rope_copy(leaf);
+    for (int i = 0; i < 13; ++i) {
+        next = rope_concat(r, r);
+        free_rope(r, false);
+        r = next;
+    }
+    int64_t length = rope_length(r), pos = 5*GIB + 12345;
+    ok = ok && length == 8*GIB && rope_index(r, pos) == text[pos % LARGE_LEAF];
+    // a substring straddling 4 GiB
+    next = rope_substring(r, 4*GIB - 10, 4*GIB + 10);
+    ok = ok && rope_length(next) == 20 && rope_copy_range(next, 0, 20, buf) == 20
+         && !memcmp(buf, text + LARGE_LEAF-10, 10) && !memcmp(buf+10, text, 10);
+    free_rope(next, false);
+    // edits past 4 GiB
+    rope_split(r, 4*GIB + 3, &left, &right);
+    ok = ok && rope_length(left) == 4*GIB + 3 && rope_length(right) == 4*GIB - 3;
+    other = rope_concat(left, right);
+    ok = ok && rope_equal(r, other) && rope_hash(r) == rope_hash(other);
+    free_rope(left, false);
+    free_rope(right, false);
+    free_rope(other, false);
+    next = rope_insert(r, 6*GIB, "xyz");
+    ok = ok && rope_length(next) == 8*GIB + 3 && rope_index(next, 6*GIB + 2) == 'z'
+         && rope_index(next, 6*GIB + 3) == text[0] && !rope_equal(r, next);
+    free_rope(next, false);
+    next = rope_delete(r, GIB, 5*GIB);
+    ok = ok && rope_length(next) == 4*GIB && rope_index(next, GIB) == text[0];
+    free_rope(next, false);
+    // search, lines and cursors
+    ok = ok && rope_find(r, "needle!", 4*GIB + 500001) == 4*GIB + LARGE_LEAF + 500000;
+    ok = ok && rope_line_count(r) == 8*GIB/LARGE_LEAF * (LARGE_LEAF/1000) + 1
+         && rope_offset_to_line(r, 8*GIB) == rope_line_count(r) - 1
+         && rope_line_to_offset(r, rope_line_count(r) - 1) == 8*GIB - LARGE_LEAF % 1000;
+    struct rope_iter it;
+    const char *chunk;
+    ok = ok && rope_iter_init(&it, r, 7*GIB + 1) && rope_iter_next_chunk(&it, &chunk) == LARGE_LEAF-1
+         && chunk == text+1 && rope_iter_pos(&it) == 7*GIB + LARGE_LEAF;
+    if (!ok) {
+        printf("rope_large failed\n");
+        failed++;
+    } else {
+        printf("rope_large passed\n");
+    }
+    free_rope(r, false);
+    free_rope(leaf, false);
+    free(text);
+    return failed;
+}
+
+/* What main_rope_parallel folds a rope into; first and last make the order matter */
+struct parallel_acc {
+    int64_t length;
+    int64_t newlines;
+    int first;
+    int last;
+};
+
+void parallel_leaf(void *acc, const char *data, int64_t len)
+{
+    struct parallel_acc *a = (struct parallel_acc *)acc;
+    for (int64_t i = 0; i < len; ++i)
+        a->newlines += data[i] == '\n';
+    if (len && !a->length)
+        a->first = data[0];
+    if (len)
+        a->last = data[len-1];
+    a->length += len;
+}
+
+void parallel_merge(void *acc, const void *from)
+{
+    struct parallel_acc *a = (struct parallel_acc *)acc;
+    const struct parallel_acc *f = (const struct parallel_acc *)from;
+    if (!a->length)
+        a->first = f->first;
+    if (f->length)
+        a->last = f->last;
+    a->length += f->length;
+    a->newlines += f->newlines;
+}
+
+/** Check rope_tostring_parallel and rope_reduce against rope_tostring, with no
+    pool, an empty pool and a pool of threads
+*/
+int main_rope_parallel()
+{
+    static char text[100001];
+    struct rope *r, *next, *small = create_rope_height_3();
+    struct rope_pool *pools[] = { NULL, new_rope_pool(0), new_rope_pool(3) };
+    int failed = 0;
+    for (int i = 0; i < sizeof(text)-1; ++i)
+        text[i] = i % 61 == 60 ? '\n' : 'A' + i % 50;
+    // about 3 MB in uneven leaves
+    r = new_rope(text);
+    for (int i = 0; i < 5; ++i) {
+        next = rope_concat(r, r);
+        free_rope(r, false);
+        r = rope_insert(next, rope_length(next)/3 + i, "(inserted)");
+        free_rope(next, false);
+    }
+    char *expected = rope_tostring(r);
+    for (int i = 0; i < NELEM(pools); ++i) {
+        char *result = rope_tostring_parallel(r, pools[i]), *small_result = rope_tostring_parallel(small, pools[i]);
+        struct parallel_acc acc = { 0 }, want = { 0 };
+        parallel_leaf(&want, expected, strlen(expected));
+        bool ok = rope_reduce(r, pools[i], parallel_leaf, parallel_merge, &acc, sizeof(acc));
+        ok = ok && !strcmp(result, expected) && !strcmp(small_result, "abcdefghijkl")
+             && acc.length == want.length && acc.newlines == want.newlines
+             && acc.first == want.first && acc.last == want.last;
+        if (!ok) {
+            printf("rope_parallel failed test %d\n", i);
+            failed++;
+        } else {
+            printf("rope_parallel passed test %d\n", i);
+        }
+        free(result);
+        free(small_result);
+        free_rope_pool(pools[i]);
+    }
+    free(expected);
+    free_rope(small, false);
+    free_rope(r, false);
+    return failed;
+}
+
+/** Byte i of the files written by main_rope_from_file, NULs included
+*/
+char file_byte(int i)
+{
+    return (char)(i % 251);
+}
+
+int main_rope_save()
+{
+    struct rope *r, *loaded, *edited;
+    struct rope_save_test *test;
+    char path[] = "/tmp/rope_testXXXXXX";
+    int fd, failed = 0;
+    for (int i = 0; i < NELEM(rope_save_tests); ++i) {
+        test = &rope_save_tests[i];
         r = test->setup();
-        lo = test->lo;
-        hi = test->hi;
-        result = rope_substring(r, lo, hi);
-        expect = test->expected();
-        if (!rope_equal(result, expect)) {
-            printf("rope_substring failed test %d\n", i);
+        strcpy(path, "/tmp/rope_testXXXXXX");
+        fd = mkstemp(path);
+        bool ok = rope_save(r, fd, test->checksum);
+        off_t size = lseek(fd, 0, SEEK_END);
+        for (int j = 0; j < 2; ++j) {
+            off_t at = j ? size - test->damage_end : test->damage;
+            char c;
+            if (j ? !test->damage_end : test->damage < 0)
+                continue;
+            ok = ok && pread(fd, &c, 1, at) == 1;
+            c ^= 0x20;
+            ok = ok && pwrite(fd, &c, 1, at) == 1;
+        }
+        ok = ok && ftruncate(fd, size - test->truncate) == 0;
+        close(fd);
+        loaded = rope_load(path);
+        unlink(path);
+        if (!test->loads) {
+            ok = ok && !loaded;
+        } else {
+            ok = ok && loaded && is_rope(loaded) && rope_equal(loaded, r) && rope_hash(loaded) == rope_hash(r)
+                 && rope_line_count(loaded) == rope_line_count(r) && rope_cp_length(loaded) == rope_cp_length(r);
+            int at = rope_length(r) ? 1 : 0;
+            edited = loaded ? rope_insert(loaded, at, "inserted") : NULL;
+            free_rope(loaded, false);   // edited keeps what it shares mapped
+            loaded = NULL;
+            ok = ok && rope_length(edited) == rope_length(r) + 8 && rope_index(edited, at) == 'i'
+                 && (!rope_length(r) || rope_index(edited, 0) == rope_index(r, 0));
+            free_rope(edited, false);
+        }
+        if (!ok) {
+            printf("rope_save failed test %d\n", i);
             failed++;
         } else {
-            printf("rope_substring passed test %d\n", i);
+            printf("rope_save passed test %d\n", i);
+        }
+        free_rope(loaded, false);
+        free_rope(r, false);
+    }
+
+    // a rope that repeats one big leaf is saved with one copy of its text
+    char *text = malloc(100001);
+    memset(text, 'x', 100000);
+    text[100000] = '\0';
+    r = new_rope(text);
+    for (int i = 0; i < 10; ++i) {
+        edited = rope_concat(r, r);
+        free_rope(r, false);
+        r = edited;
+    }
+    strcpy(path, "/tmp/rope_testXXXXXX");
+    fd = mkstemp(path);
+    bool ok = rope_save(r, fd, false) && lseek(fd, 0, SEEK_END) < 101000;
+    close(fd);
+    loaded = rope_load(path);
+    unlink(path);
+    ok = ok && loaded && rope_length(loaded) == 1024*100000LL && rope_equal(loaded, r);
+    if (!ok) {
+        printf("rope_save failed shared test\n");
+        failed++;
+    } else {
+        printf("rope_save passed shared test\n");
+    }
+    free_rope(loaded, false);
+    free_rope(r, false);
+    free(text);
+    return failed;
+}
+
+int main_rope_from_file()
+{
+    struct rope *r, *sub;
+    struct rope_from_file_test *test;
+    char path[] = "/tmp/rope_testXXXXXX", *buf;
+    int fd, failed = 0;
+    for (int i = 0; i < NELEM(rope_from_file_tests); ++i) {
+        test = &rope_from_file_tests[i];
+        bool ok = true;
+        if (test->length < 0) {
+            r = rope_from_file("/nonexistent/rope_test");
+            ok = r == NULL;
+        } else {
+            buf = (char *)malloc(test->length+1);
+            for (int j = 0; j < test->length; ++j)
+                buf[j] = file_byte(j);
+            strcpy(path, "/tmp/rope_testXXXXXX");
+            fd = mkstemp(path);
+            ok = write(fd, buf, test->length) == test->length;
+            close(fd);
+            r = rope_from_file(path);
+            unlink(path);   // the mapping outlives the name
+            ok = ok && r && rope_length(r) == test->length && is_rope(r)
+                 && rope_copy_range(r, 0, test->length, buf) == test->length;
+            for (int j = 0; ok && j < test->length; ++j)
+                ok = buf[j] == file_byte(j);
+            ok = ok && check_lines(r, buf, test->length);
+            sub = rope_substring(r, test->lo, test->hi);
+            free_rope(r, false);    // sub keeps the file mapped
+            r = NULL;
+            ok = ok && rope_length(sub) == test->hi - test->lo;
+            for (int j = test->lo; ok && j < test->hi; ++j)
+                ok = rope_index(sub, j - test->lo) == file_byte(j);
+            free_rope(sub, false);
+            free(buf);
+        }
+        if (!ok) {
+            printf("rope_from_file failed test %d\n", i);
+            failed++;
+        } else {
+            printf("rope_from_file passed test %d\n", i);
         }
+        free_rope(r, false);
     }
     return failed;
 }
 
+int main_rope_compress()
+{
+    static const int64_t pieces[] = { 50000, 3000, 100, 30000, 20, 70000 };
+    struct rope_builder *b = new_rope_builder(NULL);
+    struct rope *r, *c, *edited, *next;
+    struct rope_stats stats;
+    struct rope_iter it;
+    struct rope_edit *edits;
+    const char *chunk;
+    int64_t length = 0, at = 0, count, len, offsets[1000];
+    char *text = malloc(200000), *flat, out[1000], path[] = "/tmp/rope_testXXXXXX";
+    int failed = 0;
+    while (length < 170000)     // log lines, which compress well
+        length += sprintf(text + length, "2026-10-18 12:%02d:%02d INFO request %d served in %d ms\n",
+                          (int)(length/60 % 60), (int)(length % 60), (int)(length/50), (int)(length % 97));
+    for (int i = 0; i < NELEM(pieces); ++i) {
+        int64_t n = i == NELEM(pieces)-1 ? length - at : pieces[i];
+        rope_builder_push(b, text + at, n);
+        at += n;
+    }
+    r = rope_builder_finish(b);
+    c = rope_compress(r, 1024);
+    bool ok = c && is_rope(c) && rope_length(c) == length && rope_equal(c, r) && rope_hash(c) == rope_hash(r)
+              && rope_compare(c, r, NULL) == 0 && rope_stats(c, &stats) && stats.compressed_leaves > 4
+              && stats.text_bytes * 3 < length && rope_cp_length(c) == length && check_lines(c, text, length);
+    flat = rope_tostring(c);
+    ok = ok && flat && !strcmp(flat, text);
+    free(flat);
+
+    // reads all over the rope, more leaves than the cache holds
+    srand(25);
+    for (int i = 0; i < NELEM(offsets); ++i)
+        offsets[i] = rand() % length;
+    ok = ok && rope_index_batch(c, offsets, NELEM(offsets), out);
+    for (int i = 0; ok && i < NELEM(offsets); ++i)
+        ok = rope_index(c, offsets[i]) == text[offsets[i]] && out[i] == text[offsets[i]];
+    ok = ok && rope_find(c, "request 3000 ", 0) == strstr(text, "request 3000 ") - text;
+    ok = ok && rope_iter_init(&it, c, 0);
+    for (at = 0; ok && (len = rope_iter_next_chunk(&it, &chunk)) > 0; at += len)
+        ok = !memcmp(chunk, text + at, len);
+    ok = ok && at == length;
+    for (; ok && at > length - 100000; )
+        ok = rope_iter_prev(&it) == (unsigned char)text[--at];
+    edited = ok ? rope_compress(c, 1024) : NULL;   // already compressed, so all shared
+    ok = ok && edited && edited->head == c->head;
+    free_rope(edited, false);
+
+    // rope_write points into the cache only a few leaves at a time
+    int fd = mkstemp(path);
+    flat = malloc(length);
+    ok = ok && rope_write(c, fd) == length && pread(fd, flat, length, 0) == length && !memcmp(flat, text, length);
+    close(fd);
+    unlink(path);
+    free(flat);
+
+    // edits copy out only the text they cut, and diff against the original
+    edited = rope_copy(c);
+    for (int i = 0; ok && i < 20; ++i) {
+        int64_t lo = rand() % rope_length(edited), hi = lo + rand() % 5000;
+        next = i % 3 == 0 ? rope_insert(edited, lo, "edited") : i % 3 == 1 ? rope_delete(edited, lo, hi)
+                                                                           : rope_substring(edited, lo / 8, rope_length(edited) - lo / 8);
+        free_rope(edited, false);
+        edited = next;
+        ok = edited && is_rope(edited);
+    }
+    edits = ok ? rope_diff(c, edited, &count) : NULL;
+    ok = ok && edits && diff_applies(c, edited, edits, count) && diff_applies(r, edited, edits, count);
+    free(edits);
+    free_rope(edited, false);
+    if (!ok) {
+        printf("rope_compress failed test 0\n");
+        failed++;
+    } else {
+        printf("rope_compress passed test 0\n");
+    }
+    free_rope(c, false);
+    free_rope(r, false);
+
+    // text that doesn't compress is shared as it is
+    for (int i = 0; i < 100000; ++i)
+        text[i] = 'a' + rand() % 26;
+    text[100000] = '\0';
+    r = new_rope(text);
+    c = rope_compress(r, 0);
+    ok = c && c->head == r->head && rope_stats(c, &stats) && stats.compressed_leaves == 0;
+    if (!ok) {
+        printf("rope_compress failed test 1\n");
+        failed++;
+    } else {
+        printf("rope_compress passed test 1\n");
+    }
+    free_rope(c, false);
+    free_rope(r, false);
+
+    // is_rope rejects a compressed leaf whose text doesn't unpack
+    memset(text, 'a', 10000);
+    text[10000] = '\0';
+    r = new_rope(text);
+    c = rope_compress(r, 0);
+    ok = c && c->head->flags & ROPE_NODE_COMPRESSED;
+    if (ok) {
+        int64_t packed;
+        memcpy(&packed, c->head->data, sizeof(packed));
+        packed = 2;     // cut off after the first literal, so it unpacks short
+        memcpy(c->head->data, &packed, sizeof(packed));
+        ok = !is_rope(c);
+    }
+    if (!ok) {
+        printf("rope_compress failed test 2\n");
+        failed++;
+    } else {
+        printf("rope_compress passed test 2\n");
+    }
+    free_rope(c, false);
+    free_rope(r, false);
+    free(text);
+    return failed;
+}
 
 /** Main method for running our test suite
     this will call main_*func name* for each function
@@ -580,8 +3189,35 @@ int main()
     int failed = 0;
     failed += main_is_rope();
     failed += main_rope_index();
+    failed += main_rope_index_batch();
     failed += main_rope_concat();
+    failed += main_rope_equal();
+    failed += main_rope_compare();
+    failed += main_rope_diff();
+    failed += main_rope_stats();
+    failed += main_rope_compress();
     failed += main_rope_tostring();
     failed += main_rope_substring();
+    failed += main_rope_balance();
+    failed += main_rope_chunk();
+    failed += main_rope_arena();
+    failed += main_rope_sharing();
+    failed += main_rope_iter();
+    failed += main_rope_split();
+    failed += main_rope_insert();
+    failed += main_rope_delete();
+    failed += main_rope_edit_random();
+    failed += main_rope_copy_range();
+    failed += main_rope_from_file();
+    failed += main_rope_find();
+    failed += main_rope_lines();
+    failed += main_rope_large();
+    failed += main_rope_parallel();
+    failed += main_rope_builder();
+    failed += main_rope_inline();
+    failed += main_rope_slice();
+    failed += main_rope_handle();
+    failed += main_rope_cp();
+    failed += main_rope_save();
     printf("%d tests failed\n", failed);
 }
\ No newline at end of file